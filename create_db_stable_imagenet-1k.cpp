@@ -7,7 +7,7 @@
  * Features:
  * - Loads images from class directories
  * - Resizes images to specified dimensions
- * - Saves processed dataset to a binary file
+ * - Streams processed dataset to a binary file
  * - Supports train/test splitting
  *
  * Author: Cydral
@@ -20,19 +20,69 @@
 #include <dlib/image_transforms.h>
 #include <dlib/matrix.h>
 #include <dlib/gui_widgets.h>
+#include <dlib/threads.h>
+#include <dlib/cmd_line_parser.h>
+#include <dlib/pipe.h>
+#include <dlib/hash.h>
+#include <dlib/cuda/tensor.h>
 #include <string>
 #include <vector>
+#include <array>
+#include <bitset>
 #include <map>
+#include <unordered_map>
+#include <condition_variable>
+#include <deque>
+#include <list>
 #include <algorithm>
 #include <random>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <iomanip>
 #include <csignal>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <exception>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <cstdio>
+#include <cstring>
 #ifdef _WIN32
 #include <windows.h>
+#include <psapi.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define IMAGENET_RESIZE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define IMAGENET_RESIZE_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define IMAGENET_RESIZE_NEON
+#endif
+#ifdef IMAGENET_ZLIB_SUPPORT
+#include <zlib.h>
+#endif
+#ifdef DLIB_JPEG_SUPPORT
+#include <csetjmp>
+#ifdef DLIB_JPEG_STATIC
+#include <dlib/external/libjpeg/jpeglib.h>
+#else
+#include <jpeglib.h>
+#endif
 #endif
 
 using namespace std;
@@ -87,16 +137,193 @@ namespace dlib
         std::string filename;       // Full path to the image file
         std::string label;         // Textual label (class description)
         unsigned long numeric_label; // Numeric label (class index)
+        std::string class_dir;     // Name of the class directory
+        uint64 file_size = 0;      // Size of the image file in bytes
+        int64 last_modified = 0;   // Modification time of the image file (ns since epoch)
+    };
+
+    /**
+     * Per-channel pixel statistics of a set of images
+     * Sums are kept as exact integers, so statistics of parts (images, classes,
+     * shards, merged files) add up to exactly those of the whole.
+     */
+    struct imagenet_channel_stats
+    {
+        uint64 images = 0;
+        uint64 pixels = 0;
+        uint64 sum[3] = { 0, 0, 0 };          // Sum of the R, G and B values
+        uint64 sum_squares[3] = { 0, 0, 0 };  // Sum of their squares
+
+        void add(const matrix<rgb_pixel>& img)
+        {
+            const unsigned char* p = img.size() != 0 ? reinterpret_cast<const unsigned char*>(&img(0, 0)) : nullptr;
+            uint64 s[3] = { 0, 0, 0 }, q[3] = { 0, 0, 0 };
+            for (long i = 0; i < img.size(); ++i, p += 3)
+            {
+                for (int c = 0; c < 3; ++c)
+                {
+                    s[c] += p[c];
+                    q[c] += static_cast<uint32>(p[c]) * p[c];
+                }
+            }
+            for (int c = 0; c < 3; ++c)
+            {
+                sum[c] += s[c];
+                sum_squares[c] += q[c];
+            }
+            pixels += static_cast<uint64>(img.size());
+            ++images;
+        }
+
+        void add(const imagenet_channel_stats& other)
+        {
+            images += other.images;
+            pixels += other.pixels;
+            for (int c = 0; c < 3; ++c)
+            {
+                sum[c] += other.sum[c];
+                sum_squares[c] += other.sum_squares[c];
+            }
+        }
+
+        /**
+         * @return Mean of channel c (0 = R, 1 = G, 2 = B), in [0, 255]
+         */
+        double mean(int c) const
+        {
+            return pixels != 0 ? static_cast<double>(sum[c]) / pixels : 0;
+        }
+
+        /**
+         * @return Standard deviation of channel c over all pixels
+         */
+        double stddev(int c) const
+        {
+            if (pixels == 0)
+                return 0;
+            const double m = mean(c);
+            return std::sqrt(std::max(0.0, static_cast<double>(sum_squares[c]) / pixels - m * m));
+        }
+    };
+
+    /**
+     * Pixel statistics of a dataset file, overall and per class (indexed by numeric
+     * label), as stored by the writers when every record was given its statistics
+     */
+    struct imagenet_dataset_stats
+    {
+        imagenet_channel_stats overall;
+        std::vector<imagenet_channel_stats> classes;
+
+        /**
+         * @return true if the file has no statistics (older file or writer)
+         */
+        bool empty() const { return overall.images == 0; }
+
+        void add(unsigned long numeric_label, const imagenet_channel_stats& stats)
+        {
+            if (numeric_label >= classes.size())
+                classes.resize(numeric_label + 1);
+            classes[numeric_label].add(stats);
+            overall.add(stats);
+        }
+
+        void add(const imagenet_dataset_stats& other)
+        {
+            for (size_t c = 0; c < other.classes.size(); ++c)
+            {
+                if (other.classes[c].images != 0)
+                    add(c, other.classes[c]);
+            }
+        }
     };
 
+    inline void serialize(const imagenet_channel_stats& item, std::ostream& out)
+    {
+        serialize(item.images, out);
+        serialize(item.pixels, out);
+        for (int c = 0; c < 3; ++c)
+        {
+            serialize(item.sum[c], out);
+            serialize(item.sum_squares[c], out);
+        }
+    }
+
+    inline void deserialize(imagenet_channel_stats& item, std::istream& in)
+    {
+        deserialize(item.images, in);
+        deserialize(item.pixels, in);
+        for (int c = 0; c < 3; ++c)
+        {
+            deserialize(item.sum[c], in);
+            deserialize(item.sum_squares[c], in);
+        }
+    }
+
+    inline void serialize(const imagenet_dataset_stats& item, std::ostream& out)
+    {
+        int version = 1;
+        serialize(version, out);
+        serialize(item.overall, out);
+        serialize(item.classes, out);
+    }
+
+    inline void deserialize(imagenet_dataset_stats& item, std::istream& in)
+    {
+        int version = 0;
+        deserialize(version, in);
+        if (version != 1)
+            throw serialization_error("Unexpected version found while deserializing dlib::imagenet_dataset_stats.");
+        deserialize(item.overall, in);
+        deserialize(item.classes, in);
+    }
+
     /**
      * Structure representing an ImageNet dataset
      */
     struct imagenet_dataset
     {
         std::vector<matrix<rgb_pixel>> images;  // Vector of image matrices
-        std::vector<std::string> labels;        // Vector of textual labels
-        std::vector<unsigned long> numeric_labels; // Vector of numeric labels
+        std::vector<std::string> class_names;   // Textual label of each class, indexed by numeric label
+        std::vector<uint16> numeric_labels;     // Numeric label of each image
+        imagenet_dataset_stats stats;           // Pixel statistics stored with the file (set by load_stable_imagenet_1k)
+
+        size_t size() const { return images.size(); }
+        const matrix<rgb_pixel>& image(size_t i) const { return images[i]; }
+        unsigned long numeric_label(size_t i) const { return numeric_labels[i]; }
+        const std::string& label(size_t i) const { return class_names[numeric_labels[i]]; }
+
+        /**
+         * @return The textual label of every image, as the labels member held before
+         *         the class-name table replaced it (builds a copy, prefer label(i))
+         */
+        std::vector<std::string> labels() const
+        {
+            std::vector<std::string> result;
+            result.reserve(numeric_labels.size());
+            for (uint16 l : numeric_labels)
+                result.push_back(class_names[l]);
+            return result;
+        }
+
+        /**
+         * Appends an image, recording the class name the first time a label is seen
+         */
+        void push_back(
+            matrix<rgb_pixel>&& img,
+            const std::string& label,
+            unsigned long numeric_label
+        )
+        {
+            if (numeric_label > std::numeric_limits<uint16>::max())
+                throw error("Numeric label " + std::to_string(numeric_label) + " does not fit the 16-bit label table");
+            if (numeric_label >= class_names.size())
+                class_names.resize(numeric_label + 1);
+            if (class_names[numeric_label].empty())
+                class_names[numeric_label] = label;
+            images.push_back(std::move(img));
+            numeric_labels.push_back(static_cast<uint16>(numeric_label));
+        }
     };
 
     /**
@@ -112,48 +339,585 @@ namespace dlib
         return dir_name.substr(underscore_pos + 1);
     }
 
+    namespace impl
+    {
+        /**
+         * Case-insensitive ".jpg" test on a raw file name, without building a string
+         */
+        inline bool has_jpg_extension(const char* name, size_t len)
+        {
+            return len > 4 && name[len - 4] == '.' &&
+                (name[len - 3] | 0x20) == 'j' &&
+                (name[len - 2] | 0x20) == 'p' &&
+                (name[len - 1] | 0x20) == 'g';
+        }
+
+#ifdef _WIN32
+        // FILETIME counts 100ns ticks since 1601-01-01
+        inline int64 filetime_to_ns(const FILETIME& ft)
+        {
+            const uint64 ticks = (static_cast<uint64>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+            return (static_cast<int64>(ticks) - 116444736000000000LL) * 100;
+        }
+#else
+        inline int64 stat_mtime_ns(const struct stat& st)
+        {
+#ifdef __APPLE__
+            return static_cast<int64>(st.st_mtimespec.tv_sec) * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+            return static_cast<int64>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+        }
+#endif
+
+        /**
+         * Modification time of a file or directory in ns since epoch, -1 if it does not exist
+         */
+        int64 path_last_modified(const std::string& path)
+        {
+#ifdef _WIN32
+            WIN32_FILE_ATTRIBUTE_DATA data;
+            if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data))
+                return -1;
+            return filetime_to_ns(data.ftLastWriteTime);
+#else
+            struct stat st;
+            if (::stat(path.c_str(), &st) != 0)
+                return -1;
+            return stat_mtime_ns(st);
+#endif
+        }
+
+        /**
+         * Reads the size and modification time (ns since epoch) of a regular file
+         *
+         * @return false if the file does not exist or is not a regular file
+         */
+        bool read_file_times(const std::string& path, uint64& file_size, int64& last_modified)
+        {
+#ifdef _WIN32
+            WIN32_FILE_ATTRIBUTE_DATA data;
+            if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data) ||
+                (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+                return false;
+            file_size = (static_cast<uint64>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+            last_modified = filetime_to_ns(data.ftLastWriteTime);
+#else
+            struct stat st;
+            if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+                return false;
+            file_size = static_cast<uint64>(st.st_size);
+            last_modified = stat_mtime_ns(st);
+#endif
+            return true;
+        }
+
+        /**
+         * Lists the JPG files of one class directory, sorted by file name
+         *
+         * Entries are read with the native directory API and only the ones with a
+         * JPG extension are stat'ed and turned into strings, which keeps the scan
+         * cheap on network file systems.
+         *
+         * @param dir Full path of the class directory
+         * @param temp Label fields shared by every image of the class
+         * @param results Receives one imagenet_info per image
+         */
+        void scan_class_directory(
+            const std::string& dir,
+            const imagenet_info& temp,
+            std::vector<imagenet_info>& results
+        )
+        {
+            results.clear();
+#ifdef _WIN32
+            WIN32_FIND_DATAA data;
+            HANDLE handle = FindFirstFileA((dir + "\\*").c_str(), &data);
+            if (handle == INVALID_HANDLE_VALUE)
+            {
+                if (GetLastError() == ERROR_FILE_NOT_FOUND)
+                    return;
+                throw error("Unable to open directory: " + dir);
+            }
+            do
+            {
+                if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+                    !has_jpg_extension(data.cFileName, std::strlen(data.cFileName)))
+                    continue;
+                results.push_back(temp);
+                auto& info = results.back();
+                info.filename = dir + "\\" + data.cFileName;
+                info.file_size = (static_cast<uint64>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+                info.last_modified = filetime_to_ns(data.ftLastWriteTime);
+            } while (FindNextFileA(handle, &data));
+            FindClose(handle);
+#else
+            std::unique_ptr<DIR, int (*)(DIR*)> handle(opendir(dir.c_str()), &closedir);
+            if (!handle)
+                throw error("Unable to open directory: " + dir);
+            const int dir_fd = dirfd(handle.get());
+            while (const dirent* entry = readdir(handle.get()))
+            {
+                if (!has_jpg_extension(entry->d_name, std::strlen(entry->d_name)))
+                    continue;
+                struct stat st;
+                if (::fstatat(dir_fd, entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+                    continue;
+                results.push_back(temp);
+                auto& info = results.back();
+                info.filename = dir + "/" + entry->d_name;
+                info.file_size = static_cast<uint64>(st.st_size);
+                info.last_modified = stat_mtime_ns(st);
+            }
+#endif
+            std::sort(results.begin(), results.end(),
+                [](const imagenet_info& a, const imagenet_info& b) {
+                    return a.filename < b.filename;
+                });
+        }
+    }
+
+    /**
+     * Scans the class directories of an image folder in the background, in parallel
+     *
+     * Classes are numbered in sorted directory name order and handed out in that
+     * order by next_class(), each one as soon as it has been listed, so a build can
+     * start decoding the first classes while the others are still being scanned.
+     * Directory listing is latency bound (especially over NFS), so more threads
+     * than cores is fine. Workers never list a class more than max_scanned_ahead
+     * classes past the last one delivered, which bounds the listings held in memory
+     * and lets classes that finish early wait in a fixed ring of that many slots.
+     */
+    class imagenet_listing_scanner
+    {
+    public:
+        static const size_t max_scanned_ahead = 64;
+
+        /**
+         * @param images_folder Root directory containing class subdirectories
+         * @param num_threads Number of directories listed concurrently (default 8)
+         */
+        explicit imagenet_listing_scanner(
+            const std::string& images_folder,
+            unsigned long num_threads = 8
+        ) : m_queue(max_scanned_ahead), m_pending(max_scanned_ahead), m_parked(max_scanned_ahead, 0)
+        {
+            // Taken before listing, so that a change during the scan shows up as a newer time
+            m_root_last_modified = impl::path_last_modified(images_folder);
+
+            // Get all subdirectories (each represents a class)
+            auto subdirs = directory(images_folder).get_dirs();
+
+            // Sort subdirectories to assign numeric labels in consistent order
+            std::sort(subdirs.begin(), subdirs.end(),
+                [](const directory& a, const directory& b) {
+                    return a.name() < b.name();
+                });
+
+            for (const auto& subdir : subdirs)
+                m_classes.emplace_back(subdir.full_name(), subdir.name());
+
+            const size_t workers = std::min<size_t>(std::max(1ul, num_threads), m_classes.size());
+            for (size_t i = 0; i < workers; ++i)
+                m_workers.emplace_back([this]() { worker_loop(); });
+        }
+
+        ~imagenet_listing_scanner()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_window_mutex);
+                m_stop.store(true);
+            }
+            m_window_signal.notify_all();
+            m_queue.disable();
+            for (auto& t : m_workers)
+                t.join();
+        }
+
+        imagenet_listing_scanner(const imagenet_listing_scanner&) = delete;
+        imagenet_listing_scanner& operator=(const imagenet_listing_scanner&) = delete;
+
+        size_t num_classes() const { return m_classes.size(); }
+        const std::string& class_dir(size_t i) const { return m_classes[i].second; }
+        int64 root_last_modified() const { return m_root_last_modified; }
+
+        /**
+         * Blocks until the next class (in numeric label order) has been listed
+         *
+         * @param images Receives the images of the class, sorted by file name
+         * @param dir_last_modified If not null, receives the modification time of the
+         *        class directory, taken before it was listed
+         * @return false once every class has been returned
+         */
+        bool next_class(
+            std::vector<imagenet_info>& images,
+            int64* dir_last_modified = nullptr
+        )
+        {
+            if (m_next_to_deliver >= m_classes.size())
+                return false;
+
+            // Directories finish out of order: park early ones in the slot of their id
+            const size_t slot = m_next_to_deliver % m_pending.size();
+            while (!m_parked[slot])
+            {
+                scanned_class c;
+                if (!m_queue.dequeue(c))
+                    throw dlib::error("imagenet_listing_scanner has been shut down");
+                if (c.error)
+                    std::rethrow_exception(c.error);
+                const size_t s = c.id % m_pending.size();
+                m_pending[s] = std::move(c);
+                m_parked[s] = 1;
+            }
+
+            scanned_class& c = m_pending[slot];
+            images.swap(c.images);
+            c.images.clear();
+            if (dir_last_modified)
+                *dir_last_modified = c.dir_last_modified;
+            m_parked[slot] = 0;
+            {
+                std::lock_guard<std::mutex> lock(m_window_mutex);
+                ++m_next_to_deliver;
+            }
+            m_window_signal.notify_all();
+            return true;
+        }
+
+    private:
+        struct scanned_class
+        {
+            size_t id = 0;
+            std::vector<imagenet_info> images;
+            int64 dir_last_modified = -1;
+            std::exception_ptr error;
+        };
+
+        /**
+         * Hands the next class to a worker once it fits in the ring of parked classes
+         *
+         * @return false when every class has been handed out or the scanner stops
+         */
+        bool next_class_id(size_t& id)
+        {
+            std::unique_lock<std::mutex> lock(m_window_mutex);
+            id = m_next_to_scan++;
+            if (id >= m_classes.size())
+                return false;
+            m_window_signal.wait(lock, [&]() { return m_stop.load() || id < m_next_to_deliver + m_pending.size(); });
+            return !m_stop.load();
+        }
+
+        void worker_loop()
+        {
+            while (!m_stop.load())
+            {
+                scanned_class c;
+                if (!next_class_id(c.id))
+                    return;
+                try
+                {
+                    imagenet_info temp;
+                    temp.numeric_label = static_cast<unsigned long>(c.id);
+                    temp.class_dir = m_classes[c.id].second;
+                    temp.label = extract_desc_class(temp.class_dir);
+                    c.dir_last_modified = impl::path_last_modified(m_classes[c.id].first);
+                    impl::scan_class_directory(m_classes[c.id].first, temp, c.images);
+                }
+                catch (...)
+                {
+                    c.error = std::current_exception();
+                }
+
+                if (!m_queue.enqueue(c))
+                    return;
+            }
+        }
+
+        std::vector<std::pair<std::string, std::string>> m_classes; // (full path, directory name)
+        int64 m_root_last_modified = -1;
+        dlib::pipe<scanned_class> m_queue;
+        std::vector<scanned_class> m_pending;   // Classes listed early, in slot id % max_scanned_ahead
+        std::vector<char> m_parked;
+        std::mutex m_window_mutex;
+        std::condition_variable m_window_signal;
+        size_t m_next_to_scan = 0;              // Guarded by m_window_mutex
+        size_t m_next_to_deliver = 0;           // Guarded by m_window_mutex, only changed by next_class()
+        std::atomic<bool> m_stop{false};
+        std::vector<std::thread> m_workers;
+    };
+
     /**
      * Scans an image directory and creates a list of ImageNet images with their metadata
+     * Class directories are listed in parallel; the result is sorted by class, then
+     * by file name, whatever the number of threads.
      *
      * @param images_folder Root directory containing class subdirectories
+     * @param num_threads Number of directories listed concurrently (default 8)
      * @return Vector of imagenet_info structures for all found images
      */
     std::vector<imagenet_info> get_imagenet_listing(
-        const std::string& images_folder
+        const std::string& images_folder,
+        unsigned long num_threads = 8
     )
     {
-        std::vector<imagenet_info> results;
-        imagenet_info temp;
-        temp.numeric_label = 0;
+        std::vector<imagenet_info> results, images;
+        imagenet_listing_scanner scanner(images_folder, num_threads);
+        while (scanner.next_class(images))
+            results.insert(results.end(), std::make_move_iterator(images.begin()), std::make_move_iterator(images.end()));
+        return results;
+    }
+
+    namespace impl
+    {
+        /**
+         * Blends two source rows of the RGB resize: dest[i] = a[i] * (256 - w) + b[i] * w
+         * for n bytes, kept in 16 bits (at most 255 * 256)
+         */
+        inline void blend_rows_u8(
+            const unsigned char* a,
+            const unsigned char* b,
+            uint32 w,
+            uint16* dest,
+            long n
+        )
+        {
+            const uint32 w0 = 256 - w;
+            long i = 0;
+#if defined(IMAGENET_RESIZE_AVX2)
+            const __m256i vw0 = _mm256_set1_epi16(static_cast<short>(w0));
+            const __m256i vw1 = _mm256_set1_epi16(static_cast<short>(w));
+            for (; i + 16 <= n; i += 16)
+            {
+                const __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+                const __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i),
+                    _mm256_add_epi16(_mm256_mullo_epi16(va, vw0), _mm256_mullo_epi16(vb, vw1)));
+            }
+#elif defined(IMAGENET_RESIZE_SSE2)
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i vw0 = _mm_set1_epi16(static_cast<short>(w0));
+            const __m128i vw1 = _mm_set1_epi16(static_cast<short>(w));
+            for (; i + 16 <= n; i += 16)
+            {
+                const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+                const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_add_epi16(
+                    _mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), vw0),
+                    _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), vw1)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i + 8), _mm_add_epi16(
+                    _mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), vw0),
+                    _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), vw1)));
+            }
+#elif defined(IMAGENET_RESIZE_NEON)
+            const uint16x8_t vw0 = vdupq_n_u16(static_cast<uint16_t>(w0));
+            const uint16x8_t vw1 = vdupq_n_u16(static_cast<uint16_t>(w));
+            for (; i + 8 <= n; i += 8)
+            {
+                uint16x8_t v = vmulq_u16(vmovl_u8(vld1_u8(a + i)), vw0);
+                v = vmlaq_u16(v, vmovl_u8(vld1_u8(b + i)), vw1);
+                vst1q_u16(dest + i, v);
+            }
+#endif
+            for (; i < n; ++i)
+                dest[i] = static_cast<uint16>(a[i] * w0 + b[i] * w);
+        }
 
-        // Get all subdirectories (each represents a class)
-        auto subdirs = directory(images_folder).get_dirs();
+        /**
+         * Blends two rows of the RGB resize that were already interpolated
+         * horizontally (values scaled by 256):
+         * dest[i] = (a[i] * (256 - w) + b[i] * w) / 65536, rounded
+         */
+        inline void blend_rows_u16(
+            const uint16* a,
+            const uint16* b,
+            uint32 w,
+            unsigned char* dest,
+            long n
+        )
+        {
+            const uint32 w0 = 256 - w;
+            long i = 0;
+#if defined(IMAGENET_RESIZE_AVX2)
+            const __m256i vw0 = _mm256_set1_epi16(static_cast<short>(w0));
+            const __m256i vw1 = _mm256_set1_epi16(static_cast<short>(w));
+            const __m256i half = _mm256_set1_epi32(32768);
+            auto blend16 = [&](const uint16* pa, const uint16* pb) {
+                const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pa));
+                const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pb));
+                const __m256i alo = _mm256_mullo_epi16(va, vw0), ahi = _mm256_mulhi_epu16(va, vw0);
+                const __m256i blo = _mm256_mullo_epi16(vb, vw1), bhi = _mm256_mulhi_epu16(vb, vw1);
+                const __m256i s0 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(
+                    _mm256_unpacklo_epi16(alo, ahi), _mm256_unpacklo_epi16(blo, bhi)), half), 16);
+                const __m256i s1 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(
+                    _mm256_unpackhi_epi16(alo, ahi), _mm256_unpackhi_epi16(blo, bhi)), half), 16);
+                return _mm256_packs_epi32(s0, s1);
+            };
+            for (; i + 32 <= n; i += 32)
+            {
+                const __m256i packed = _mm256_packus_epi16(blend16(a + i, b + i), blend16(a + i + 16, b + i + 16));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i), _mm256_permute4x64_epi64(packed, 0xD8));
+            }
+#elif defined(IMAGENET_RESIZE_SSE2)
+            const __m128i vw0 = _mm_set1_epi16(static_cast<short>(w0));
+            const __m128i vw1 = _mm_set1_epi16(static_cast<short>(w));
+            const __m128i half = _mm_set1_epi32(32768);
+            auto blend8 = [&](const uint16* pa, const uint16* pb) {
+                const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pa));
+                const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb));
+                const __m128i alo = _mm_mullo_epi16(va, vw0), ahi = _mm_mulhi_epu16(va, vw0);
+                const __m128i blo = _mm_mullo_epi16(vb, vw1), bhi = _mm_mulhi_epu16(vb, vw1);
+                const __m128i s0 = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(
+                    _mm_unpacklo_epi16(alo, ahi), _mm_unpacklo_epi16(blo, bhi)), half), 16);
+                const __m128i s1 = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(
+                    _mm_unpackhi_epi16(alo, ahi), _mm_unpackhi_epi16(blo, bhi)), half), 16);
+                return _mm_packs_epi32(s0, s1);
+            };
+            for (; i + 16 <= n; i += 16)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i),
+                    _mm_packus_epi16(blend8(a + i, b + i), blend8(a + i + 8, b + i + 8)));
+            }
+#elif defined(IMAGENET_RESIZE_NEON)
+            const uint16x4_t vw0 = vdup_n_u16(static_cast<uint16_t>(w0));
+            const uint16x4_t vw1 = vdup_n_u16(static_cast<uint16_t>(w));
+            for (; i + 8 <= n; i += 8)
+            {
+                const uint16x8_t va = vld1q_u16(a + i), vb = vld1q_u16(b + i);
+                const uint32x4_t lo = vmlal_u16(vmull_u16(vget_low_u16(va), vw0), vget_low_u16(vb), vw1);
+                const uint32x4_t hi = vmlal_u16(vmull_u16(vget_high_u16(va), vw0), vget_high_u16(vb), vw1);
+                vst1_u8(dest + i, vqmovn_u16(vcombine_u16(vrshrn_n_u32(lo, 16), vrshrn_n_u32(hi, 16))));
+            }
+#endif
+            for (; i < n; ++i)
+                dest[i] = static_cast<unsigned char>((a[i] * w0 + b[i] * w + 32768) >> 16);
+        }
+    }
 
-        // Sort subdirectories to assign numeric labels in consistent order
-        std::sort(subdirs.begin(), subdirs.end(),
-            [](const directory& a, const directory& b) {
-                return a.name() < b.name();
-            });
+    /**
+     * Bilinear resize of an interleaved 8-bit RGB image, written straight into dest
+     *
+     * Uses the same sample positions as dlib's resize_image() with
+     * interpolate_bilinear (corners mapped onto corners, edges clamped) but with
+     * 8-bit fixed point weights. The row blends are vectorized with AVX2, SSE2 or
+     * NEON depending on the target (scalar otherwise) and the horizontal
+     * interpolation uses a precomputed column table. The order of the two passes
+     * is picked from their estimated cost: interpolating the needed source rows
+     * horizontally first only touches the output columns, which wins for large
+     * horizontal reductions, while blending full source rows first keeps most of
+     * the work vectorized.
+     *
+     * @param src Source image, must not be empty
+     * @param dest Destination image, already set to the output size
+     */
+    void resize_rgb_image_bilinear(
+        const matrix<rgb_pixel>& src,
+        matrix<rgb_pixel>& dest
+    )
+    {
+        static_assert(sizeof(rgb_pixel) == 3, "rgb_pixel must be 3 packed bytes");
+        DLIB_CASSERT(src.size() != 0 && dest.size() != 0 && &src != &dest,
+            "resize_rgb_image_bilinear: invalid images");
+
+        const long src_nr = src.nr(), src_nc = src.nc();
+        const long dest_nr = dest.nr(), dest_nc = dest.nc();
+        const double x_scale = (src_nc - 1) / static_cast<double>(std::max<long>(dest_nc - 1, 1));
+        const double y_scale = (src_nr - 1) / static_cast<double>(std::max<long>(dest_nr - 1, 1));
 
-        // Process each class directory
-        for (auto subdir : subdirs)
+        // Per output column: offset of the left source pixel, step to the right one, weight
+        std::vector<long> x_offset(dest_nc);
+        std::vector<long> x_step(dest_nc);
+        std::vector<uint32> x_weight(dest_nc);
+        for (long c = 0; c < dest_nc; ++c)
         {
-            temp.label = extract_desc_class(subdir.name());
+            const double x = c * x_scale;
+            const long left = std::min<long>(static_cast<long>(x), src_nc - 1);
+            x_offset[c] = left * 3;
+            x_step[c] = left + 1 < src_nc ? 3 : 0;
+            x_weight[c] = static_cast<uint32>(std::lround((x - left) * 256));
+        }
+
+        const unsigned char* src_data = reinterpret_cast<const unsigned char*>(&src(0, 0));
+        unsigned char* dest_data = reinterpret_cast<unsigned char*>(&dest(0, 0));
+        const long src_stride = src_nc * 3;
+        const long dest_stride = dest_nc * 3;
 
-            // Process each image in the directory
-            for (auto image_file : subdir.get_files())
+        // Rough cost of each order, a vectorized blend counting as 1/8 of a scalar one
+        const long rows_needed = std::min(src_nr, 2 * dest_nr);
+        const long vertical_first_cost = dest_nr * src_stride / 8 + dest_nr * dest_stride;
+        const long horizontal_first_cost = rows_needed * dest_stride + dest_nr * dest_stride / 8;
+
+        if (vertical_first_cost < horizontal_first_cost)
+        {
+            std::vector<uint16> row(src_stride);
+            for (long r = 0; r < dest_nr; ++r)
             {
-                // Only process JPG files
-                if (image_file.name().size() > 4 &&
-                    tolower(image_file.name().substr(image_file.name().size() - 4)) == ".jpg")
+                const double y = r * y_scale;
+                const long top = std::min<long>(static_cast<long>(y), src_nr - 1);
+                const long bottom = std::min<long>(top + 1, src_nr - 1);
+                impl::blend_rows_u8(src_data + top * src_stride, src_data + bottom * src_stride,
+                    static_cast<uint32>(std::lround((y - top) * 256)), row.data(), src_stride);
+
+                unsigned char* out = dest_data + r * dest_stride;
+                for (long c = 0; c < dest_nc; ++c, out += 3)
                 {
-                    temp.filename = image_file;
-                    results.push_back(temp);
+                    const uint16* p = row.data() + x_offset[c];
+                    const uint16* q = p + x_step[c];
+                    const uint32 w1 = x_weight[c], w0 = 256 - w1;
+                    out[0] = static_cast<unsigned char>((p[0] * w0 + q[0] * w1 + 32768) >> 16);
+                    out[1] = static_cast<unsigned char>((p[1] * w0 + q[1] * w1 + 32768) >> 16);
+                    out[2] = static_cast<unsigned char>((p[2] * w0 + q[2] * w1 + 32768) >> 16);
                 }
             }
-            ++temp.numeric_label;
+            return;
+        }
+
+        auto interpolate_row = [&](long src_row, uint16* out) {
+            const unsigned char* in = src_data + src_row * src_stride;
+            for (long c = 0; c < dest_nc; ++c, out += 3)
+            {
+                const unsigned char* p = in + x_offset[c];
+                const unsigned char* q = p + x_step[c];
+                const uint32 w1 = x_weight[c], w0 = 256 - w1;
+                out[0] = static_cast<uint16>(p[0] * w0 + q[0] * w1);
+                out[1] = static_cast<uint16>(p[1] * w0 + q[1] * w1);
+                out[2] = static_cast<uint16>(p[2] * w0 + q[2] * w1);
+            }
+        };
+
+        // The two source rows of the current output row, interpolated horizontally
+        std::vector<uint16> top_buf(dest_stride), bottom_buf(dest_stride);
+        long top_row = -1, bottom_row = -1;
+
+        for (long r = 0; r < dest_nr; ++r)
+        {
+            const double y = r * y_scale;
+            const long top = std::min<long>(static_cast<long>(y), src_nr - 1);
+            const long bottom = std::min<long>(top + 1, src_nr - 1);
+
+            if (top == bottom_row)
+            {
+                top_buf.swap(bottom_buf);
+                std::swap(top_row, bottom_row);
+            }
+            if (top != top_row)
+            {
+                interpolate_row(top, top_buf.data());
+                top_row = top;
+            }
+            if (bottom != bottom_row)
+            {
+                if (bottom == top)
+                    bottom_buf = top_buf;
+                else
+                    interpolate_row(bottom, bottom_buf.data());
+                bottom_row = bottom;
+            }
+
+            impl::blend_rows_u16(top_buf.data(), bottom_buf.data(),
+                static_cast<uint32>(std::lround((y - top) * 256)), dest_data + r * dest_stride, dest_stride);
         }
-        return results;
     }
 
     /**
@@ -178,205 +942,7665 @@ namespace dlib
         {
             matrix<rgb_pixel> resized(rows, cols);
             resize_image(img, resized, interpolate_bilinear());
-            assign_image(img, resized);
+            return resized;
         }
 
         return img;
     }
 
-    /**
-     * Creates an ImageNet dataset from a directory of images
-     *
-     * @param images_folder Root directory containing class subdirectories
-     * @param output_file Path to save the processed dataset
-     * @param resize_rows Height for resizing images (default 224)
-     * @param resize_cols Width for resizing images (default 224)
-     */
-    void create_imagenet_dataset(
-        const std::string& images_folder,
-        const std::string& output_file,
-        long resize_rows = 224,
-        long resize_cols = 224
-    )
+    namespace impl
     {
-        std::cout << "Scanning image directory..." << std::endl;
-        auto image_listing = get_imagenet_listing(images_folder);
-        std::cout << "Total images found: " << image_listing.size() << std::endl;
+        /**
+         * @return Size of a file in bytes (0 if it cannot be opened)
+         */
+        inline uint64 file_size_bytes(const std::string& filename)
+        {
+            std::ifstream in(filename, std::ios::binary | std::ios::ate);
+            return in ? static_cast<uint64>(in.tellg()) : 0;
+        }
 
-        if (image_listing.empty())
-            throw dlib::error("No images found in directory: " + images_folder);
+        /**
+         * Reads a whole file into memory
+         */
+        std::vector<unsigned char> read_file_bytes(const std::string& filename)
+        {
+            std::ifstream in(filename, std::ios::binary);
+            if (!in)
+                throw error("Unable to open " + filename);
+            in.seekg(0, std::ios::end);
+            std::vector<unsigned char> data(static_cast<size_t>(in.tellg()));
+            in.seekg(0, std::ios::beg);
+            if (!data.empty() && !in.read(reinterpret_cast<char*>(data.data()), data.size()))
+                throw error("Unable to read " + filename);
+            return data;
+        }
 
-        imagenet_dataset dataset;
+#ifdef DLIB_JPEG_SUPPORT
+        // libjpeg reports fatal errors through error_exit, which must not return
+        struct jpeg_error_state
+        {
+            jpeg_error_mgr mgr;
+            std::jmp_buf jump;
+            char message[JMSG_LENGTH_MAX];
+        };
+
+        void jpeg_error_exit(j_common_ptr cinfo)
+        {
+            jpeg_error_state* state = reinterpret_cast<jpeg_error_state*>(cinfo->err);
+            (*cinfo->err->format_message)(cinfo, state->message);
+            std::longjmp(state->jump, 1);
+        }
 
-        std::cout << "Loading and processing images..." << std::endl;
-        dataset.images.reserve(image_listing.size());
-        dataset.labels.reserve(image_listing.size());
-        dataset.numeric_labels.reserve(image_listing.size());
+        // Warnings (e.g. premature end of data) are not fatal, keep the console quiet
+        void jpeg_output_message(j_common_ptr) {}
 
-        for (size_t i = 0; i < image_listing.size() && !g_terminate_flag.load(); ++i)
+        /**
+         * Decodes an in-memory JPEG to RGB, letting libjpeg drop DCT coefficients so
+         * that the image comes out at 1/2, 1/4 or 1/8 of its size whenever that is
+         * still at least min_rows x min_cols
+         *
+         * No object with a destructor may be created between setjmp and the end of
+         * the decode, the error path jumps over them.
+         *
+         * @return false if libjpeg failed, with its message in err_msg
+         */
+        bool decode_jpeg_scaled(
+            const unsigned char* data,
+            size_t size,
+            long min_rows,
+            long min_cols,
+            matrix<rgb_pixel>& img,
+            std::string& err_msg
+        )
         {
-            try
+            jpeg_decompress_struct cinfo;
+            jpeg_error_state err;
+            cinfo.err = jpeg_std_error(&err.mgr);
+            err.mgr.error_exit = jpeg_error_exit;
+            err.mgr.output_message = jpeg_output_message;
+
+            if (setjmp(err.jump))
             {
-                const auto& info = image_listing[i];
-                matrix<rgb_pixel> img = load_and_resize_image(info.filename, resize_rows, resize_cols);
-                dataset.images.push_back(std::move(img));
-                dataset.labels.push_back(info.label);
-                dataset.numeric_labels.push_back(info.numeric_label);
+                jpeg_destroy_decompress(&cinfo);
+                err_msg = err.message;
+                return false;
+            }
 
-                // Print progress every 1000 images
-                if ((i + 1) % 1000 == 0 || i == image_listing.size() - 1)
-                {
-                    std::cout << "Progress: " << (i + 1) << "/" << image_listing.size()
-                        << " images processed" << std::endl;
-                }
+            jpeg_create_decompress(&cinfo);
+            jpeg_mem_src(&cinfo, const_cast<unsigned char*>(data), static_cast<unsigned long>(size));
+            jpeg_read_header(&cinfo, TRUE);
+            cinfo.out_color_space = JCS_RGB;
+
+            // Largest reduction that does not go below the requested size
+            cinfo.scale_num = 1;
+            for (unsigned int denom = 8; denom >= 1; denom /= 2)
+            {
+                cinfo.scale_denom = denom;
+                jpeg_calc_output_dimensions(&cinfo);
+                if (denom == 1 ||
+                    (static_cast<long>(cinfo.output_height) >= min_rows &&
+                     static_cast<long>(cinfo.output_width) >= min_cols))
+                    break;
             }
-            catch (const std::exception& e)
+
+            jpeg_start_decompress(&cinfo);
+            img.set_size(cinfo.output_height, cinfo.output_width);
+            while (cinfo.output_scanline < cinfo.output_height)
+            {
+                JSAMPROW row = reinterpret_cast<JSAMPROW>(&img(cinfo.output_scanline, 0));
+                jpeg_read_scanlines(&cinfo, &row, 1);
+            }
+            jpeg_finish_decompress(&cinfo);
+            jpeg_destroy_decompress(&cinfo);
+            return true;
+        }
+#endif
+
+        /**
+         * @return true if the first bytes of a file (at least 8 when it is that long)
+         *         show a format decode_image_from_memory() handles: JPEG with
+         *         DLIB_JPEG_SUPPORT, PNG with DLIB_PNG_SUPPORT
+         */
+        inline bool decodes_from_memory(const unsigned char* data, size_t size)
+        {
+#ifdef DLIB_JPEG_SUPPORT
+            if (size > 2 && data[0] == 0xFF && data[1] == 0xD8)
+                return true;
+#endif
+#ifdef DLIB_PNG_SUPPORT
+            if (size >= 8 && std::memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0)
+                return true;
+#endif
+            return false;
+        }
+
+        /**
+         * Decodes an image held in memory, JPEG files at the reduced scale of
+         * decode_jpeg_scaled() when that still covers min_rows x min_cols
+         * JPEG files the scaled decoder rejects (e.g. CMYK) go through dlib's own
+         * decoder, still from memory.
+         *
+         * @return false if the format cannot be decoded from memory (see
+         *         decodes_from_memory); the caller then loads the file with load_image()
+         */
+        bool decode_image_from_memory(
+            const unsigned char* data,
+            size_t size,
+            long min_rows,
+            long min_cols,
+            matrix<rgb_pixel>& img
+        )
+        {
+            if (!decodes_from_memory(data, size))
+                return false;
+#ifdef DLIB_JPEG_SUPPORT
+            if (data[0] == 0xFF)
             {
-                std::cerr << "Error processing image " << image_listing[i].filename
-                    << ": " << e.what() << std::endl;
+                std::string err_msg;
+                if (!decode_jpeg_scaled(data, size, min_rows, min_cols, img, err_msg))
+                    load_jpeg(img, data, size);
+                return true;
             }
+#endif
+#ifdef DLIB_PNG_SUPPORT
+            load_png(img, data, size);
+#endif
+            return true;
         }
 
-        std::cout << "Saving dataset to: " << output_file << std::endl;
-        serialize(output_file) << dataset.images << dataset.labels << dataset.numeric_labels;
-        std::cout << "Dataset saved successfully!" << std::endl;
+        /**
+         * Reads an image file into memory when decode_image_from_memory() can decode
+         * it, judging from its first bytes; other files are left to load_image(),
+         * so that no file is read twice
+         *
+         * @param data Receives the file contents, or stays empty
+         * @return false if the file must be loaded with load_image()
+         */
+        bool read_image_file(const std::string& filename, std::vector<unsigned char>& data)
+        {
+            data.clear();
+            std::ifstream in(filename, std::ios::binary);
+            if (!in)
+                throw error("Unable to open " + filename);
+            in.seekg(0, std::ios::end);
+            const size_t size = static_cast<size_t>(in.tellg());
+            in.seekg(0, std::ios::beg);
+            unsigned char header[8] = {};
+            const size_t header_size = std::min(size, sizeof(header));
+            if (!in.read(reinterpret_cast<char*>(header), header_size))
+                throw error("Unable to read " + filename);
+            if (!decodes_from_memory(header, header_size))
+                return false;
+            data.resize(size);
+            std::memcpy(data.data(), header, header_size);
+            if (size > header_size && !in.read(reinterpret_cast<char*>(data.data() + header_size), size - header_size))
+                throw error("Unable to read " + filename);
+            return true;
+        }
     }
 
     /**
-     * Loads a preprocessed ImageNet dataset and splits it into training and testing sets
+     * Loads an image, decoding JPEG files at a reduced scale when possible
      *
-     * @param dataset_file Path to the saved dataset file
-     * @param training_images Output vector for training images
-     * @param training_labels Output vector for training labels
-     * @param testing_images Output vector for testing images
-     * @param testing_labels Output vector for testing labels
-     * @param test_fraction Fraction of data to use for testing (default 0.05)
+     * JPEG files are decoded with libjpeg's DCT-domain scaling at the smallest of
+     * 1/8, 1/4, 1/2 or 1/1 that still covers min_rows x min_cols, which skips most
+     * of the IDCT and color conversion work for large photos. Files libjpeg cannot
+     * decode to RGB (e.g. CMYK) are decoded at full resolution, and formats that
+     * cannot be decoded from memory (see impl::decodes_from_memory) go through
+     * load_image(). Either way the file is read once.
+     *
+     * @param img Output image
+     * @param filename Path to the image file
+     * @param min_rows Minimum height of the decoded image
+     * @param min_cols Minimum width of the decoded image
+     */
+    void load_image_scaled(
+        matrix<rgb_pixel>& img,
+        const std::string& filename,
+        long min_rows,
+        long min_cols
+    )
+    {
+        std::vector<unsigned char> data;
+        if (!impl::read_image_file(filename, data) ||
+            !impl::decode_image_from_memory(data.data(), data.size(), min_rows, min_cols, img))
+            load_image(img, filename);
+    }
+
+    namespace impl
+    {
+        /**
+         * Escapes a string for use inside a JSON string literal
+         */
+        inline std::string json_escape(const std::string& s)
+        {
+            std::string out;
+            out.reserve(s.size());
+            for (const char ch : s)
+            {
+                switch (ch)
+                {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(ch) < 0x20)
+                    {
+                        char buf[8];
+                        std::snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned int>(ch));
+                        out += buf;
+                    }
+                    else
+                        out += ch;
+                }
+            }
+            return out;
+        }
+    }
+
+    /**
+     * Per-stage timing of a dataset build
+     *
+     * Worker threads report the time each image spends in each stage (file read,
+     * wait for a prefetched file, decode, resize, write). Every report is a handful of relaxed atomic updates:
+     * a count, a total, a byte count and one bucket of a latency histogram whose
+     * buckets are 1/8 of an octave wide, so percentiles are within about 6%.
+     * The slowest images of the build are kept to help find pathological files.
+     */
+    class imagenet_build_stats
+    {
+    public:
+        enum stage_type
+        {
+            read_stage,
+            wait_stage,     // Decode threads waiting for prefetched bytes
+            decode_stage,
+            resize_stage,
+            write_stage,
+            num_stages
+        };
+
+        struct stage_summary
+        {
+            uint64 count = 0;
+            uint64 bytes = 0;
+            double seconds = 0; // Summed over all threads
+            double p50_ms = 0;
+            double p99_ms = 0;
+            double max_ms = 0;
+        };
+
+        imagenet_build_stats() : m_start(std::chrono::steady_clock::now())
+        {
+            for (auto& s : m_stages)
+            {
+                s.count.store(0);
+                s.bytes.store(0);
+                s.total_ns.store(0);
+                s.max_ns.store(0);
+                for (auto& b : s.buckets)
+                    b.store(0);
+            }
+        }
+
+        imagenet_build_stats(const imagenet_build_stats&) = delete;
+        imagenet_build_stats& operator=(const imagenet_build_stats&) = delete;
+
+        static const char* stage_name(stage_type s)
+        {
+            static const char* const names[num_stages] = { "read", "wait", "decode", "resize", "write" };
+            return names[s];
+        }
+
+        /**
+         * Records the time one image spent in a stage
+         */
+        void record(stage_type s, std::chrono::steady_clock::duration elapsed, uint64 bytes = 0)
+        {
+            const uint64 ns = static_cast<uint64>(std::max<int64>(0,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+            auto& st = m_stages[s];
+            st.count.fetch_add(1, std::memory_order_relaxed);
+            st.bytes.fetch_add(bytes, std::memory_order_relaxed);
+            st.total_ns.fetch_add(ns, std::memory_order_relaxed);
+            st.buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+            uint64 prev = st.max_ns.load(std::memory_order_relaxed);
+            while (ns > prev && !st.max_ns.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+        }
+
+        /**
+         * Records the total time spent on one image, keeping the slowest ones
+         */
+        void record_image(const std::string& filename, std::chrono::steady_clock::duration elapsed)
+        {
+            const double ms = std::chrono::duration<double, std::milli>(elapsed).count();
+            if (m_slowest_full.load(std::memory_order_relaxed) && ms <= m_slowest_min_ms.load(std::memory_order_relaxed))
+                return;
+            std::lock_guard<std::mutex> lock(m_slowest_mutex);
+            m_slowest.emplace_back(ms, filename);
+            std::sort(m_slowest.begin(), m_slowest.end(), std::greater<std::pair<double, std::string>>());
+            if (m_slowest.size() > max_slowest)
+                m_slowest.resize(max_slowest);
+            m_slowest_full.store(m_slowest.size() == max_slowest);
+            m_slowest_min_ms.store(m_slowest.back().first);
+        }
+
+        void record_failure() { m_failed.fetch_add(1, std::memory_order_relaxed); }
+
+        /**
+         * Records the number of listed images waiting to be processed
+         */
+        void set_backlog(size_t images)
+        {
+            m_backlog.store(images, std::memory_order_relaxed);
+            size_t prev = m_max_backlog.load(std::memory_order_relaxed);
+            while (images > prev && !m_max_backlog.compare_exchange_weak(prev, images, std::memory_order_relaxed)) {}
+        }
+
+        stage_summary summary(stage_type s) const
+        {
+            const auto& st = m_stages[s];
+            stage_summary result;
+            result.count = st.count.load();
+            result.bytes = st.bytes.load();
+            result.seconds = st.total_ns.load() * 1e-9;
+            result.max_ms = st.max_ns.load() * 1e-6;
+            result.p50_ms = std::min(result.max_ms, percentile(st, 0.50) * 1e-6);
+            result.p99_ms = std::min(result.max_ms, percentile(st, 0.99) * 1e-6);
+            return result;
+        }
+
+        double elapsed_seconds() const
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+        }
+
+        /**
+         * Prints one line per stage that has seen at least one image: its share of
+         * the time spent in all stages and its per-image latencies, then the overall
+         * throughput and the backlog
+         */
+        void print(std::ostream& out) const
+        {
+            const double elapsed = elapsed_seconds();
+            stage_summary sums[num_stages];
+            double busy = 0;
+            for (int s = 0; s < num_stages; ++s)
+            {
+                sums[s] = summary(static_cast<stage_type>(s));
+                busy += sums[s].seconds;
+            }
+
+            const auto flags = out.flags();
+            const auto precision = out.precision();
+            out << std::fixed;
+            for (int s = 0; s < num_stages; ++s)
+            {
+                const stage_summary& sum = sums[s];
+                if (sum.count == 0)
+                    continue;
+                out << "  " << std::left << std::setw(7) << stage_name(static_cast<stage_type>(s)) << std::right
+                    << std::setw(9) << sum.count << " img"
+                    << std::setprecision(1) << std::setw(7) << (busy > 0 ? 100 * sum.seconds / busy : 0) << "%"
+                    << "  p50 " << std::setprecision(2) << std::setw(8) << sum.p50_ms << " ms"
+                    << "  p99 " << std::setw(8) << sum.p99_ms << " ms"
+                    << "  max " << std::setw(8) << sum.max_ms << " ms";
+                if (sum.bytes != 0)
+                    out << "  " << std::setprecision(1) << (elapsed > 0 ? sum.bytes / elapsed / (1024.0 * 1024.0) : 0) << " MB/s";
+                out << std::endl;
+            }
+            out << "  " << std::setprecision(1) << (elapsed > 0 ? sums[decode_stage].count / elapsed : 0)
+                << " images/s, backlog " << m_backlog.load() << " images (max " << m_max_backlog.load() << ")";
+            if (m_failed.load() != 0)
+                out << ", " << m_failed.load() << " failed";
+            out << std::endl;
+            out.flags(flags);
+            out.precision(precision);
+        }
+
+        /**
+         * Writes every counter, the percentiles and the slowest images as JSON
+         */
+        void save_json(const std::string& filename) const
+        {
+            std::ofstream out(filename);
+            if (!out)
+                throw dlib::error("Unable to write stats file: " + filename);
+            out << "{\n  \"elapsed_seconds\": " << elapsed_seconds() << ",\n";
+            out << "  \"failed_images\": " << m_failed.load() << ",\n";
+            out << "  \"max_backlog\": " << m_max_backlog.load() << ",\n";
+            out << "  \"stages\": {\n";
+            for (int s = 0; s < num_stages; ++s)
+            {
+                const stage_summary sum = summary(static_cast<stage_type>(s));
+                out << "    \"" << stage_name(static_cast<stage_type>(s)) << "\": { \"count\": " << sum.count
+                    << ", \"bytes\": " << sum.bytes << ", \"seconds\": " << sum.seconds
+                    << ", \"p50_ms\": " << sum.p50_ms << ", \"p99_ms\": " << sum.p99_ms
+                    << ", \"max_ms\": " << sum.max_ms << " }" << (s + 1 < num_stages ? "," : "") << "\n";
+            }
+            out << "  },\n  \"slowest_images\": [\n";
+            std::lock_guard<std::mutex> lock(m_slowest_mutex);
+            for (size_t i = 0; i < m_slowest.size(); ++i)
+            {
+                out << "    { \"file\": \"" << impl::json_escape(m_slowest[i].second) << "\", \"ms\": "
+                    << m_slowest[i].first << " }" << (i + 1 < m_slowest.size() ? "," : "") << "\n";
+            }
+            out << "  ]\n}\n";
+            if (!out)
+                throw dlib::error("Error while writing stats file: " + filename);
+        }
+
+    private:
+        static const size_t num_buckets = 512;
+        static const size_t max_slowest = 10;
+
+        struct stage_counters
+        {
+            std::atomic<uint64> count;
+            std::atomic<uint64> bytes;
+            std::atomic<uint64> total_ns;
+            std::atomic<uint64> max_ns;
+            std::atomic<uint64> buckets[num_buckets];
+        };
+
+        // Values below 8 ns get their own bucket, then each octave is cut in 8
+        static size_t bucket_of(uint64 ns)
+        {
+            if (ns < 8)
+                return static_cast<size_t>(ns);
+            unsigned e = 3;
+            while ((ns >> (e + 1)) != 0)
+                ++e;
+            return (e - 2) * 8 + static_cast<size_t>((ns >> (e - 3)) & 7);
+        }
+
+        static double bucket_middle(size_t b)
+        {
+            if (b < 8)
+                return static_cast<double>(b);
+            const unsigned e = static_cast<unsigned>(b / 8 + 2);
+            return (8 + (b % 8) + 0.5) * std::ldexp(1.0, static_cast<int>(e) - 3);
+        }
+
+        static double percentile(const stage_counters& st, double q)
+        {
+            uint64 total = 0;
+            for (const auto& b : st.buckets)
+                total += b.load(std::memory_order_relaxed);
+            if (total == 0)
+                return 0;
+            const uint64 rank = static_cast<uint64>(std::ceil(q * total));
+            uint64 seen = 0;
+            for (size_t b = 0; b < num_buckets; ++b)
+            {
+                seen += st.buckets[b].load(std::memory_order_relaxed);
+                if (seen >= rank)
+                    return bucket_middle(b);
+            }
+            return bucket_middle(num_buckets - 1);
+        }
+
+        const std::chrono::steady_clock::time_point m_start;
+        stage_counters m_stages[num_stages];
+        std::atomic<uint64> m_failed{0};
+        std::atomic<size_t> m_backlog{0};
+        std::atomic<size_t> m_max_backlog{0};
+
+        mutable std::mutex m_slowest_mutex;
+        std::vector<std::pair<double, std::string>> m_slowest; // (ms, file), slowest first
+        std::atomic<bool> m_slowest_full{false};
+        std::atomic<double> m_slowest_min_ms{0};
+    };
+
+    /**
+     * Decodes an image already read into memory and produces one resized copy per
+     * requested size
+     *
+     * Sizes are produced from the largest to the smallest, each one being resized
+     * from the smallest already computed output that is at least as large in both
+     * dimensions (a resize pyramid), so the small sizes cost almost nothing compared
+     * to the decode. JPEG files (and PNG files with DLIB_PNG_SUPPORT) are decoded
+     * from data; other formats, which dlib only loads from files, are loaded from
+     * filename by load_image(), so data may be empty for them.
+     *
+     * @param data Contents of the image file
+     * @param filename Path to the image file
+     * @param sizes Requested output sizes as (rows, cols)
+     * @param jpeg_dct_scaling Decode JPEG files at a reduced scale that still covers
+     *        the largest size (see load_image_scaled)
+     * @param fixed_point_resize Resize with resize_rgb_image_bilinear() instead of
+     *        dlib's resize_image()
+     * @param stats If not null, receives the time spent decoding and resizing
+     * @return One matrix per entry of sizes, in the same order
+     */
+    std::vector<matrix<rgb_pixel>> load_and_resize_image(
+        const std::vector<unsigned char>& data,
+        const std::string& filename,
+        const std::vector<std::pair<long, long>>& sizes,
+        bool jpeg_dct_scaling = false,
+        bool fixed_point_resize = false,
+        imagenet_build_stats* stats = nullptr
+    )
+    {
+        using clock = std::chrono::steady_clock;
+        long min_rows = 0, min_cols = 0;
+        if (jpeg_dct_scaling)
+        {
+            for (const auto& size : sizes)
+            {
+                min_rows = std::max(min_rows, size.first);
+                min_cols = std::max(min_cols, size.second);
+            }
+        }
+        else
+        {
+            // Never reduce: full-resolution decode
+            min_rows = min_cols = std::numeric_limits<long>::max();
+        }
+
+        matrix<rgb_pixel> img;
+        auto start = clock::now();
+        if (!impl::decode_image_from_memory(data.data(), data.size(), min_rows, min_cols, img))
+            load_image(img, filename);
+        if (stats)
+            stats->record(imagenet_build_stats::decode_stage, clock::now() - start);
+        start = clock::now();
+
+        std::vector<size_t> order(sizes.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return sizes[a].first * sizes[a].second > sizes[b].first * sizes[b].second;
+        });
+
+        std::vector<matrix<rgb_pixel>> results(sizes.size());
+        std::vector<size_t> done;
+        for (size_t k : order)
+        {
+            const long rows = sizes[k].first, cols = sizes[k].second;
+
+            // Start from the smallest finished output that still covers this size
+            const matrix<rgb_pixel>* source = &img;
+            for (size_t d : done)
+            {
+                const auto& candidate = results[d];
+                if (candidate.nr() >= rows && candidate.nc() >= cols &&
+                    candidate.size() < source->size())
+                    source = &candidate;
+            }
+
+            if (source->nr() == rows && source->nc() == cols)
+            {
+                results[k] = *source;
+            }
+            else
+            {
+                results[k].set_size(rows, cols);
+                if (fixed_point_resize)
+                    resize_rgb_image_bilinear(*source, results[k]);
+                else
+                    resize_image(*source, results[k], interpolate_bilinear());
+            }
+            done.push_back(k);
+        }
+        if (stats)
+            stats->record(imagenet_build_stats::resize_stage, clock::now() - start);
+        return results;
+    }
+
+    /**
+     * Loads an image from disk once and produces one resized copy per requested size
+     * (see the overload above for the resize pyramid)
+     * Only files that can be decoded from memory are read up front; the others are
+     * read by load_image() alone (see impl::read_image_file).
+     *
+     * @param filename Path to the image file
+     * @param sizes Requested output sizes as (rows, cols)
+     * @param jpeg_dct_scaling Decode JPEG files at a reduced scale that still covers
+     *        the largest size (see load_image_scaled)
+     * @param fixed_point_resize Resize with resize_rgb_image_bilinear() instead of
+     *        dlib's resize_image()
+     * @param stats If not null, receives the time spent reading, decoding and resizing
+     * @return One matrix per entry of sizes, in the same order
+     */
+    std::vector<matrix<rgb_pixel>> load_and_resize_image(
+        const std::string& filename,
+        const std::vector<std::pair<long, long>>& sizes,
+        bool jpeg_dct_scaling = false,
+        bool fixed_point_resize = false,
+        imagenet_build_stats* stats = nullptr
+    )
+    {
+        // Read the file first so that I/O and decode are timed apart
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<unsigned char> data;
+        if (impl::read_image_file(filename, data) && stats)
+            stats->record(imagenet_build_stats::read_stage, std::chrono::steady_clock::now() - start, data.size());
+        return load_and_resize_image(data, filename, sizes, jpeg_dct_scaling, fixed_point_resize, stats);
+    }
+
+    /**
+     * On-disk layouts understood by the loaders
+     *
+     * - legacy: the three vectors of imagenet_dataset serialized one after the other
+     *   (format of the shipped 32x32 dataset)
+     * - stream: a magic header followed by one record per image, written as soon as
+     *   the image is processed, and an end marker holding the record count
+     * - fixed: a fixed-size header, a contiguous block of same-size images, a label
+     *   array and a class-name table; it can be memory-mapped for random access
+     * - compressed: a fixed-size header, then chunks of delta-filtered records each
+     *   deflated on its own (needs IMAGENET_ZLIB_SUPPORT), followed by the class and
+     *   chunk tables; readers inflate the chunks in parallel
+     */
+    enum class dataset_format
+    {
+        legacy,
+        stream,
+        fixed,
+        compressed
+    };
+
+    /**
+     * Pixel layout of a fixed-stride dataset
+     *
+     * planar stores each image as three channel planes (CHW) and planar_float as
+     * CHW float32 already normalized the way dlib's input_rgb_image layer does it,
+     * (value - channel mean) / 256, so batches can be copied into a tensor as is.
+     */
+    enum class pixel_layout : uint32
+    {
+        interleaved = 0,
+        planar = 1,
+        planar_float = 2
+    };
+
+    namespace impl
+    {
+        // Stream layout: magic, version, then tagged records up to the end tag and
+        // the record count. Version 1 records carry the label string of every image;
+        // version 2 records only a uint16 numeric label, the class name being sent
+        // once in a class record before the first image of that class.
+        // After the record count, version 2 writers append a class index (see
+        // class_index): the class names, the label, first record, count and byte
+        // offset of each run of same-class records, optionally the pixel statistics
+        // (imagenet_dataset_stats), then the uint64 offset of the index and
+        // stream_index_magic, little-endian. Readers stop at the end tag,
+        // so files with and without an index read the same.
+        const char stream_magic[8] = { 'D', 'L', 'I', 'B', 'I', 'N', 'S', 'T' };
+        const unsigned long stream_version = 2;
+        const char stream_record_tag = 'R';
+        const char stream_class_tag = 'C';
+        const char stream_end_tag = 'E';
+        const char stream_index_magic[8] = { 'D', 'L', 'I', 'B', 'I', 'N', 'C', 'I' };
+        const size_t stream_index_trailer_size = 16;
+
+        // Fixed-stride layout, all integers little-endian:
+        //   [0, 128)          header (see fixed_header)
+        //   [pixel_offset, +) num_images * rows * cols interleaved RGB pixels
+        //   [labels_offset,+) num_images uint32 numeric labels
+        //   [meta_offset, +)  dlib-serialized class names, indexed by numeric label,
+        //                     optionally followed by the pixel statistics
+        // Version 2 adds, after meta_size, a uint32 pixel_layout followed by the
+        // float32 channel means and scale used by planar_float (as IEEE bit patterns).
+        // Interleaved files are still written as version 1.
+        const char fixed_magic[8] = { 'D', 'L', 'I', 'B', 'I', 'N', 'F', 'X' };
+        const uint32 fixed_version = 1;
+        const uint32 fixed_layout_version = 2;
+
+        // Defaults of dlib's input_rgb_image layer
+        const float input_rgb_mean[3] = { 122.782f, 117.001f, 104.298f };
+        const float input_rgb_scale = 1.0f / 256;
+        const size_t fixed_header_size = 128;
+        const uint64 fixed_incomplete = ~uint64(0);
+
+        // Compressed layout:
+        //   [0, 24)  magic, uint32 version, uint32 images per chunk, uint64 offset of
+        //            the footer (little-endian, ~0 while incomplete)
+        //   chunks   zlib streams; once inflated, per image: uint32 rows, uint32 cols,
+        //            uint16 numeric label, then the RGB bytes with each byte minus
+        //            the same channel of the pixel on its left (PNG "sub" filter)
+        //   footer   dlib-serialized class names, then per chunk its offset,
+        //            compressed size, inflated size and number of images, then the
+        //            labels, first records and counts of the class index and the
+        //            pixel statistics (older files end before either)
+        const char compressed_magic[8] = { 'D', 'L', 'I', 'B', 'I', 'N', 'C', 'Z' };
+        const uint32 compressed_version = 1;
+        const size_t compressed_header_size = 24;
+        const size_t compressed_record_header_size = 10;
+        const unsigned long compressed_default_chunk = 256;
+        const uint64 deflate_max_ratio = 1032; // Largest expansion of a deflate stream
+
+        /**
+         * @return true if rows x cols RGB bytes fit in available bytes; the sizes come
+         *         from the file, so their product is never computed before this check
+         */
+        inline bool compressed_record_fits(size_t available, size_t rows, size_t cols)
+        {
+            return cols <= available / 3 && (cols == 0 || rows <= available / (cols * 3));
+        }
+
+        static_assert(sizeof(rgb_pixel) == 3, "rgb_pixel must be tightly packed");
+
+        inline std::string file_name_part(const std::string& path)
+        {
+            return path.substr(path.find_last_of("/\\") + 1);
+        }
+
+        /**
+         * Moves a finished file to its final name, atomically replacing any file
+         * already there (on failure the old file is left untouched)
+         */
+        void publish_file(const std::string& from, const std::string& to)
+        {
+#ifdef _WIN32
+            const bool moved = MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+            const bool moved = std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+            if (!moved)
+                throw dlib::error("Unable to rename " + from + " to " + to);
+        }
+
+        /**
+         * Output file stream that writes to "<filename>.partial"
+         * commit() closes the stream and renames the file to its final name; if the
+         * stream is destroyed before that, the partial file is deleted. A reader can
+         * therefore never see a half-written file under the final name.
+         */
+        class partial_ofstream : public std::ofstream
+        {
+        public:
+            explicit partial_ofstream(const std::string& filename)
+                : std::ofstream(filename + ".partial", std::ios::binary), m_filename(filename)
+            {
+                if (!*this)
+                    throw dlib::error("Unable to open file for writing: " + filename + ".partial");
+            }
+
+            ~partial_ofstream()
+            {
+                if (!m_committed)
+                {
+                    std::ofstream::close();
+                    std::remove((m_filename + ".partial").c_str());
+                }
+            }
+
+            void commit()
+            {
+                std::ofstream::close();
+                if (!*this)
+                    throw dlib::error("Error while writing file: " + m_filename + ".partial");
+                publish_file(m_filename + ".partial", m_filename);
+                m_committed = true;
+            }
+
+        private:
+            std::string m_filename;
+            bool m_committed = false;
+        };
+
+        struct fixed_header
+        {
+            uint32 version = fixed_version;
+            uint32 channels = 3;
+            uint64 rows = 0;
+            uint64 cols = 0;
+            uint64 num_images = fixed_incomplete;
+            uint64 pixel_offset = fixed_header_size;
+            uint64 labels_offset = 0;
+            uint64 meta_offset = 0;
+            uint64 meta_size = 0;
+            pixel_layout layout = pixel_layout::interleaved;
+            float mean[3] = { input_rgb_mean[0], input_rgb_mean[1], input_rgb_mean[2] };
+            float scale = input_rgb_scale;
+        };
+
+        inline uint32 float_bits(float value)
+        {
+            uint32 bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            return bits;
+        }
+
+        inline float bits_float(uint32 bits)
+        {
+            float value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+        inline size_t pixel_layout_bytes(pixel_layout layout)
+        {
+            return layout == pixel_layout::planar_float ? sizeof(float) : 1;
+        }
+
+        inline void store_le(char* dst, uint64 value, size_t bytes)
+        {
+            for (size_t i = 0; i < bytes; ++i)
+                dst[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+        }
+
+        inline uint64 load_le(const char* src, size_t bytes)
+        {
+            uint64 value = 0;
+            for (size_t i = 0; i < bytes; ++i)
+                value |= uint64(static_cast<unsigned char>(src[i])) << (8 * i);
+            return value;
+        }
+
+        /**
+         * Where the images of each class are in a dataset file
+         * Consecutive records of the same class form one run; a loader that only
+         * wants some classes, or the first images of each class, reads just the
+         * runs it needs.
+         */
+        struct class_index
+        {
+            std::vector<uint16> labels;      // Numeric label of each run
+            std::vector<uint64> first;       // Index of the first record of each run
+            std::vector<uint64> counts;      // Number of records of each run
+            std::vector<uint64> offsets;     // Byte offset of the first record (stream files only)
+
+            size_t size() const { return labels.size(); }
+
+            void add(uint16 label, uint64 record, uint64 offset)
+            {
+                if (!labels.empty() && labels.back() == label && first.back() + counts.back() == record)
+                {
+                    ++counts.back();
+                    return;
+                }
+                labels.push_back(label);
+                first.push_back(record);
+                counts.push_back(1);
+                offsets.push_back(offset);
+            }
+        };
+
+        inline void encode_fixed_header(const fixed_header& h, char* buf)
+        {
+            std::fill(buf, buf + fixed_header_size, 0);
+            std::copy(fixed_magic, fixed_magic + sizeof(fixed_magic), buf);
+            store_le(buf + 8, h.version, 4);
+            store_le(buf + 12, h.channels, 4);
+            store_le(buf + 16, h.rows, 8);
+            store_le(buf + 24, h.cols, 8);
+            store_le(buf + 32, h.num_images, 8);
+            store_le(buf + 40, h.pixel_offset, 8);
+            store_le(buf + 48, h.labels_offset, 8);
+            store_le(buf + 56, h.meta_offset, 8);
+            store_le(buf + 64, h.meta_size, 8);
+            if (h.version >= fixed_layout_version)
+            {
+                store_le(buf + 72, static_cast<uint32>(h.layout), 4);
+                for (int c = 0; c < 3; ++c)
+                    store_le(buf + 76 + 4 * c, float_bits(h.mean[c]), 4);
+                store_le(buf + 88, float_bits(h.scale), 4);
+            }
+        }
+
+        inline fixed_header decode_fixed_header(const char* buf)
+        {
+            fixed_header h;
+            h.version = static_cast<uint32>(load_le(buf + 8, 4));
+            h.channels = static_cast<uint32>(load_le(buf + 12, 4));
+            h.rows = load_le(buf + 16, 8);
+            h.cols = load_le(buf + 24, 8);
+            h.num_images = load_le(buf + 32, 8);
+            h.pixel_offset = load_le(buf + 40, 8);
+            h.labels_offset = load_le(buf + 48, 8);
+            h.meta_offset = load_le(buf + 56, 8);
+            h.meta_size = load_le(buf + 64, 8);
+            if (h.version >= fixed_layout_version)
+            {
+                h.layout = static_cast<pixel_layout>(load_le(buf + 72, 4));
+                for (int c = 0; c < 3; ++c)
+                    h.mean[c] = bits_float(static_cast<uint32>(load_le(buf + 76 + 4 * c, 4)));
+                h.scale = bits_float(static_cast<uint32>(load_le(buf + 88, 4)));
+            }
+            return h;
+        }
+
+        /**
+         * Read-only memory mapping of a whole file
+         */
+        class mapped_file
+        {
+        public:
+            explicit mapped_file(const std::string& filename)
+            {
+#ifdef _WIN32
+                m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                if (m_file == INVALID_HANDLE_VALUE)
+                    throw dlib::error("Unable to open dataset file: " + filename);
+                LARGE_INTEGER file_size;
+                GetFileSizeEx(m_file, &file_size);
+                m_size = static_cast<size_t>(file_size.QuadPart);
+                if (m_size != 0)
+                {
+                    m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+                    if (m_mapping != NULL)
+                        m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+                    if (m_data == nullptr)
+                    {
+                        release();
+                        throw dlib::error("Unable to memory-map dataset file: " + filename);
+                    }
+                }
+#else
+                m_fd = ::open(filename.c_str(), O_RDONLY);
+                if (m_fd < 0)
+                    throw dlib::error("Unable to open dataset file: " + filename);
+                struct stat st;
+                if (::fstat(m_fd, &st) != 0)
+                {
+                    release();
+                    throw dlib::error("Unable to stat dataset file: " + filename);
+                }
+                m_size = static_cast<size_t>(st.st_size);
+                if (m_size != 0)
+                {
+                    void* addr = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+                    if (addr == MAP_FAILED)
+                    {
+                        release();
+                        throw dlib::error("Unable to memory-map dataset file: " + filename);
+                    }
+                    m_data = static_cast<const char*>(addr);
+                }
+#endif
+            }
+
+            ~mapped_file() { release(); }
+
+            mapped_file(const mapped_file&) = delete;
+            mapped_file& operator=(const mapped_file&) = delete;
+
+            const char* data() const { return m_data; }
+            size_t size() const { return m_size; }
+
+            /**
+             * Removes the pages of [offset, offset + size) from the resident memory of
+             * the process; they are read from the file again the next time they are
+             * touched. The range is widened to whole pages.
+             */
+            void drop_pages(size_t offset, size_t size) const
+            {
+                if (!m_data || offset >= m_size || size == 0)
+                    return;
+                size = std::min(size, m_size - offset);
+#ifdef _WIN32
+                // Unlocking pages that are not locked takes them out of the working set
+                VirtualUnlock(const_cast<char*>(m_data + offset), size);
+#else
+                const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+                const size_t begin = offset / page * page;
+                ::madvise(const_cast<char*>(m_data + begin), offset + size - begin, MADV_DONTNEED);
+#endif
+            }
+
+        private:
+            void release()
+            {
+#ifdef _WIN32
+                if (m_data) UnmapViewOfFile(m_data);
+                if (m_mapping) CloseHandle(m_mapping);
+                if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+                m_mapping = NULL;
+                m_file = INVALID_HANDLE_VALUE;
+#else
+                if (m_data) ::munmap(const_cast<char*>(m_data), m_size);
+                if (m_fd >= 0) ::close(m_fd);
+                m_fd = -1;
+#endif
+                m_data = nullptr;
+            }
+
+#ifdef _WIN32
+            HANDLE m_file = INVALID_HANDLE_VALUE;
+            HANDLE m_mapping = NULL;
+#else
+            int m_fd = -1;
+#endif
+            const char* m_data = nullptr;
+            size_t m_size = 0;
+        };
+    }
+
+    /**
+     * Detects the layout of a dataset file by looking at its first bytes
+     * A legacy file starts with a serialized integer whose first byte is a small
+     * length code, so it can never collide with the magic of the other formats.
+     *
+     * @param filename Path to the dataset file
+     * @return The detected format
+     */
+    dataset_format detect_dataset_format(const std::string& filename)
+    {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in)
+            throw dlib::error("Unable to open dataset file: " + filename);
+
+        char magic[8];
+        in.read(magic, sizeof(magic));
+        if (in.gcount() == sizeof(magic))
+        {
+            if (std::equal(magic, magic + sizeof(magic), impl::stream_magic))
+                return dataset_format::stream;
+            if (std::equal(magic, magic + sizeof(magic), impl::fixed_magic))
+                return dataset_format::fixed;
+            if (std::equal(magic, magic + sizeof(magic), impl::compressed_magic))
+                return dataset_format::compressed;
+        }
+        return dataset_format::legacy;
+    }
+
+    /**
+     * Parses a pixel layout name as given on the command line
+     * ("interleaved", "planar" or "planar-float")
+     */
+    pixel_layout parse_pixel_layout(const std::string& name)
+    {
+        if (name == "interleaved") return pixel_layout::interleaved;
+        if (name == "planar") return pixel_layout::planar;
+        if (name == "planar-float") return pixel_layout::planar_float;
+        throw dlib::error("Unknown pixel layout: " + name + " (expected interleaved, planar or planar-float)");
+    }
+
+    /**
+     * Parses a format name as given on the command line ("stream", "fixed" or "compressed")
+     */
+    dataset_format parse_dataset_format(const std::string& name)
+    {
+        if (name == "stream") return dataset_format::stream;
+        if (name == "fixed") return dataset_format::fixed;
+        if (name == "compressed") return dataset_format::compressed;
+        throw dlib::error("Unknown dataset format: " + name + " (expected stream, fixed or compressed)");
+    }
+
+    /**
+     * Interface of the dataset writers
+     *
+     * Each call to write() sends the record to disk, so memory usage does not depend
+     * on the size of the dataset. Data goes to "<filename>.partial", which close()
+     * finalizes and renames to filename; a writer destroyed before close() deletes
+     * its partial file.
+     */
+    class imagenet_dataset_writer
+    {
+    public:
+        virtual ~imagenet_dataset_writer() = default;
+
+        /**
+         * Appends one image record to the file
+         *
+         * @param img The processed image
+         * @param label Textual label of the image
+         * @param numeric_label Numeric label of the image
+         */
+        virtual void write(
+            const matrix<rgb_pixel>& img,
+            const std::string& label,
+            unsigned long numeric_label
+        ) = 0;
+
+        /**
+         * Finalizes and flushes the file
+         */
+        virtual void close() = 0;
+
+        /**
+         * @return Number of records written so far
+         */
+        virtual size_t size() const = 0;
+
+        /**
+         * Adds the pixel statistics of records already written
+         * close() stores the statistics only if they cover every record, so a writer
+         * whose caller never calls add_stats() writes a file without them.
+         *
+         * @param numeric_label Class of the records
+         * @param stats Their statistics (stats.images records)
+         */
+        virtual void add_stats(unsigned long numeric_label, const imagenet_channel_stats& stats)
+        {
+            m_stats.add(numeric_label, stats);
+        }
+
+        const imagenet_dataset_stats& stats() const { return m_stats; }
+
+    protected:
+        bool stats_complete() const { return !m_stats.empty() && m_stats.overall.images == size(); }
+
+        imagenet_dataset_stats m_stats;
+    };
+
+    /**
+     * Writes the stream format: one serialized record per image, plus one class
+     * record (numeric label, name) before the first image of each class, and the
+     * class index after the end record
+     */
+    class stream_dataset_writer : public imagenet_dataset_writer
+    {
+    public:
+        explicit stream_dataset_writer(const std::string& filename)
+            : m_filename(filename), m_out(filename)
+        {
+            m_out.write(impl::stream_magic, sizeof(impl::stream_magic));
+            serialize(impl::stream_version, m_out);
+        }
+
+        void write(
+            const matrix<rgb_pixel>& img,
+            const std::string& label,
+            unsigned long numeric_label
+        ) override
+        {
+            const uint16 id = begin_record(label, numeric_label);
+            serialize(img, m_out);
+            end_record(id);
+        }
+
+        /**
+         * Appends a rows x cols record from its interleaved RGB bytes, as they are
+         * stored in another stream file, without going through a matrix
+         */
+        void write_raw(
+            const void* pixels,
+            long rows,
+            long cols,
+            const std::string& label,
+            unsigned long numeric_label
+        )
+        {
+            const uint16 id = begin_record(label, numeric_label);
+            // Same bytes as serialize(matrix<rgb_pixel>)
+            serialize(-rows, m_out);
+            serialize(-cols, m_out);
+            m_out.write(static_cast<const char*>(pixels), rows * cols * sizeof(rgb_pixel));
+            end_record(id);
+        }
+
+        void close() override
+        {
+            if (m_closed)
+                return;
+            m_out.put(impl::stream_end_tag);
+            serialize(m_count, m_out);
+
+            const uint64 index_offset = static_cast<uint64>(m_out.tellp());
+            serialize(m_class_names, m_out);
+            serialize(m_index.labels, m_out);
+            serialize(m_index.first, m_out);
+            serialize(m_index.counts, m_out);
+            serialize(m_index.offsets, m_out);
+            if (stats_complete())
+                serialize(m_stats, m_out);
+            char trailer[impl::stream_index_trailer_size];
+            impl::store_le(trailer, index_offset, 8);
+            std::copy(impl::stream_index_magic, impl::stream_index_magic + sizeof(impl::stream_index_magic), trailer + 8);
+            m_out.write(trailer, sizeof(trailer));
+            if (!m_out)
+                throw dlib::error("Error while writing dataset file: " + m_filename);
+            m_out.commit();
+            m_closed = true;
+        }
+
+        size_t size() const override { return m_count; }
+
+    private:
+        /**
+         * Writes the class record if the class is new, then the tag of an image record
+         */
+        uint16 begin_record(const std::string& label, unsigned long numeric_label)
+        {
+            DLIB_CASSERT(!m_closed, "write() called on a closed dataset writer");
+            if (numeric_label > std::numeric_limits<uint16>::max())
+                throw dlib::error("Numeric label " + std::to_string(numeric_label) + " does not fit the 16-bit label table");
+            const uint16 id = static_cast<uint16>(numeric_label);
+            if (id >= m_known_classes.size())
+                m_known_classes.resize(id + 1, false);
+            if (id >= m_class_names.size())
+                m_class_names.resize(id + 1);
+            if (!m_known_classes[id])
+            {
+                m_out.put(impl::stream_class_tag);
+                serialize(id, m_out);
+                serialize(label, m_out);
+                m_known_classes[id] = true;
+                m_class_names[id] = label;
+            }
+            m_index.add(id, m_count, static_cast<uint64>(m_out.tellp()));
+            m_out.put(impl::stream_record_tag);
+            return id;
+        }
+
+        void end_record(uint16 id)
+        {
+            serialize(id, m_out);
+            if (!m_out)
+                throw dlib::error("Error while writing dataset file: " + m_filename);
+            ++m_count;
+        }
+
+        std::string m_filename;
+        impl::partial_ofstream m_out;
+        std::vector<bool> m_known_classes;
+        std::vector<std::string> m_class_names;
+        impl::class_index m_index;
+        size_t m_count = 0;
+        bool m_closed = false;
+    };
+
+    /**
+     * Writes the fixed-stride format
+     *
+     * Pixels are streamed to disk as they arrive; the (small) label array and class
+     * table are kept in memory and written by close(), which then fills in the header.
+     * Until then the header marks the file as incomplete. Images are stored
+     * interleaved by default, or as CHW planes (see pixel_layout).
+     */
+    class fixed_dataset_writer : public imagenet_dataset_writer
+    {
+    public:
+        fixed_dataset_writer(
+            const std::string& filename,
+            long rows,
+            long cols,
+            pixel_layout layout = pixel_layout::interleaved
+        ) : m_filename(filename), m_out(filename)
+        {
+            m_header.rows = rows;
+            m_header.cols = cols;
+            m_header.layout = layout;
+            if (layout != pixel_layout::interleaved)
+                m_header.version = impl::fixed_layout_version;
+            write_header();
+        }
+
+        void write(
+            const matrix<rgb_pixel>& img,
+            const std::string& label,
+            unsigned long numeric_label
+        ) override
+        {
+            DLIB_CASSERT(!m_closed, "write() called on a closed dataset writer");
+            if (img.nr() != static_cast<long>(m_header.rows) || img.nc() != static_cast<long>(m_header.cols))
+                throw dlib::error("Image size does not match the fixed-stride dataset size");
+
+            const size_t n = img.size();
+            const unsigned char* src = reinterpret_cast<const unsigned char*>(&img(0, 0));
+            if (m_header.layout == pixel_layout::interleaved)
+            {
+                m_out.write(reinterpret_cast<const char*>(src), n * sizeof(rgb_pixel));
+            }
+            else if (m_header.layout == pixel_layout::planar)
+            {
+                m_planes.resize(n * 3);
+                for (size_t i = 0; i < n; ++i)
+                    for (size_t c = 0; c < 3; ++c)
+                        m_planes[c * n + i] = src[i * 3 + c];
+                m_out.write(reinterpret_cast<const char*>(m_planes.data()), m_planes.size());
+            }
+            else
+            {
+                m_float_planes.resize(n * 3);
+                for (size_t i = 0; i < n; ++i)
+                    for (size_t c = 0; c < 3; ++c)
+                        m_float_planes[c * n + i] = (src[i * 3 + c] - m_header.mean[c]) * m_header.scale;
+                m_out.write(reinterpret_cast<const char*>(m_float_planes.data()), m_float_planes.size() * sizeof(float));
+            }
+            if (!m_out)
+                throw dlib::error("Error while writing dataset file: " + m_filename);
+            add_labels(label, numeric_label, 1);
+        }
+
+        /**
+         * Appends count consecutive images of one class from their stored bytes,
+         * already in the pixel layout of this file (see
+         * mapped_imagenet_dataset::raw_image()), in a single block write
+         */
+        void write_raw(
+            const void* pixels,
+            size_t count,
+            const std::string& label,
+            unsigned long numeric_label
+        )
+        {
+            DLIB_CASSERT(!m_closed, "write_raw() called on a closed dataset writer");
+            const size_t stride = m_header.rows * m_header.cols * 3 * impl::pixel_layout_bytes(m_header.layout);
+            m_out.write(static_cast<const char*>(pixels), count * stride);
+            if (!m_out)
+                throw dlib::error("Error while writing dataset file: " + m_filename);
+            add_labels(label, numeric_label, count);
+        }
+
+        void close() override
+        {
+            if (m_closed)
+                return;
+
+            m_header.num_images = m_labels.size();
+            m_header.labels_offset = static_cast<uint64>(m_out.tellp());
+            std::vector<char> buf(m_labels.size() * 4);
+            for (size_t i = 0; i < m_labels.size(); ++i)
+                impl::store_le(&buf[i * 4], m_labels[i], 4);
+            m_out.write(buf.data(), buf.size());
+
+            m_header.meta_offset = static_cast<uint64>(m_out.tellp());
+            serialize(m_class_names, m_out);
+            if (stats_complete())
+                serialize(m_stats, m_out);
+            m_header.meta_size = static_cast<uint64>(m_out.tellp()) - m_header.meta_offset;
+
+            m_out.seekp(0);
+            write_header();
+            m_out.commit();
+            m_closed = true;
+        }
+
+        size_t size() const override { return m_labels.size(); }
+        pixel_layout layout() const { return m_header.layout; }
+
+    private:
+        void add_labels(const std::string& label, unsigned long numeric_label, size_t count)
+        {
+            m_labels.insert(m_labels.end(), count, static_cast<uint32>(numeric_label));
+            if (numeric_label >= m_class_names.size())
+                m_class_names.resize(numeric_label + 1);
+            if (m_class_names[numeric_label].empty())
+                m_class_names[numeric_label] = label;
+        }
+
+        void write_header()
+        {
+            char buf[impl::fixed_header_size];
+            impl::encode_fixed_header(m_header, buf);
+            m_out.write(buf, sizeof(buf));
+        }
+
+        std::string m_filename;
+        impl::partial_ofstream m_out;
+        impl::fixed_header m_header;
+        std::vector<uint32> m_labels;
+        std::vector<std::string> m_class_names;
+        std::vector<unsigned char> m_planes;
+        std::vector<float> m_float_planes;
+        bool m_closed = false;
+    };
+
+    namespace impl
+    {
+        const char* const compressed_unsupported =
+            "Compressed datasets need zlib: build with IMAGENET_ZLIB_SUPPORT defined and link zlib";
+
+        /**
+         * Compresses one chunk of the compressed format
+         */
+        std::vector<char> deflate_chunk(const std::vector<char>& raw, int level)
+        {
+#ifdef IMAGENET_ZLIB_SUPPORT
+            uLongf size = compressBound(static_cast<uLong>(raw.size()));
+            std::vector<char> out(size);
+            if (compress2(reinterpret_cast<Bytef*>(out.data()), &size,
+                    reinterpret_cast<const Bytef*>(raw.data()), static_cast<uLong>(raw.size()), level) != Z_OK)
+                throw dlib::error("zlib compression of a dataset chunk failed");
+            out.resize(size);
+            return out;
+#else
+            (void)raw; (void)level;
+            throw dlib::error(compressed_unsupported);
+#endif
+        }
+
+        /**
+         * Inflates one chunk of the compressed format into raw, which must already have
+         * the inflated size
+         */
+        void inflate_chunk(const char* data, size_t size, std::vector<char>& raw)
+        {
+#ifdef IMAGENET_ZLIB_SUPPORT
+            uLongf raw_size = static_cast<uLongf>(raw.size());
+            if (uncompress(reinterpret_cast<Bytef*>(raw.data()), &raw_size,
+                    reinterpret_cast<const Bytef*>(data), static_cast<uLong>(size)) != Z_OK ||
+                raw_size != raw.size())
+                throw dlib::error("Corrupted chunk in compressed dataset file");
+#else
+            (void)data; (void)size; (void)raw;
+            throw dlib::error(compressed_unsupported);
+#endif
+        }
+    }
+
+    /**
+     * Writes the compressed format: images are grouped in chunks of images_per_chunk
+     * records, each one delta-filtered and deflated independently so that readers
+     * can inflate chunks in parallel
+     *
+     * Chunks are compressed and written as soon as they are full, so memory usage
+     * is one chunk. The class table and chunk table are written by close().
+     */
+    class compressed_dataset_writer : public imagenet_dataset_writer
+    {
+    public:
+        /**
+         * @param filename Path of the file to create
+         * @param images_per_chunk Number of images per compressed chunk (default 256)
+         * @param level zlib compression level, 1 (fastest) to 9 (smallest), default 6
+         * @throw dlib::error if images_per_chunk does not fit the 32-bit header field
+         */
+        explicit compressed_dataset_writer(
+            const std::string& filename,
+            unsigned long images_per_chunk = impl::compressed_default_chunk,
+            int level = 6
+        ) : m_filename(filename), m_out(filename),
+            m_images_per_chunk(std::max(1ul, images_per_chunk)), m_level(level)
+        {
+#ifndef IMAGENET_ZLIB_SUPPORT
+            throw dlib::error(impl::compressed_unsupported);
+#endif
+            if (m_images_per_chunk > std::numeric_limits<uint32>::max())
+                throw dlib::error("Too many images per chunk: " + std::to_string(images_per_chunk));
+            write_header(impl::fixed_incomplete);
+        }
+
+        void write(
+            const matrix<rgb_pixel>& img,
+            const std::string& label,
+            unsigned long numeric_label
+        ) override
+        {
+            DLIB_CASSERT(!m_closed, "write() called on a closed dataset writer");
+            if (numeric_label > std::numeric_limits<uint16>::max())
+                throw dlib::error("Numeric label " + std::to_string(numeric_label) + " does not fit the 16-bit label table");
+            add_class(label, numeric_label);
+            m_index.add(static_cast<uint16>(numeric_label), m_count, 0);
+
+            const size_t begin = m_chunk.size();
+            const size_t row_bytes = img.nc() * 3;
+            m_chunk.resize(begin + impl::compressed_record_header_size + img.nr() * row_bytes);
+            char* out = &m_chunk[begin];
+            impl::store_le(out, static_cast<uint64>(img.nr()), 4);
+            impl::store_le(out + 4, static_cast<uint64>(img.nc()), 4);
+            impl::store_le(out + 8, numeric_label, 2);
+            out += impl::compressed_record_header_size;
+
+            // Neighbouring pixels are similar, their differences deflate much better
+            for (long r = 0; r < img.nr(); ++r, out += row_bytes)
+            {
+                const unsigned char* row = reinterpret_cast<const unsigned char*>(&img(r, 0));
+                for (size_t i = 0; i < row_bytes; ++i)
+                    out[i] = static_cast<char>(i < 3 ? row[i] : row[i] - row[i - 3]);
+            }
+
+            ++m_chunk_images;
+            ++m_count;
+            if (m_chunk_images == m_images_per_chunk)
+                flush_chunk();
+        }
+
+        /**
+         * Appends a chunk already deflated by another compressed writer, as is
+         * The chunk being filled is flushed first, so the copied chunk keeps its
+         * own number of records.
+         *
+         * @param packed Deflated bytes of the chunk
+         * @param size Number of deflated bytes
+         * @param raw_size Size of the chunk once inflated
+         * @param labels Numeric label of each record, as stored in the chunk
+         * @param count Number of records of the chunk
+         * @param class_names Class names indexed by numeric label
+         */
+        void write_chunk(
+            const char* packed,
+            size_t size,
+            uint64 raw_size,
+            const uint16* labels,
+            size_t count,
+            const std::vector<std::string>& class_names
+        )
+        {
+            DLIB_CASSERT(!m_closed, "write_chunk() called on a closed dataset writer");
+            flush_chunk();
+            for (size_t i = 0; i < count; ++i)
+            {
+                add_class(class_names[labels[i]], labels[i]);
+                m_index.add(labels[i], m_count + i, 0);
+            }
+            append_chunk(packed, size, raw_size, count);
+            m_count += count;
+        }
+
+        void close() override
+        {
+            if (m_closed)
+                return;
+            flush_chunk();
+
+            const uint64 footer_offset = static_cast<uint64>(m_out.tellp());
+            serialize(m_class_names, m_out);
+            serialize(m_chunk_offsets, m_out);
+            serialize(m_chunk_sizes, m_out);
+            serialize(m_chunk_raw_sizes, m_out);
+            serialize(m_chunk_counts, m_out);
+            serialize(m_index.labels, m_out);
+            serialize(m_index.first, m_out);
+            serialize(m_index.counts, m_out);
+            if (stats_complete())
+                serialize(m_stats, m_out);
+
+            m_out.seekp(0);
+            write_header(footer_offset);
+            m_out.commit();
+            m_closed = true;
+        }
+
+        size_t size() const override { return m_count; }
+
+    private:
+        void add_class(const std::string& label, unsigned long numeric_label)
+        {
+            if (numeric_label >= m_class_names.size())
+                m_class_names.resize(numeric_label + 1);
+            if (m_class_names[numeric_label].empty())
+                m_class_names[numeric_label] = label;
+        }
+
+        void flush_chunk()
+        {
+            if (m_chunk_images == 0)
+                return;
+            const std::vector<char> packed = impl::deflate_chunk(m_chunk, m_level);
+            append_chunk(packed.data(), packed.size(), m_chunk.size(), m_chunk_images);
+            m_chunk.clear();
+            m_chunk_images = 0;
+        }
+
+        void append_chunk(const char* packed, size_t size, uint64 raw_size, uint64 count)
+        {
+            m_chunk_offsets.push_back(static_cast<uint64>(m_out.tellp()));
+            m_chunk_sizes.push_back(size);
+            m_chunk_raw_sizes.push_back(raw_size);
+            m_chunk_counts.push_back(count);
+            m_out.write(packed, size);
+            if (!m_out)
+                throw dlib::error("Error while writing dataset file: " + m_filename);
+        }
+
+        void write_header(uint64 footer_offset)
+        {
+            char buf[impl::compressed_header_size];
+            std::copy(impl::compressed_magic, impl::compressed_magic + sizeof(impl::compressed_magic), buf);
+            impl::store_le(buf + 8, impl::compressed_version, 4);
+            impl::store_le(buf + 12, m_images_per_chunk, 4);
+            impl::store_le(buf + 16, footer_offset, 8);
+            m_out.write(buf, sizeof(buf));
+        }
+
+        std::string m_filename;
+        impl::partial_ofstream m_out;
+        const unsigned long m_images_per_chunk;
+        const int m_level;
+        std::vector<std::string> m_class_names;
+        std::vector<char> m_chunk;
+        uint64 m_chunk_images = 0;
+        std::vector<uint64> m_chunk_offsets, m_chunk_sizes, m_chunk_raw_sizes, m_chunk_counts;
+        impl::class_index m_index;
+        size_t m_count = 0;
+        bool m_closed = false;
+    };
+
+    /**
+     * Creates a writer for the requested format
+     *
+     * @param filename Path of the file to create
+     * @param format Output format (stream, fixed or compressed)
+     * @param rows Height of every image (used by the fixed format)
+     * @param cols Width of every image (used by the fixed format)
+     * @param layout Pixel layout, anything but interleaved needs the fixed format
+     */
+    std::unique_ptr<imagenet_dataset_writer> make_dataset_writer(
+        const std::string& filename,
+        dataset_format format,
+        long rows,
+        long cols,
+        pixel_layout layout = pixel_layout::interleaved
+    )
+    {
+        if (layout != pixel_layout::interleaved && format != dataset_format::fixed)
+            throw dlib::error("Planar pixel layouts are only available with the fixed format");
+
+        switch (format)
+        {
+        case dataset_format::stream:
+            return std::unique_ptr<imagenet_dataset_writer>(new stream_dataset_writer(filename));
+        case dataset_format::fixed:
+            return std::unique_ptr<imagenet_dataset_writer>(new fixed_dataset_writer(filename, rows, cols, layout));
+        case dataset_format::compressed:
+            return std::unique_ptr<imagenet_dataset_writer>(new compressed_dataset_writer(filename));
+        default:
+            throw dlib::error("The legacy format can only be read, not written");
+        }
+    }
+
+    namespace impl
+    {
+        const char shard_index_magic[8] = { 'D', 'L', 'I', 'B', 'I', 'N', 'I', 'X' };
+        const int shard_index_version = 1;
+
+        /**
+         * Name of shard s of n for an index file, e.g. imagenet.dat -> imagenet-00003-of-00016.dat
+         */
+        std::string shard_file_name(const std::string& index_file, unsigned long s, unsigned long n)
+        {
+            const size_t sep = index_file.find_last_of("/\\");
+            size_t dot = index_file.find_last_of('.');
+            if (dot == std::string::npos || (sep != std::string::npos && dot < sep))
+                dot = index_file.size();
+
+            char suffix[32];
+            std::snprintf(suffix, sizeof(suffix), "-%05lu-of-%05lu", s, n);
+            return index_file.substr(0, dot) + suffix + index_file.substr(dot);
+        }
+
+        inline std::string directory_part(const std::string& path)
+        {
+            const size_t sep = path.find_last_of("/\\");
+            return sep == std::string::npos ? std::string() : path.substr(0, sep + 1);
+        }
+    }
+
+    /**
+     * Content of a shard index file
+     */
+    struct imagenet_shard_index
+    {
+        std::vector<std::string> shard_files;               // Shard paths, relative to the index
+        std::vector<uint64> shard_sizes;                    // Number of images in each shard
+        std::vector<std::string> class_names;               // Class names, indexed by numeric label
+        std::vector<std::vector<uint64>> class_counts;      // Per shard, number of images of each class
+    };
+
+    /**
+     * Writes a dataset as num_shards files plus an index
+     *
+     * The k-th image of class c goes to shard (k + c) % num_shards, so every shard
+     * holds the same share of every class (within one image) and the shard sizes stay
+     * balanced even when classes are small. Each shard is a regular dataset file of
+     * the requested format; the index written by close() lists them.
+     */
+    class sharded_dataset_writer : public imagenet_dataset_writer
+    {
+    public:
+        sharded_dataset_writer(
+            const std::string& index_file,
+            unsigned long num_shards,
+            dataset_format format,
+            long rows,
+            long cols,
+            pixel_layout layout = pixel_layout::interleaved
+        ) : m_index_file(index_file)
+        {
+            DLIB_CASSERT(num_shards > 0, "num_shards must be positive");
+            for (unsigned long s = 0; s < num_shards; ++s)
+            {
+                const std::string name = impl::shard_file_name(index_file, s, num_shards);
+                m_shards.push_back(make_dataset_writer(name, format, rows, cols, layout));
+                m_index.shard_files.push_back(impl::file_name_part(name));
+            }
+            m_index.class_counts.resize(num_shards);
+        }
+
+        void write(
+            const matrix<rgb_pixel>& img,
+            const std::string& label,
+            unsigned long numeric_label
+        ) override
+        {
+            DLIB_CASSERT(!m_closed, "write() called on a closed dataset writer");
+            if (numeric_label >= m_class_seen.size())
+            {
+                m_class_seen.resize(numeric_label + 1, 0);
+                m_index.class_names.resize(numeric_label + 1);
+                for (auto& counts : m_index.class_counts)
+                    counts.resize(numeric_label + 1, 0);
+            }
+            if (m_index.class_names[numeric_label].empty())
+                m_index.class_names[numeric_label] = label;
+
+            const size_t shard = (m_class_seen[numeric_label]++ + numeric_label) % m_shards.size();
+            m_shards[shard]->write(img, label, numeric_label);
+            ++m_index.class_counts[shard][numeric_label];
+            ++m_count;
+            m_last_shard = shard;
+        }
+
+        /**
+         * Statistics go to the shard of the last record written, each shard file
+         * storing its own
+         */
+        void add_stats(unsigned long numeric_label, const imagenet_channel_stats& stats) override
+        {
+            imagenet_dataset_writer::add_stats(numeric_label, stats);
+            m_shards[m_last_shard]->add_stats(numeric_label, stats);
+        }
+
+        void close() override
+        {
+            if (m_closed)
+                return;
+            m_index.shard_sizes.clear();
+            for (auto& shard : m_shards)
+            {
+                shard->close();
+                m_index.shard_sizes.push_back(shard->size());
+            }
+
+            impl::partial_ofstream out(m_index_file);
+            out.write(impl::shard_index_magic, sizeof(impl::shard_index_magic));
+            serialize(impl::shard_index_version, out);
+            serialize(m_index.shard_files, out);
+            serialize(m_index.shard_sizes, out);
+            serialize(m_index.class_names, out);
+            serialize(m_index.class_counts, out);
+            out.commit();
+            m_closed = true;
+        }
+
+        size_t size() const override { return m_count; }
+
+    private:
+        std::string m_index_file;
+        std::vector<std::unique_ptr<imagenet_dataset_writer>> m_shards;
+        std::vector<uint64> m_class_seen;
+        imagenet_shard_index m_index;
+        size_t m_count = 0;
+        size_t m_last_shard = 0;
+        bool m_closed = false;
+    };
+
+    /**
+     * @return true if filename is a shard index written by sharded_dataset_writer
+     */
+    bool is_shard_index(const std::string& filename)
+    {
+        std::ifstream in(filename, std::ios::binary);
+        char magic[8];
+        in.read(magic, sizeof(magic));
+        return in.gcount() == sizeof(magic) &&
+            std::equal(magic, magic + sizeof(magic), impl::shard_index_magic);
+    }
+
+    /**
+     * Reads a shard index file
+     */
+    imagenet_shard_index load_imagenet_shard_index(const std::string& index_file)
+    {
+        if (!is_shard_index(index_file))
+            throw dlib::error("Not a shard index file: " + index_file);
+
+        std::ifstream in(index_file, std::ios::binary);
+        in.ignore(sizeof(impl::shard_index_magic));
+        int version = 0;
+        deserialize(version, in);
+        if (version != impl::shard_index_version)
+            throw dlib::error("Unsupported shard index version in: " + index_file);
+
+        imagenet_shard_index index;
+        deserialize(index.shard_files, in);
+        deserialize(index.shard_sizes, in);
+        deserialize(index.class_names, in);
+        deserialize(index.class_counts, in);
+        return index;
+    }
+
+    /**
+     * Lists the shard files assigned to one node of a distributed job
+     * Shard s belongs to rank s % world_size, so with a number of shards that is a
+     * multiple of world_size every node gets the same number of shards.
+     *
+     * @param index_file Path to the shard index
+     * @param rank Index of this node, in [0, world_size)
+     * @param world_size Number of nodes
+     * @return Full paths of the shard files of this rank
+     */
+    std::vector<std::string> get_rank_shard_files(
+        const std::string& index_file,
+        unsigned long rank,
+        unsigned long world_size
+    )
+    {
+        DLIB_CASSERT(world_size > 0 && rank < world_size, "invalid rank/world_size");
+        const imagenet_shard_index index = load_imagenet_shard_index(index_file);
+        std::vector<std::string> files;
+        for (size_t s = rank; s < index.shard_files.size(); s += world_size)
+            files.push_back(impl::directory_part(index_file) + index.shard_files[s]);
+        return files;
+    }
+
+    /**
+     * Read-only view of an interleaved RGB image stored in external memory
+     * It implements dlib's generic image interface, so it can be passed directly as
+     * the input of dlib image functions (assign_image, resize_image, ...).
+     */
+    struct const_rgb_image_view
+    {
+        const rgb_pixel* data = nullptr;
+        long rows = 0;
+        long cols = 0;
+    };
+
+    template <>
+    struct image_traits<const_rgb_image_view>
+    {
+        typedef rgb_pixel pixel_type;
+    };
+
+    inline long num_rows(const const_rgb_image_view& img) { return img.rows; }
+    inline long num_columns(const const_rgb_image_view& img) { return img.cols; }
+    inline const void* image_data(const const_rgb_image_view& img) { return img.data; }
+    inline long width_step(const const_rgb_image_view& img) { return img.cols * sizeof(rgb_pixel); }
+
+    namespace impl
+    {
+        /**
+         * Converts n interleaved RGB pixels into three normalized float planes of n values
+         */
+        inline void interleaved_to_planar_float(
+            const rgb_pixel* src,
+            size_t n,
+            const float* mean,
+            float scale,
+            float* dest
+        )
+        {
+            const unsigned char* in = reinterpret_cast<const unsigned char*>(src);
+            for (size_t c = 0; c < 3; ++c)
+            {
+                float* plane = dest + c * n;
+                for (size_t i = 0; i < n; ++i)
+                    plane[i] = (in[i * 3 + c] - mean[c]) * scale;
+            }
+        }
+    }
+
+    /**
+     * Random-access, memory-mapped view of a fixed-stride dataset file
+     *
+     * Opening only maps the file and parses the header and class table; pixels are
+     * paged in by the OS when an image is actually accessed. Planar files (see
+     * pixel_layout) have no interleaved view: use copy_image(), or copy_to_tensor()
+     * which for planar_float is a plain memcpy per image.
+     */
+    class mapped_imagenet_dataset
+    {
+    public:
+        explicit mapped_imagenet_dataset(const std::string& filename)
+            : m_file(filename)
+        {
+            const char* base = m_file.data();
+            if (m_file.size() < impl::fixed_header_size ||
+                !std::equal(impl::fixed_magic, impl::fixed_magic + sizeof(impl::fixed_magic), base))
+                throw dlib::error("Not a fixed-stride dataset file: " + filename);
+
+            m_header = impl::decode_fixed_header(base);
+            if (m_header.version != impl::fixed_version && m_header.version != impl::fixed_layout_version)
+                throw dlib::error("Unsupported dataset version " + std::to_string(m_header.version) + " in file: " + filename);
+            if (m_header.layout != pixel_layout::interleaved && m_header.layout != pixel_layout::planar &&
+                m_header.layout != pixel_layout::planar_float)
+                throw dlib::error("Unsupported pixel layout in file: " + filename);
+            if (m_header.num_images == impl::fixed_incomplete)
+                throw dlib::error("Incomplete dataset file (writer was not closed): " + filename);
+
+            // Every size and offset comes from the file: check them without overflowing
+            const uint64 size = m_file.size();
+            const uint64 pixel_bytes = 3 * impl::pixel_layout_bytes(m_header.layout);
+            if (m_header.rows > size || m_header.cols > size ||
+                (m_header.rows != 0 && m_header.cols > size / m_header.rows / pixel_bytes))
+                throw dlib::error("Corrupted dataset file: " + filename);
+            m_stride = static_cast<size_t>(m_header.rows * m_header.cols * pixel_bytes);
+            if (m_header.pixel_offset > m_header.labels_offset ||
+                m_header.labels_offset > m_header.meta_offset ||
+                m_header.meta_offset > size ||
+                m_header.meta_size > size - m_header.meta_offset ||
+                (m_stride != 0 && m_header.num_images > (m_header.labels_offset - m_header.pixel_offset) / m_stride) ||
+                m_header.num_images > (m_header.meta_offset - m_header.labels_offset) / 4)
+                throw dlib::error("Corrupted dataset file: " + filename);
+
+            std::istringstream meta(std::string(base + m_header.meta_offset, m_header.meta_size));
+            deserialize(m_class_names, meta);
+            if (meta.peek() != std::char_traits<char>::eof())
+                deserialize(m_stats, meta);
+        }
+
+        mapped_imagenet_dataset(const mapped_imagenet_dataset&) = delete;
+        mapped_imagenet_dataset& operator=(const mapped_imagenet_dataset&) = delete;
+
+        size_t size() const { return m_header.num_images; }
+        long nr() const { return static_cast<long>(m_header.rows); }
+        long nc() const { return static_cast<long>(m_header.cols); }
+        pixel_layout layout() const { return m_header.layout; }
+        const std::vector<std::string>& class_names() const { return m_class_names; }
+        const impl::fixed_header& header() const { return m_header; }
+
+        /**
+         * @return Pixel statistics stored by the build, empty() if there are none
+         */
+        const imagenet_dataset_stats& stats() const { return m_stats; }
+
+        /**
+         * @return Pointer to the first pixel of image i (row-major, interleaved RGB)
+         */
+        const rgb_pixel* pixels(size_t i) const
+        {
+            DLIB_CASSERT(layout() == pixel_layout::interleaved, "pixels() needs an interleaved dataset");
+            return reinterpret_cast<const rgb_pixel*>(raw_image(i));
+        }
+
+        /**
+         * @return Pointer to the stored bytes of image i, in the layout of the file
+         */
+        const void* raw_image(size_t i) const
+        {
+            DLIB_ASSERT(i < size(), "image index out of range");
+            return m_file.data() + m_header.pixel_offset + i * m_stride;
+        }
+
+        /**
+         * @return Zero-copy view of image i
+         */
+        const_rgb_image_view image(size_t i) const
+        {
+            const_rgb_image_view view;
+            view.data = pixels(i);
+            view.rows = nr();
+            view.cols = nc();
+            return view;
+        }
+
+        unsigned long numeric_label(size_t i) const
+        {
+            DLIB_ASSERT(i < size(), "image index out of range");
+            return static_cast<unsigned long>(impl::load_le(m_file.data() + m_header.labels_offset + i * 4, 4));
+        }
+
+        const std::string& label(size_t i) const
+        {
+            return m_class_names[numeric_label(i)];
+        }
+
+        /**
+         * Drops the pages of images [first, first + count) from resident memory
+         * Reading through the mapping grows the resident set of the process by
+         * every page touched, until the OS reclaims them; cached_imagenet_dataset
+         * calls this once it has copied the images out.
+         */
+        void drop_pages(size_t first, size_t count) const
+        {
+            m_file.drop_pages(m_header.pixel_offset + first * m_stride, count * m_stride);
+        }
+
+        /**
+         * Drops every page of the file from resident memory
+         */
+        void drop_pages() const { m_file.drop_pages(0, m_file.size()); }
+
+        /**
+         * Copies image i into a regular dlib matrix, converting planar layouts back
+         */
+        void copy_image(size_t i, matrix<rgb_pixel>& img) const
+        {
+            img.set_size(nr(), nc());
+            if (img.size() != 0)
+                copy_pixels(i, &img(0, 0));
+        }
+
+        /**
+         * Same as copy_image() but writes the nr() * nc() interleaved pixels to dest
+         */
+        void copy_pixels(size_t i, rgb_pixel* dest) const
+        {
+            const size_t n = static_cast<size_t>(nr() * nc());
+            unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+            if (layout() == pixel_layout::interleaved)
+            {
+                std::memcpy(out, raw_image(i), m_stride);
+            }
+            else if (layout() == pixel_layout::planar)
+            {
+                const unsigned char* in = static_cast<const unsigned char*>(raw_image(i));
+                for (size_t c = 0; c < 3; ++c)
+                    for (size_t p = 0; p < n; ++p)
+                        out[p * 3 + c] = in[c * n + p];
+            }
+            else
+            {
+                const float* in = static_cast<const float*>(raw_image(i));
+                for (size_t c = 0; c < 3; ++c)
+                {
+                    for (size_t p = 0; p < n; ++p)
+                    {
+                        const float v = std::round(in[c * n + p] / m_header.scale + m_header.mean[c]);
+                        out[p * 3 + c] = static_cast<unsigned char>(std::min(255.0f, std::max(0.0f, v)));
+                    }
+                }
+            }
+        }
+
+        /**
+         * Writes image i as three normalized CHW float planes (3 * nr() * nc() values),
+         * (value - mean) * scale with the file's channel means and scale (those of
+         * dlib's input_rgb_image for interleaved and planar files)
+         */
+        void copy_planar(size_t i, float* dest) const
+        {
+            const size_t n = static_cast<size_t>(nr() * nc());
+            if (layout() == pixel_layout::planar_float)
+            {
+                std::memcpy(dest, raw_image(i), m_stride);
+            }
+            else if (layout() == pixel_layout::planar)
+            {
+                const unsigned char* in = static_cast<const unsigned char*>(raw_image(i));
+                for (size_t c = 0; c < 3; ++c)
+                    for (size_t p = 0; p < n; ++p)
+                        dest[c * n + p] = (in[c * n + p] - m_header.mean[c]) * m_header.scale;
+            }
+            else
+            {
+                impl::interleaved_to_planar_float(pixels(i), n, m_header.mean, m_header.scale, dest);
+            }
+        }
+
+        /**
+         * Fills a tensor of shape (indices.size(), 3, nr(), nc()) with the given images,
+         * ready to be fed to a network whose input layer is input_rgb_image
+         */
+        void copy_to_tensor(const std::vector<size_t>& indices, resizable_tensor& data) const
+        {
+            data.set_size(indices.size(), 3, nr(), nc());
+            const size_t sample_size = static_cast<size_t>(3 * nr() * nc());
+            float* dest = data.host();
+            for (size_t k = 0; k < indices.size(); ++k)
+                copy_planar(indices[k], dest + k * sample_size);
+        }
+
+    private:
+        impl::mapped_file m_file;
+        impl::fixed_header m_header;
+        size_t m_stride = 0;
+        std::vector<std::string> m_class_names;
+        imagenet_dataset_stats m_stats;
+    };
+
+    namespace impl
+    {
+        /**
+         * Memory-mapped compressed dataset: header, footer tables and chunk decoding
+         * decode_chunk() is const and only touches its own buffers, so several
+         * threads can inflate different chunks at the same time.
+         */
+        class compressed_dataset_file
+        {
+        public:
+            explicit compressed_dataset_file(const std::string& filename)
+                : m_filename(filename), m_file(filename)
+            {
+                const char* base = m_file.data();
+                if (m_file.size() < compressed_header_size ||
+                    !std::equal(compressed_magic, compressed_magic + sizeof(compressed_magic), base))
+                    throw dlib::error("Not a compressed dataset file: " + filename);
+                if (load_le(base + 8, 4) != compressed_version)
+                    throw dlib::error("Unsupported compressed dataset version in file: " + filename);
+                const uint64 footer_offset = load_le(base + 16, 8);
+                if (footer_offset == fixed_incomplete)
+                    throw dlib::error("Incomplete compressed dataset file: " + filename);
+                if (footer_offset > m_file.size())
+                    throw dlib::error("Corrupted compressed dataset file: " + filename);
+
+                std::istringstream footer(std::string(base + footer_offset, m_file.size() - footer_offset));
+                deserialize(m_class_names, footer);
+                deserialize(m_offsets, footer);
+                deserialize(m_sizes, footer);
+                deserialize(m_raw_sizes, footer);
+                deserialize(m_counts, footer);
+                if (m_sizes.size() != m_offsets.size() || m_raw_sizes.size() != m_offsets.size() ||
+                    m_counts.size() != m_offsets.size())
+                    throw dlib::error("Corrupted compressed dataset file: " + filename);
+                if (footer.peek() != std::char_traits<char>::eof())
+                {
+                    deserialize(m_index.labels, footer);
+                    deserialize(m_index.first, footer);
+                    deserialize(m_index.counts, footer);
+                    m_has_index = true;
+                    if (footer.peek() != std::char_traits<char>::eof())
+                        deserialize(m_stats, footer);
+                }
+
+                m_first.push_back(0);
+                for (size_t k = 0; k < m_offsets.size(); ++k)
+                {
+                    // Every record is at least a header, which also bounds the label buffers of the callers
+                    if (m_offsets[k] < compressed_header_size || m_offsets[k] > footer_offset ||
+                        m_sizes[k] > footer_offset - m_offsets[k] ||
+                        m_raw_sizes[k] / deflate_max_ratio > m_sizes[k] ||
+                        m_counts[k] > m_raw_sizes[k] / compressed_record_header_size)
+                        throw dlib::error("Corrupted compressed dataset file: " + filename);
+                    m_first.push_back(m_first.back() + m_counts[k]);
+                }
+                if (m_has_index)
+                {
+                    if (m_index.first.size() != m_index.labels.size() || m_index.counts.size() != m_index.labels.size())
+                        throw dlib::error("Corrupted compressed dataset file: " + filename);
+                    for (size_t r = 0; r < m_index.size(); ++r)
+                    {
+                        if (m_index.first[r] + m_index.counts[r] > m_first.back() || m_index.labels[r] >= m_class_names.size())
+                            throw dlib::error("Corrupted compressed dataset file: " + filename);
+                    }
+                }
+            }
+
+            size_t size() const { return m_first.back(); }
+            size_t num_chunks() const { return m_offsets.size(); }
+            size_t chunk_begin(size_t k) const { return m_first[k]; }
+            size_t chunk_size(size_t k) const { return m_counts[k]; }
+            const std::vector<std::string>& class_names() const { return m_class_names; }
+
+            /**
+             * @return The deflated bytes of chunk k as stored in the file,
+             *         chunk_bytes(k) of them, chunk_raw_size(k) once inflated
+             */
+            const char* chunk_data(size_t k) const { return m_file.data() + m_offsets[k]; }
+            size_t chunk_bytes(size_t k) const { return m_sizes[k]; }
+            size_t chunk_raw_size(size_t k) const { return m_raw_sizes[k]; }
+
+            /**
+             * Drops the deflated bytes of chunk k from resident memory
+             */
+            void drop_chunk_pages(size_t k) const { m_file.drop_pages(m_offsets[k], m_sizes[k]); }
+
+            /**
+             * @return false for files written before the class index was added
+             */
+            bool has_class_index() const { return m_has_index; }
+            const class_index& classes() const { return m_index; }
+
+            /**
+             * @return Pixel statistics stored by the build, empty() if there are none
+             */
+            const imagenet_dataset_stats& stats() const { return m_stats; }
+
+            /**
+             * Inflates chunk k into imgs[0, chunk_size(k)) and labels[0, chunk_size(k))
+             *
+             * @param buffer Scratch space, reused across calls
+             */
+            void decode_chunk(
+                size_t k,
+                matrix<rgb_pixel>* imgs,
+                uint16* labels,
+                std::vector<char>& buffer
+            ) const
+            {
+                decode_records(k, labels, buffer, [&](size_t i, long rows, long cols) {
+                    imgs[i].set_size(rows, cols);
+                    return imgs[i].size() != 0 ? reinterpret_cast<unsigned char*>(&imgs[i](0, 0)) : nullptr;
+                });
+            }
+
+            /**
+             * Same as decode_chunk() but writes the images back to back at dest;
+             * every image of the chunk must be rows x cols
+             */
+            void decode_chunk(
+                size_t k,
+                rgb_pixel* dest,
+                long rows,
+                long cols,
+                uint16* labels,
+                std::vector<char>& buffer
+            ) const
+            {
+                decode_records(k, labels, buffer, [&](size_t i, long r, long c) {
+                    if (r != rows || c != cols)
+                        throw dlib::error("Images of different sizes in compressed dataset file: " + m_filename);
+                    return reinterpret_cast<unsigned char*>(dest + i * rows * cols);
+                });
+            }
+
+            /**
+             * Inflates chunk k and undoes the row filter of each record into the
+             * memory returned by dest(record, rows, cols)
+             */
+            template <typename dest_fn>
+            void decode_records(
+                size_t k,
+                uint16* labels,
+                std::vector<char>& buffer,
+                dest_fn dest
+            ) const
+            {
+                buffer.resize(m_raw_sizes[k]);
+                inflate_chunk(m_file.data() + m_offsets[k], m_sizes[k], buffer);
+
+                const char* in = buffer.data();
+                const char* const end = in + buffer.size();
+                for (size_t i = 0; i < m_counts[k]; ++i)
+                {
+                    if (end - in < static_cast<std::ptrdiff_t>(compressed_record_header_size))
+                        throw dlib::error("Corrupted chunk in compressed dataset file: " + m_filename);
+                    const long rows = static_cast<long>(load_le(in, 4));
+                    const long cols = static_cast<long>(load_le(in + 4, 4));
+                    labels[i] = static_cast<uint16>(load_le(in + 8, 2));
+                    in += compressed_record_header_size;
+                    if (labels[i] >= m_class_names.size() || !compressed_record_fits(end - in, rows, cols))
+                        throw dlib::error("Corrupted chunk in compressed dataset file: " + m_filename);
+                    const size_t row_bytes = cols * 3;
+
+                    unsigned char* const out = dest(i, rows, cols);
+                    for (long r = 0; r < rows; ++r, in += row_bytes)
+                    {
+                        unsigned char* row = out + r * row_bytes;
+                        for (size_t b = 0; b < row_bytes; ++b)
+                            row[b] = static_cast<unsigned char>(b < 3 ? in[b] : in[b] + row[b - 3]);
+                    }
+                }
+            }
+
+        private:
+            std::string m_filename;
+            mapped_file m_file;
+            std::vector<std::string> m_class_names;
+            std::vector<uint64> m_offsets, m_sizes, m_raw_sizes, m_counts;
+            std::vector<size_t> m_first;
+            class_index m_index;
+            bool m_has_index = false;
+            imagenet_dataset_stats m_stats;
+        };
+    }
+
+    /**
+     * Reads a dataset one image record at a time, whatever its format
+     *
+     * Stream files are read incrementally, fixed-stride files through a memory
+     * mapping and compressed files one chunk at a time. Legacy files store all
+     * images before all labels, so they are deserialized as a whole when the
+     * reader is opened.
+     */
+    class imagenet_dataset_reader
+    {
+    public:
+        explicit imagenet_dataset_reader(const std::string& filename)
+            : m_filename(filename), m_format(detect_dataset_format(filename))
+        {
+            if (m_format == dataset_format::legacy)
+            {
+                deserialize(filename) >> m_legacy_images >> m_legacy_labels >> m_legacy_numeric_labels;
+                if (m_legacy_labels.size() != m_legacy_images.size() ||
+                    m_legacy_numeric_labels.size() != m_legacy_images.size())
+                    throw dlib::error("Inconsistent dataset file: " + filename);
+                return;
+            }
+
+            if (m_format == dataset_format::fixed)
+            {
+                m_mapped.reset(new mapped_imagenet_dataset(filename));
+                return;
+            }
+
+            if (m_format == dataset_format::compressed)
+            {
+                m_compressed.reset(new impl::compressed_dataset_file(filename));
+                return;
+            }
+
+            m_in.open(filename, std::ios::binary);
+            m_in.ignore(sizeof(impl::stream_magic));
+            deserialize(m_version, m_in);
+            if (m_version != 1 && m_version != impl::stream_version)
+                throw dlib::error("Unsupported dataset version " + std::to_string(m_version) + " in file: " + filename);
+        }
+
+        imagenet_dataset_reader(const imagenet_dataset_reader&) = delete;
+        imagenet_dataset_reader& operator=(const imagenet_dataset_reader&) = delete;
+
+        dataset_format format() const { return m_format; }
+
+        /**
+         * Reads the next image record
+         *
+         * @param img Receives the image
+         * @param label Receives the textual label
+         * @param numeric_label Receives the numeric label
+         * @return false once all records have been read
+         */
+        bool read(
+            matrix<rgb_pixel>& img,
+            std::string& label,
+            unsigned long& numeric_label
+        )
+        {
+            if (m_format == dataset_format::legacy)
+            {
+                if (m_count == m_legacy_images.size())
+                    return false;
+                img = std::move(m_legacy_images[m_count]);
+                label = m_legacy_labels[m_count];
+                numeric_label = m_legacy_numeric_labels[m_count];
+                ++m_count;
+                return true;
+            }
+
+            if (m_format == dataset_format::fixed)
+            {
+                if (m_count == m_mapped->size())
+                    return false;
+                m_mapped->copy_image(m_count, img);
+                label = m_mapped->label(m_count);
+                numeric_label = m_mapped->numeric_label(m_count);
+                ++m_count;
+                return true;
+            }
+
+            if (m_format == dataset_format::compressed)
+            {
+                while (m_chunk_pos == m_chunk_images.size())
+                {
+                    if (m_next_chunk == m_compressed->num_chunks())
+                        return false;
+                    const size_t n = m_compressed->chunk_size(m_next_chunk);
+                    m_chunk_images.resize(n);
+                    m_chunk_labels.resize(n);
+                    m_compressed->decode_chunk(m_next_chunk, m_chunk_images.data(), m_chunk_labels.data(), m_chunk_buffer);
+                    ++m_next_chunk;
+                    m_chunk_pos = 0;
+                }
+                img = std::move(m_chunk_images[m_chunk_pos]);
+                numeric_label = m_chunk_labels[m_chunk_pos];
+                label = m_compressed->class_names()[numeric_label];
+                ++m_chunk_pos;
+                ++m_count;
+                return true;
+            }
+
+            if (m_done)
+                return false;
+
+            int tag = m_in.get();
+            while (tag == impl::stream_class_tag && m_version >= 2)
+            {
+                uint16 id;
+                deserialize(id, m_in);
+                if (id >= m_class_names.size())
+                    m_class_names.resize(id + 1);
+                deserialize(m_class_names[id], m_in);
+                tag = m_in.get();
+            }
+            if (tag == impl::stream_record_tag)
+            {
+                deserialize(img, m_in);
+                if (m_version == 1)
+                {
+                    deserialize(label, m_in);
+                    deserialize(numeric_label, m_in);
+                }
+                else
+                {
+                    uint16 id;
+                    deserialize(id, m_in);
+                    if (id >= m_class_names.size())
+                        throw dlib::error("Corrupted dataset file (image of an unknown class): " + m_filename);
+                    label = m_class_names[id];
+                    numeric_label = id;
+                }
+                ++m_count;
+                return true;
+            }
+            if (tag == impl::stream_end_tag)
+            {
+                size_t expected;
+                deserialize(expected, m_in);
+                if (expected != m_count)
+                    throw dlib::error("Corrupted dataset file (record count mismatch): " + m_filename);
+                m_done = true;
+                return false;
+            }
+            throw dlib::error("Incomplete or corrupted dataset file: " + m_filename);
+        }
+
+    private:
+        std::string m_filename;
+        dataset_format m_format;
+        std::ifstream m_in;
+        unsigned long m_version = 0;
+        std::vector<std::string> m_class_names;
+        std::vector<matrix<rgb_pixel>> m_legacy_images;
+        std::vector<std::string> m_legacy_labels;
+        std::vector<unsigned long> m_legacy_numeric_labels;
+        std::unique_ptr<mapped_imagenet_dataset> m_mapped;
+        std::unique_ptr<impl::compressed_dataset_file> m_compressed;
+        std::vector<matrix<rgb_pixel>> m_chunk_images;
+        std::vector<uint16> m_chunk_labels;
+        std::vector<char> m_chunk_buffer;
+        size_t m_next_chunk = 0;
+        size_t m_chunk_pos = 0;
+        size_t m_count = 0;
+        bool m_done = false;
+    };
+
+    namespace impl
+    {
+        // Listing cache layout:
+        //   [0, 20)  magic, uint32 version, uint64 offset of the directory table
+        //            (little-endian, ~0 while incomplete)
+        //   [20, +)  per class: image count, then (file name, size, modification time) per image
+        //   table    root folder, its modification time, class directory names and
+        //            their modification times
+        const char listing_magic[8] = { 'D', 'L', 'I', 'B', 'I', 'N', 'L', 'S' };
+        const uint32 listing_version = 1;
+        const size_t listing_header_size = 20;
+    }
+
+    /**
+     * Class by class listing of an image folder that is cached next to the output
+     *
+     * When cache_file holds the listing of the same folder and neither the folder
+     * nor any class directory has a different modification time, classes are read
+     * back from it without walking the tree. Otherwise the folder is scanned with
+     * imagenet_listing_scanner and the cache is rewritten as the classes go by; it
+     * is only published once every class has been listed.
+     *
+     * Directory times change when entries are added, removed or renamed, not when
+     * an existing file is rewritten in place, so the cached sizes and modification
+     * times of such a file are stale. Pass refresh_file_times when they matter (a
+     * checkpoint reuses images by size and time): the files are then stat'ed again,
+     * and the cache only saves the directory reads. A cache that turns out to be
+     * unreadable or truncated halfway is dropped and the tree scanned again.
+     */
+    class cached_imagenet_listing
+    {
+    public:
+        /**
+         * @param images_folder Root directory containing class subdirectories
+         * @param cache_file Listing cache path (empty = always scan, no cache)
+         * @param scan_threads Number of directories listed concurrently on a scan
+         * @param refresh_file_times Read the size and modification time of every
+         *        file again when the listing comes from the cache
+         */
+        cached_imagenet_listing(
+            const std::string& images_folder,
+            const std::string& cache_file,
+            unsigned long scan_threads = 8,
+            bool refresh_file_times = false
+        ) : m_images_folder(images_folder), m_folder(directory(images_folder).full_name()),
+            m_cache_file(cache_file), m_scan_threads(scan_threads), m_refresh_file_times(refresh_file_times)
+        {
+            if (!cache_file.empty() && open_cache(cache_file))
+                return;
+
+            m_scanner.reset(new imagenet_listing_scanner(images_folder, scan_threads));
+            if (!cache_file.empty())
+            {
+                m_out.reset(new impl::partial_ofstream(cache_file));
+                write_header(impl::fixed_incomplete);
+            }
+        }
+
+        bool from_cache() const { return !m_scanner; }
+
+        /**
+         * Returns the images of the next class, in numeric label order
+         *
+         * @param images Receives the images of the class, sorted by file name
+         * @return false once every class has been returned
+         */
+        bool next_class(std::vector<imagenet_info>& images)
+        {
+            if (m_scanner)
+                return next_scanned_class(images);
+
+            if (m_next_class >= m_class_dirs.size())
+                return false;
+
+            try
+            {
+                read_cached_class(images);
+            }
+            catch (const std::exception&)
+            {
+                rescan();
+                return next_scanned_class(images);
+            }
+            ++m_next_class;
+            return true;
+        }
+
+    private:
+        void read_cached_class(std::vector<imagenet_info>& images)
+        {
+            imagenet_info temp;
+            temp.numeric_label = static_cast<unsigned long>(m_next_class);
+            temp.class_dir = m_class_dirs[m_next_class];
+            temp.label = extract_desc_class(temp.class_dir);
+            const std::string dir = m_folder + directory::get_separator() + temp.class_dir;
+
+            uint64 count = 0;
+            std::string name;
+            deserialize(count, m_in);
+            if (!m_in || count > m_table_offset)
+                throw dlib::error("Corrupted listing cache");
+            images.assign(count, temp);
+            for (auto& info : images)
+            {
+                deserialize(name, m_in);
+                deserialize(info.file_size, m_in);
+                deserialize(info.last_modified, m_in);
+                info.filename = dir + directory::get_separator() + name;
+                if (m_refresh_file_times && !impl::read_file_times(info.filename, info.file_size, info.last_modified))
+                    throw dlib::error("Listed file is gone: " + info.filename);
+            }
+            if (!m_in || static_cast<uint64>(m_in.tellg()) > m_table_offset)
+                throw dlib::error("Corrupted listing cache");
+        }
+
+        /**
+         * Drops an unreadable cache and lists the tree again, skipping the classes
+         * that were already returned from the cache
+         */
+        void rescan()
+        {
+            std::cout << "Listing cache " << m_cache_file << " is unreadable, scanning the image directory" << std::endl;
+            close_cache();
+            m_scanner.reset(new imagenet_listing_scanner(m_images_folder, m_scan_threads));
+            m_out.reset(new impl::partial_ofstream(m_cache_file));
+            write_header(impl::fixed_incomplete);
+            std::vector<imagenet_info> skipped;
+            for (size_t i = 0; i < m_next_class && next_scanned_class(skipped); ++i) {}
+        }
+
+        bool next_scanned_class(std::vector<imagenet_info>& images)
+        {
+            int64 dir_last_modified = -1;
+            if (!m_scanner->next_class(images, &dir_last_modified))
+            {
+                if (m_out)
+                {
+                    // Every class is in: append the directory table and publish
+                    const uint64 table_offset = static_cast<uint64>(m_out->tellp());
+                    serialize(m_folder, *m_out);
+                    serialize(m_scanner->root_last_modified(), *m_out);
+                    serialize(m_class_dirs, *m_out);
+                    serialize(m_class_times, *m_out);
+                    m_out->seekp(0);
+                    write_header(table_offset);
+                    m_out->commit();
+                    m_out.reset();
+                }
+                return false;
+            }
+
+            if (m_out)
+            {
+                m_class_dirs.push_back(m_scanner->class_dir(m_class_dirs.size()));
+                m_class_times.push_back(dir_last_modified);
+                serialize(static_cast<uint64>(images.size()), *m_out);
+                for (const auto& info : images)
+                {
+                    serialize(impl::file_name_part(info.filename), *m_out);
+                    serialize(info.file_size, *m_out);
+                    serialize(info.last_modified, *m_out);
+                }
+            }
+            return true;
+        }
+
+        void write_header(uint64 table_offset)
+        {
+            char buf[impl::listing_header_size];
+            std::copy(impl::listing_magic, impl::listing_magic + sizeof(impl::listing_magic), buf);
+            impl::store_le(buf + 8, impl::listing_version, 4);
+            impl::store_le(buf + 12, table_offset, 8);
+            m_out->write(buf, sizeof(buf));
+        }
+
+        /**
+         * Opens the cache if it describes the current tree, leaving m_in on the first class
+         */
+        bool open_cache(const std::string& cache_file)
+        {
+            try
+            {
+                m_in.open(cache_file, std::ios::binary);
+                char buf[impl::listing_header_size];
+                if (!m_in || !m_in.read(buf, sizeof(buf)) ||
+                    !std::equal(impl::listing_magic, impl::listing_magic + sizeof(impl::listing_magic), buf) ||
+                    impl::load_le(buf + 8, 4) != impl::listing_version)
+                    return close_cache();
+                const uint64 table_offset = impl::load_le(buf + 12, 8);
+                if (table_offset == impl::fixed_incomplete)
+                    return close_cache();
+                m_table_offset = table_offset;
+
+                std::string folder;
+                int64 root_last_modified = 0;
+                m_in.seekg(static_cast<std::streamoff>(table_offset));
+                deserialize(folder, m_in);
+                deserialize(root_last_modified, m_in);
+                deserialize(m_class_dirs, m_in);
+                deserialize(m_class_times, m_in);
+                if (folder != m_folder || m_class_dirs.size() != m_class_times.size() ||
+                    root_last_modified != impl::path_last_modified(m_folder))
+                    return close_cache();
+                for (size_t i = 0; i < m_class_dirs.size(); ++i)
+                {
+                    if (m_class_times[i] != impl::path_last_modified(m_folder + directory::get_separator() + m_class_dirs[i]))
+                        return close_cache();
+                }
+
+                m_in.seekg(static_cast<std::streamoff>(impl::listing_header_size));
+                return true;
+            }
+            catch (const std::exception&)
+            {
+                // An unreadable cache is only a missed shortcut
+                return close_cache();
+            }
+        }
+
+        bool close_cache()
+        {
+            m_in.close();
+            m_class_dirs.clear();
+            m_class_times.clear();
+            return false;
+        }
+
+        std::string m_images_folder;
+        std::string m_folder;
+        std::string m_cache_file;
+        unsigned long m_scan_threads;
+        bool m_refresh_file_times;
+        std::vector<std::string> m_class_dirs;
+        std::vector<int64> m_class_times;
+
+        // Reading back a valid cache
+        std::ifstream m_in;
+        uint64 m_table_offset = 0;
+        size_t m_next_class = 0;
+
+        // Scanning (and rewriting the cache, if any)
+        std::unique_ptr<imagenet_listing_scanner> m_scanner;
+        std::unique_ptr<impl::partial_ofstream> m_out;
+    };
+
+    /**
+     * How a build detects duplicate images
+     *
+     * - none: every image is written
+     * - exact: images whose files have the same bytes (128-bit murmur hash)
+     * - perceptual: images whose 64-bit difference hashes differ in at most 3 bits and
+     *   whose coarse luminance is nearly the same, which also catches re-encoded or
+     *   slightly altered copies
+     */
+    enum class dedup_mode
+    {
+        none,
+        exact,
+        perceptual
+    };
+
+    /**
+     * Parses a deduplication mode as given on the command line ("none", "exact" or "perceptual")
+     */
+    dedup_mode parse_dedup_mode(const std::string& name)
+    {
+        if (name == "none") return dedup_mode::none;
+        if (name == "exact") return dedup_mode::exact;
+        if (name == "perceptual") return dedup_mode::perceptual;
+        throw dlib::error("Unknown deduplication mode: " + name + " (expected none, exact or perceptual)");
+    }
+
+    /**
+     * Settings of a dataset build
+     */
+    struct imagenet_build_options
+    {
+        std::vector<std::pair<long, long>> sizes{ {224, 224} }; // Output sizes as (rows, cols), one dataset each
+        unsigned long num_threads = 1;                  // Worker threads used for decoding
+        unsigned long scan_threads = 8;                 // Class directories listed concurrently
+        unsigned long io_threads = 4;                   // Threads reading files ahead of the decode (0 = read in the decode threads)
+        size_t prefetch = 64;                           // Files read ahead of the decode (at least twice num_threads)
+        dataset_format format = dataset_format::stream; // Output format
+        pixel_layout layout = pixel_layout::interleaved; // Pixel layout (planar layouts need the fixed format)
+        std::string checkpoint_dir;                     // Checkpoint directory (empty = none)
+        unsigned long num_shards = 1;                   // Number of output shards
+        bool jpeg_dct_scaling = false;                  // Decode JPEGs at 1/2, 1/4 or 1/8 scale when large enough
+        bool fixed_point_resize = false;                // Resize with resize_rgb_image_bilinear() instead of dlib's resize_image()
+        bool listing_cache = true;                      // Reuse/refresh "<output_file>.listing" (see cached_imagenet_listing)
+        bool print_stats = false;                       // Print per-stage timings with each progress line
+        std::string stats_file;                         // Write the final per-stage timings as JSON (empty = none)
+        bool skip_failed = true;                        // Skip images that failed in an earlier build and did not change
+        dedup_mode dedup = dedup_mode::none;            // Duplicate detection (only the first copy is written)
+        bool keep_duplicates = false;                   // Report duplicates but write them anyway
+        std::string dedup_report;                       // Write "duplicate<TAB>original" lines to this file (empty = none)
+    };
+
+    /**
+     * Creates the writer for one output size of a build: a plain dataset file, or a
+     * set of shards plus an index when options.num_shards > 1
+     */
+    std::unique_ptr<imagenet_dataset_writer> make_dataset_writer(
+        const std::string& filename,
+        const imagenet_build_options& options,
+        long rows,
+        long cols
+    )
+    {
+        if (options.num_shards > 1)
+        {
+            return std::unique_ptr<imagenet_dataset_writer>(new sharded_dataset_writer(
+                filename, options.num_shards, options.format, rows, cols, options.layout));
+        }
+        return make_dataset_writer(filename, options.format, rows, cols, options.layout);
+    }
+
+    /**
+     * Name of the output file of size k of a build
+     * With a single size this is output_file itself; otherwise the size is inserted
+     * before the extension, e.g. imagenet.dat -> imagenet_64.dat (or imagenet_48x64.dat).
+     */
+    std::string get_sized_output_file(
+        const std::string& output_file,
+        const imagenet_build_options& options,
+        size_t k
+    )
+    {
+        if (options.sizes.size() == 1)
+            return output_file;
+
+        const long rows = options.sizes[k].first, cols = options.sizes[k].second;
+        const std::string tag = rows == cols ? std::to_string(rows) : std::to_string(rows) + "x" + std::to_string(cols);
+        const size_t sep = output_file.find_last_of("/\\");
+        size_t dot = output_file.find_last_of('.');
+        if (dot == std::string::npos || (sep != std::string::npos && dot < sep))
+            dot = output_file.size();
+        return output_file.substr(0, dot) + "_" + tag + output_file.substr(dot);
+    }
+
+    /**
+     * Checks the output sizes of a build: at least one, all positive and none listed
+     * twice (two writers would then write the same file)
+     */
+    void check_build_sizes(const std::vector<std::pair<long, long>>& sizes)
+    {
+        if (sizes.empty())
+            throw dlib::error("A build needs at least one output size");
+        for (size_t k = 0; k < sizes.size(); ++k)
+        {
+            const std::string name = std::to_string(sizes[k].first) + "x" + std::to_string(sizes[k].second);
+            if (sizes[k].first <= 0 || sizes[k].second <= 0)
+                throw dlib::error("Invalid output size: " + name);
+            if (std::find(sizes.begin(), sizes.begin() + k, sizes[k]) != sizes.begin() + k)
+                throw dlib::error("Output size listed twice: " + name);
+        }
+    }
+
+    /**
+     * Opens one writer per output size of a build
+     */
+    std::vector<std::unique_ptr<imagenet_dataset_writer>> make_dataset_writers(
+        const std::string& output_file,
+        const imagenet_build_options& options
+    )
+    {
+        check_build_sizes(options.sizes);
+        std::vector<std::unique_ptr<imagenet_dataset_writer>> writers;
+        for (size_t k = 0; k < options.sizes.size(); ++k)
+        {
+            const std::string filename = get_sized_output_file(output_file, options, k);
+            std::cout << "Writing " << options.sizes[k].first << "x" << options.sizes[k].second
+                << " dataset to: " << filename << std::endl;
+            writers.push_back(make_dataset_writer(filename, options, options.sizes[k].first, options.sizes[k].second));
+        }
+        return writers;
+    }
+
+    namespace impl
+    {
+        /**
+         * Content hash of an image, used to find duplicates
+         */
+        struct image_hash
+        {
+            uint64 h1 = 0;
+            uint64 h2 = 0;
+
+            bool operator==(const image_hash& other) const { return h1 == other.h1 && h2 == other.h2; }
+        };
+
+        struct image_hash_hasher
+        {
+            size_t operator()(const image_hash& h) const { return static_cast<size_t>(h.h1 ^ (h.h2 * 0x9E3779B97F4A7C15ull)); }
+        };
+
+        inline image_hash hash_bytes(const void* data, size_t size)
+        {
+            image_hash h;
+            const auto murmur = murmur_hash3_128bit(data, static_cast<int>(size));
+            h.h1 = murmur.first;
+            h.h2 = murmur.second;
+            return h;
+        }
+
+        /**
+         * The 9x8 grid of mean luminances a difference hash is computed from, kept to
+         * confirm that two images with the same hash really look alike
+         */
+        typedef std::array<unsigned char, 72> image_thumbnail;
+
+        /**
+         * 64-bit difference hash (dHash) of an image
+         * The image is averaged down to a 9x8 grid of luminances and each bit tells
+         * whether a cell is darker than its right neighbour, so the hash survives
+         * resizing, recompression and small color changes.
+         *
+         * @param thumbnail If not null, receives the luminance grid
+         */
+        inline image_hash difference_hash(const matrix<rgb_pixel>& img, image_thumbnail* thumbnail = nullptr)
+        {
+            float sums[8][9] = {};
+            float counts[8][9] = {};
+            for (long r = 0; r < img.nr(); ++r)
+            {
+                const long y = r * 8 / img.nr();
+                for (long c = 0; c < img.nc(); ++c)
+                {
+                    const long x = c * 9 / img.nc();
+                    const rgb_pixel& p = img(r, c);
+                    sums[y][x] += 0.299f * p.red + 0.587f * p.green + 0.114f * p.blue;
+                    counts[y][x] += 1;
+                }
+            }
+
+            image_hash h;
+            for (int y = 0; y < 8; ++y)
+            {
+                for (int x = 0; x < 8; ++x)
+                {
+                    const float left = counts[y][x] > 0 ? sums[y][x] / counts[y][x] : 0;
+                    const float right = counts[y][x + 1] > 0 ? sums[y][x + 1] / counts[y][x + 1] : 0;
+                    if (left < right)
+                        h.h1 |= uint64(1) << (y * 8 + x);
+                }
+            }
+            if (thumbnail)
+            {
+                for (int y = 0; y < 8; ++y)
+                {
+                    for (int x = 0; x < 9; ++x)
+                    {
+                        const float mean = counts[y][x] > 0 ? sums[y][x] / counts[y][x] : 0;
+                        (*thumbnail)[y * 9 + x] = static_cast<unsigned char>(std::min(255.0f, mean + 0.5f));
+                    }
+                }
+            }
+            return h;
+        }
+
+        /**
+         * Hash of a decoded image in the given mode: the smallest output size for
+         * perceptual hashing, the pixels of every size for exact hashing (used
+         * where the file bytes are not at hand)
+         *
+         * @param thumbnail If not null, receives the luminance grid of a perceptual hash
+         */
+        inline image_hash hash_images(
+            const std::vector<matrix<rgb_pixel>>& imgs,
+            dedup_mode mode,
+            image_thumbnail* thumbnail = nullptr
+        )
+        {
+            if (imgs.empty())
+                return image_hash();
+            if (mode == dedup_mode::perceptual)
+            {
+                size_t smallest = 0;
+                for (size_t k = 1; k < imgs.size(); ++k)
+                {
+                    if (imgs[k].size() < imgs[smallest].size())
+                        smallest = k;
+                }
+                return difference_hash(imgs[smallest], thumbnail);
+            }
+
+            image_hash h;
+            for (const auto& img : imgs)
+            {
+                const image_hash part = img.size() != 0 ? hash_bytes(&img(0, 0), img.size() * sizeof(rgb_pixel)) : image_hash();
+                h.h1 = h.h1 * 31 + part.h1;
+                h.h2 = h.h2 * 31 + part.h2;
+            }
+            return h;
+        }
+
+        /**
+         * Table of the images kept so far, keyed by content hash
+         * It holds one entry per kept image (roughly 100 bytes each, 300 in perceptual
+         * mode) and is only used by the thread writing the outputs, which sees images
+         * in listing order, so the first copy of an image is always the one kept.
+         *
+         * Perceptual hashes are indexed by their four 16-bit bands: two hashes at most
+         * max_hash_distance <= 3 bits apart share at least one band, so the images of
+         * the buckets of the four bands are the only candidates to compare. A match
+         * also needs the luminance grids to differ by at most max_thumbnail_difference
+         * levels on average, so unrelated images with close hashes are kept. Hashes
+         * with fewer than min_hash_bits bits set or clear come from flat or smoothly
+         * shaded images, which mostly hash alike whatever they show; such images are
+         * never treated as duplicates.
+         */
+        class image_deduplicator
+        {
+        public:
+            static const int max_thumbnail_difference = 4;
+            static const size_t min_hash_bits = 8;
+            static const size_t max_hash_distance = 3;
+            static const int hash_bands = 4;
+
+            image_deduplicator(dedup_mode mode, bool keep_duplicates)
+                : m_mode(mode), m_keep(keep_duplicates) {}
+
+            bool enabled() const { return m_mode != dedup_mode::none; }
+
+            /**
+             * Looks the image up, adding it to the table if it is new
+             *
+             * @param path Name of the image in the reports (class directory and file name)
+             * @param thumbnail Luminance grid of the image (perceptual mode only)
+             * @return true if the image should be written: it is new, or duplicates are kept
+             */
+            bool keep(const image_hash& hash, const std::string& path, const image_thumbnail& thumbnail = image_thumbnail())
+            {
+                if (!enabled())
+                    return true;
+                if (m_mode == dedup_mode::perceptual)
+                    return keep_similar(hash.h1, path, thumbnail);
+                const auto inserted = m_seen.emplace(hash, path);
+                if (inserted.second)
+                    return true;
+                m_duplicates.emplace_back(path, inserted.first->second);
+                return m_keep;
+            }
+
+            size_t duplicates() const { return m_duplicates.size(); }
+
+            /**
+             * Writes one "duplicate<TAB>original" line per duplicate found
+             */
+            void save_report(const std::string& filename) const
+            {
+                std::ofstream out(filename);
+                for (const auto& d : m_duplicates)
+                    out << d.first << '\t' << d.second << '\n';
+                if (!out)
+                    throw dlib::error("Unable to write duplicate report: " + filename);
+            }
+
+            void print_summary(std::ostream& out) const
+            {
+                if (!enabled())
+                    return;
+                out << "Duplicates (" << (m_mode == dedup_mode::exact ? "exact" : "perceptual") << "): "
+                    << m_duplicates.size() << (m_keep ? " found and kept" : " found and dropped") << std::endl;
+            }
+
+        private:
+            struct similar_image
+            {
+                uint64 hash;
+                image_thumbnail thumbnail;
+                std::string path;
+            };
+
+            static uint16 hash_band(uint64 hash, int band)
+            {
+                return static_cast<uint16>(hash >> (16 * band));
+            }
+
+            bool keep_similar(uint64 hash, const std::string& path, const image_thumbnail& thumbnail)
+            {
+                static_assert(max_hash_distance < hash_bands, "close hashes must share a band");
+                const size_t bits = std::bitset<64>(hash).count();
+                if (bits < min_hash_bits || bits > 64 - min_hash_bits)
+                    return true;
+
+                // The earliest kept image that matches, whichever band finds it
+                size_t original = m_similar.size();
+                for (int band = 0; band < hash_bands; ++band)
+                {
+                    const auto range = m_bands[band].equal_range(hash_band(hash, band));
+                    for (auto it = range.first; it != range.second; ++it)
+                    {
+                        const similar_image& candidate = m_similar[it->second];
+                        if (it->second >= original || std::bitset<64>(hash ^ candidate.hash).count() > max_hash_distance)
+                            continue;
+                        int difference = 0;
+                        for (size_t i = 0; i < thumbnail.size(); ++i)
+                            difference += std::abs(static_cast<int>(thumbnail[i]) - candidate.thumbnail[i]);
+                        if (difference <= max_thumbnail_difference * static_cast<int>(thumbnail.size()))
+                            original = it->second;
+                    }
+                }
+                if (original != m_similar.size())
+                {
+                    m_duplicates.emplace_back(path, m_similar[original].path);
+                    return m_keep;
+                }
+
+                for (int band = 0; band < hash_bands; ++band)
+                    m_bands[band].emplace(hash_band(hash, band), m_similar.size());
+                m_similar.push_back(similar_image{hash, thumbnail, path});
+                return true;
+            }
+
+            const dedup_mode m_mode;
+            const bool m_keep;
+            std::unordered_map<image_hash, std::string, image_hash_hasher> m_seen;
+            std::vector<similar_image> m_similar;                           // Perceptual mode: kept images
+            std::unordered_multimap<uint16, size_t> m_bands[hash_bands];    // Band value -> index in m_similar
+            std::vector<std::pair<std::string, std::string>> m_duplicates; // (duplicate, original)
+        };
+
+        /**
+         * Outcome of decoding one image of a batch
+         */
+        struct processed_image
+        {
+            enum status_type : char { not_processed, processed, failed };
+
+            std::vector<matrix<rgb_pixel>> imgs; // One image per output size
+            std::string error;
+            status_type status = not_processed;
+            bool read_failed = false;            // The file could not be read, as opposed to decoded
+            image_hash hash;                     // Content hash, when deduplicating
+            image_thumbnail thumbnail;           // Luminance grid confirming a perceptual hash
+            std::vector<imagenet_channel_stats> stats; // Pixel statistics of each image
+        };
+
+        /**
+         * Fills r.stats while the worker that produced r.imgs still has them in cache
+         */
+        inline void compute_image_stats(processed_image& r)
+        {
+            r.stats.assign(r.imgs.size(), imagenet_channel_stats());
+            for (size_t k = 0; k < r.imgs.size(); ++k)
+                r.stats[k].add(r.imgs[k]);
+        }
+
+        /**
+         * Reads files ahead of the decode threads
+         *
+         * Files are queued with add() in the order they will be decoded and read by
+         * a few I/O threads, at most max_ahead files beyond the ones already taken,
+         * so the decode threads find the bytes in memory instead of waiting on the
+         * file system; this matters most on network storage, where every open pays
+         * the full latency. Read errors are handed to the caller of take().
+         */
+        class file_prefetcher
+        {
+        public:
+            file_prefetcher(
+                unsigned long num_threads,
+                size_t max_ahead,
+                imagenet_build_stats* stats = nullptr
+            ) : m_max_ahead(std::max<size_t>(1, max_ahead)), m_stats(stats)
+            {
+                for (unsigned long i = 0; i < num_threads; ++i)
+                    m_workers.emplace_back([this]() { worker_loop(); });
+            }
+
+            ~file_prefetcher()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_stop = true;
+                }
+                m_cond.notify_all();
+                for (auto& t : m_workers)
+                    t.join();
+            }
+
+            file_prefetcher(const file_prefetcher&) = delete;
+            file_prefetcher& operator=(const file_prefetcher&) = delete;
+
+            /**
+             * Queues a file
+             * @return Its ticket, to be passed to take()
+             */
+            size_t add(const std::string& filename)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_queued.push_back(filename);
+                m_cond.notify_all();
+                return m_num_added++;
+            }
+
+            /**
+             * Blocks until the file of a ticket has been read and hands its bytes over
+             * (each ticket must be taken exactly once)
+             */
+            std::vector<unsigned char> take(size_t ticket)
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                auto it = m_done.find(ticket);
+                while (it == m_done.end())
+                {
+                    m_cond.wait(lock);
+                    it = m_done.find(ticket);
+                }
+                read_file f = std::move(it->second);
+                m_done.erase(it);
+                ++m_num_taken;
+                lock.unlock();
+                m_cond.notify_all();
+
+                if (f.error)
+                    std::rethrow_exception(f.error);
+                return std::move(f.data);
+            }
+
+        private:
+            struct read_file
+            {
+                std::vector<unsigned char> data;
+                std::exception_ptr error;
+            };
+
+            void worker_loop()
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (true)
+                {
+                    m_cond.wait(lock, [this]() {
+                        return m_stop || (m_next_to_read < m_num_added && m_next_to_read < m_num_taken + m_max_ahead);
+                    });
+                    if (m_stop)
+                        return;
+
+                    const size_t ticket = m_next_to_read++;
+                    const std::string filename = std::move(m_queued.front());
+                    m_queued.pop_front();
+                    lock.unlock();
+
+                    read_file f;
+                    const auto start = std::chrono::steady_clock::now();
+                    try
+                    {
+                        f.data = read_file_bytes(filename);
+                        if (m_stats)
+                            m_stats->record(imagenet_build_stats::read_stage, std::chrono::steady_clock::now() - start, f.data.size());
+                    }
+                    catch (...)
+                    {
+                        f.error = std::current_exception();
+                    }
+
+                    lock.lock();
+                    m_done.emplace(ticket, std::move(f));
+                    m_cond.notify_all();
+                }
+            }
+
+            const size_t m_max_ahead;
+            imagenet_build_stats* const m_stats;
+            std::mutex m_mutex;
+            std::condition_variable m_cond;
+            std::deque<std::string> m_queued;       // Files added but not yet being read, in ticket order
+            std::map<size_t, read_file> m_done;     // Files read but not yet taken
+            size_t m_num_added = 0;
+            size_t m_next_to_read = 0;
+            size_t m_num_taken = 0;
+            bool m_stop = false;
+            std::vector<std::thread> m_workers;
+        };
+
+        /**
+         * Decodes and resizes one image of a build, from its prefetched bytes if a
+         * prefetcher is given
+         * A file that cannot be read fails with r.read_failed set, so that it is not
+         * taken for an undecodable image.
+         */
+        void process_image(
+            const std::string& filename,
+            const imagenet_build_options& options,
+            processed_image& r,
+            imagenet_build_stats* stats,
+            file_prefetcher* prefetcher,
+            size_t ticket
+        )
+        {
+            const auto start = std::chrono::steady_clock::now();
+            std::vector<unsigned char> data;
+            try
+            {
+                if (prefetcher)
+                {
+                    data = prefetcher->take(ticket);
+                    if (stats)
+                        stats->record(imagenet_build_stats::wait_stage, std::chrono::steady_clock::now() - start);
+                }
+                else
+                {
+                    data = read_file_bytes(filename);
+                    if (stats)
+                        stats->record(imagenet_build_stats::read_stage, std::chrono::steady_clock::now() - start, data.size());
+                }
+            }
+            catch (const std::exception& e)
+            {
+                // Not a property of the image: a later build reads it again
+                r.error = e.what();
+                r.status = processed_image::failed;
+                r.read_failed = true;
+                if (stats)
+                    stats->record_failure();
+                return;
+            }
+
+            try
+            {
+                r.imgs = load_and_resize_image(data, filename, options.sizes, options.jpeg_dct_scaling, options.fixed_point_resize, stats);
+                if (options.dedup == dedup_mode::exact)
+                    r.hash = hash_bytes(data.data(), data.size());
+                else if (options.dedup == dedup_mode::perceptual)
+                    r.hash = hash_images(r.imgs, options.dedup, &r.thumbnail);
+                compute_image_stats(r);
+                r.status = processed_image::processed;
+            }
+            catch (const std::exception& e)
+            {
+                r.error = e.what();
+                r.status = processed_image::failed;
+                if (stats)
+                    stats->record_failure();
+            }
+            if (stats)
+                stats->record_image(filename, std::chrono::steady_clock::now() - start);
+        }
+
+        /**
+         * Decodes and resizes listing[indices[0..count)] on the thread pool
+         * Images are handed to the threads in order, which keeps the files a
+         * prefetcher reads ahead in step with the decode. With a prefetcher, image i
+         * must have been queued with ticket first_ticket + i. Images that were not
+         * reached because of an interruption stay not_processed.
+         */
+        void process_images(
+            thread_pool& pool,
+            const std::vector<imagenet_info>& listing,
+            const size_t* indices,
+            size_t count,
+            const imagenet_build_options& options,
+            std::vector<processed_image>& results,
+            imagenet_build_stats* stats = nullptr,
+            file_prefetcher* prefetcher = nullptr,
+            size_t first_ticket = 0
+        )
+        {
+            results.resize(count);
+            for (auto& r : results)
+                r.status = processed_image::not_processed;
+
+            std::atomic<size_t> next{0};
+            const long num_tasks = static_cast<long>(std::max<size_t>(1, pool.num_threads_in_pool()));
+            parallel_for(pool, 0, num_tasks, [&](long)
+            {
+                for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1))
+                {
+                    auto& r = results[i];
+                    if (g_terminate_flag.load())
+                    {
+                        // Prefetched bytes must still be collected
+                        if (prefetcher)
+                        {
+                            try { prefetcher->take(first_ticket + i); }
+                            catch (...) {}
+                        }
+                        continue;
+                    }
+                    process_image(listing[indices[i]].filename, options, r, stats, prefetcher, first_ticket + i);
+                }
+            });
+        }
+
+        /**
+         * Source file of an image stored in a checkpoint shard
+         */
+        struct checkpoint_entry
+        {
+            std::string name;
+            uint64 file_size = 0;
+            int64 last_modified = 0;
+        };
+
+        inline void serialize(const checkpoint_entry& item, std::ostream& out)
+        {
+            dlib::serialize(item.name, out);
+            dlib::serialize(item.file_size, out);
+            dlib::serialize(item.last_modified, out);
+        }
+
+        inline void deserialize(checkpoint_entry& item, std::istream& in)
+        {
+            dlib::deserialize(item.name, in);
+            dlib::deserialize(item.file_size, in);
+            dlib::deserialize(item.last_modified, in);
+        }
+
+        /**
+         * Index of a checkpoint directory: build sizes, decode settings, the resampler
+         * the shards were resized with and the completed class shards (class directory
+         * name -> number of images in the shard)
+         */
+        struct checkpoint_manifest
+        {
+            std::vector<std::pair<long, long>> sizes;
+            bool jpeg_dct_scaling = false;
+            int resampler = 0;
+            std::map<std::string, uint64> shards;
+        };
+
+        const int checkpoint_version = 4;
+
+        /**
+         * Identifies the resize of resize_rgb_image_bilinear() in a manifest, where 0
+         * stands for dlib's resize_image(). Bump it whenever a change to the resize
+         * alters output pixels, so checkpoints built with the old one are decoded again.
+         */
+        const int checkpoint_resampler = 1;
+
+        inline std::string manifest_path(const std::string& dir) { return dir + "/manifest.dat"; }
+        inline std::string shard_path(const std::string& dir, const std::string& class_dir) { return dir + "/" + class_dir + ".shard"; }
+
+        checkpoint_manifest load_checkpoint_manifest(const std::string& dir)
+        {
+            checkpoint_manifest manifest;
+            if (!file_exists(manifest_path(dir)))
+                return manifest;
+
+            std::ifstream in(manifest_path(dir), std::ios::binary);
+            int version = 0;
+            dlib::deserialize(version, in);
+            if (version != checkpoint_version)
+                return manifest;
+            dlib::deserialize(manifest.sizes, in);
+            dlib::deserialize(manifest.jpeg_dct_scaling, in);
+            dlib::deserialize(manifest.resampler, in);
+            dlib::deserialize(manifest.shards, in);
+            return manifest;
+        }
+
+        void save_checkpoint_manifest(const std::string& dir, const checkpoint_manifest& manifest)
+        {
+            const std::string tmp = manifest_path(dir) + ".tmp";
+            dlib::serialize(tmp) << checkpoint_version << manifest.sizes << manifest.jpeg_dct_scaling << manifest.resampler
+                << manifest.shards;
+            publish_file(tmp, manifest_path(dir));
+        }
+
+        /**
+         * Sequential access to a checkpoint shard: a version, the entry table, then
+         * for each entry one serialized image per build size
+         */
+        class checkpoint_shard_reader
+        {
+        public:
+            explicit checkpoint_shard_reader(const std::string& filename)
+                : m_in(filename, std::ios::binary)
+            {
+                if (!m_in)
+                    throw dlib::error("Unable to open checkpoint shard: " + filename);
+                int version = 0;
+                dlib::deserialize(version, m_in);
+                if (version != checkpoint_version)
+                    throw dlib::error("Unsupported checkpoint shard version in: " + filename);
+                dlib::deserialize(m_entries, m_in);
+            }
+
+            const std::vector<checkpoint_entry>& entries() const { return m_entries; }
+            void read_images(std::vector<matrix<rgb_pixel>>& imgs, size_t num_sizes)
+            {
+                imgs.resize(num_sizes);
+                for (auto& img : imgs)
+                    dlib::deserialize(img, m_in);
+            }
+
+        private:
+            std::ifstream m_in;
+            std::vector<checkpoint_entry> m_entries;
+        };
+
+        void write_checkpoint_shard(
+            const std::string& filename,
+            const std::vector<checkpoint_entry>& entries,
+            const std::vector<const std::vector<matrix<rgb_pixel>>*>& images
+        )
+        {
+            const std::string tmp = filename + ".tmp";
+            {
+                std::ofstream out(tmp, std::ios::binary);
+                dlib::serialize(checkpoint_version, out);
+                dlib::serialize(entries, out);
+                for (auto imgs : images)
+                {
+                    for (const auto& img : *imgs)
+                        dlib::serialize(img, out);
+                }
+                if (!out)
+                    throw dlib::error("Error while writing checkpoint shard: " + tmp);
+            }
+            publish_file(tmp, filename);
+        }
+
+        /**
+         * Image that failed to decode in an earlier build
+         */
+        struct quarantined_image
+        {
+            std::string path;                // Class directory and file name, e.g. "n01440764_tench/img.jpg"
+            uint64 file_size = 0;
+            int64 last_modified = 0;
+            std::string error;
+        };
+
+        inline void serialize(const quarantined_image& item, std::ostream& out)
+        {
+            dlib::serialize(item.path, out);
+            dlib::serialize(item.file_size, out);
+            dlib::serialize(item.last_modified, out);
+            dlib::serialize(item.error, out);
+        }
+
+        inline void deserialize(quarantined_image& item, std::istream& in)
+        {
+            dlib::deserialize(item.path, in);
+            dlib::deserialize(item.file_size, in);
+            dlib::deserialize(item.last_modified, in);
+            dlib::deserialize(item.error, in);
+        }
+
+        const int quarantine_version = 1;
+
+        /**
+         * Skip-list of the images that failed to decode, kept across builds
+         *
+         * An image that failed before is skipped without being read, as long as its
+         * size and modification time are unchanged; a file that was replaced is
+         * decoded again. save() only keeps the entries of images that are still
+         * listed, so removed files drop out of the list. Only decode errors belong
+         * here: a file that could not be read (a transient storage error) is not
+         * recorded and is read again by the next build.
+         */
+        class image_quarantine
+        {
+        public:
+            /**
+             * @param filename Path of the skip-list, loaded if it exists
+             * @param skip_known false to decode the listed images again (they are
+             *        still recorded if they fail again)
+             */
+            image_quarantine(const std::string& filename, bool skip_known)
+                : m_filename(filename), m_skip_known(skip_known)
+            {
+                if (!file_exists(filename))
+                    return;
+                try
+                {
+                    std::ifstream in(filename, std::ios::binary);
+                    int version = 0;
+                    dlib::deserialize(version, in);
+                    if (version != quarantine_version)
+                        return;
+                    std::vector<quarantined_image> entries;
+                    dlib::deserialize(entries, in);
+                    for (auto& e : entries)
+                    {
+                        const std::string path = e.path;
+                        m_known.emplace(path, std::move(e));
+                    }
+                }
+                catch (const std::exception&)
+                {
+                    m_known.clear(); // An unreadable list only costs a retry of the images it held
+                }
+            }
+
+            const std::string& filename() const { return m_filename; }
+
+            /**
+             * Tells that the sizes and times of the listing may be stale (cached
+             * listing, see cached_imagenet_listing): those of the listed images are
+             * then read again before they are compared or recorded
+             */
+            void refresh_file_times(bool refresh) { m_refresh = refresh; }
+
+            /**
+             * @return true if the image failed in an earlier build and has not changed since
+             */
+            bool skip(const imagenet_info& info)
+            {
+                const auto it = m_known.find(key(info));
+                if (it == m_known.end() || it->second.file_size != info.file_size ||
+                    it->second.last_modified != info.last_modified)
+                    return false;
+                if (!m_skip_known)
+                    return false;
+                m_current.insert(*it);
+                ++m_skipped;
+                return true;
+            }
+
+            /**
+             * Drops the quarantined images from a listing
+             */
+            void filter(std::vector<imagenet_info>& images)
+            {
+                for (auto& info : images)
+                {
+                    if (m_refresh && m_known.count(key(info)) != 0)
+                        read_file_times(info.filename, info.file_size, info.last_modified);
+                }
+                images.erase(std::remove_if(images.begin(), images.end(),
+                    [this](const imagenet_info& info) { return skip(info); }), images.end());
+            }
+
+            /**
+             * Records an image that just failed to decode
+             */
+            void add(const imagenet_info& info, const std::string& error)
+            {
+                quarantined_image e;
+                e.path = key(info);
+                e.file_size = info.file_size;
+                e.last_modified = info.last_modified;
+                if (m_refresh)
+                    read_file_times(info.filename, e.file_size, e.last_modified);
+                e.error = error;
+                m_current[e.path] = e;
+                ++m_added;
+            }
+
+            size_t skipped() const { return m_skipped; }
+            size_t added() const { return m_added; }
+
+            /**
+             * Writes the list of this build
+             *
+             * @param complete false if the listing was not gone through entirely, in
+             *        which case the entries not seen yet are kept
+             */
+            void save(bool complete = true) const
+            {
+                std::vector<quarantined_image> entries;
+                for (const auto& e : m_current)
+                    entries.push_back(e.second);
+                for (const auto& e : m_known)
+                {
+                    if (!complete && m_current.count(e.first) == 0)
+                        entries.push_back(e.second);
+                }
+                if (entries.empty() && !file_exists(m_filename))
+                    return;
+                const std::string tmp = m_filename + ".tmp";
+                dlib::serialize(tmp) << quarantine_version << entries;
+                publish_file(tmp, m_filename);
+            }
+
+            /**
+             * Prints the number of failed and skipped images, and where they are listed
+             */
+            void print_summary(std::ostream& out) const
+            {
+                if (m_added == 0 && m_skipped == 0)
+                    return;
+                out << "Failed images: " << m_added << " new, " << m_skipped
+                    << " skipped (failed in an earlier build, unchanged since); listed in " << m_filename << std::endl;
+            }
+
+        private:
+            static std::string key(const imagenet_info& info)
+            {
+                return info.class_dir + "/" + file_name_part(info.filename);
+            }
+
+            std::string m_filename;
+            bool m_skip_known;
+            bool m_refresh = false;
+            std::map<std::string, quarantined_image> m_known;   // Loaded list
+            std::map<std::string, quarantined_image> m_current; // List of this build
+            size_t m_skipped = 0;
+            size_t m_added = 0;
+        };
+
+        /**
+         * Brings the checkpoint shard of every class up to date
+         *
+         * An image is decoded again only if its file is new or its size or mtime
+         * changed since the shard was written; everything else is copied from the old
+         * shard. Classes whose files are all unchanged are not touched at all.
+         *
+         * @return false if the build was interrupted
+         */
+        bool update_checkpoint(
+            const std::vector<imagenet_info>& listing,
+            const std::vector<std::pair<size_t, size_t>>& classes,
+            const imagenet_build_options& options,
+            thread_pool& pool,
+            imagenet_build_stats& stats,
+            file_prefetcher* prefetcher,
+            image_quarantine& quarantine
+        )
+        {
+            const std::string& dir = options.checkpoint_dir;
+            create_directory(dir);
+
+            checkpoint_manifest manifest = load_checkpoint_manifest(dir);
+            const int resampler = options.fixed_point_resize ? checkpoint_resampler : 0;
+            if (manifest.sizes != options.sizes || manifest.jpeg_dct_scaling != options.jpeg_dct_scaling ||
+                manifest.resampler != resampler)
+            {
+                if (!manifest.shards.empty())
+                    std::cout << "Checkpoint was built with other image sizes or decode settings, starting over" << std::endl;
+                manifest = checkpoint_manifest();
+                manifest.sizes = options.sizes;
+                manifest.jpeg_dct_scaling = options.jpeg_dct_scaling;
+                manifest.resampler = resampler;
+            }
+
+            // Forget classes that disappeared from the source tree
+            std::map<std::string, uint64> current;
+            for (const auto& c : classes)
+            {
+                const std::string& class_dir = listing[c.first].class_dir;
+                auto it = manifest.shards.find(class_dir);
+                if (it != manifest.shards.end())
+                    current.insert(*it);
+            }
+            for (const auto& s : manifest.shards)
+            {
+                if (current.count(s.first) == 0)
+                    std::remove(shard_path(dir, s.first).c_str());
+            }
+            manifest.shards.swap(current);
+            save_checkpoint_manifest(dir, manifest);
+
+            const size_t batch_size = 1000;
+            std::vector<processed_image> results;
+            size_t reused_total = 0, decoded_total = 0;
+
+            for (size_t k = 0; k < classes.size() && !g_terminate_flag.load(); ++k)
+            {
+                const size_t begin = classes[k].first, end = classes[k].second;
+                const std::string& class_dir = listing[begin].class_dir;
+                const std::string shard = shard_path(dir, class_dir);
+
+                // Match the current files against the previous shard of this class
+                std::unique_ptr<checkpoint_shard_reader> old_shard;
+                std::map<std::string, size_t> old_index;
+                if (manifest.shards.count(class_dir) != 0 && file_exists(shard))
+                {
+                    old_shard.reset(new checkpoint_shard_reader(shard));
+                    const auto& entries = old_shard->entries();
+                    for (size_t i = 0; i < entries.size(); ++i)
+                        old_index[entries[i].name] = i;
+                }
+
+                const size_t none = std::numeric_limits<size_t>::max();
+                std::vector<size_t> reuse(end - begin, none);
+                std::vector<size_t> todo;
+                for (size_t i = begin; i < end; ++i)
+                {
+                    const auto& info = listing[i];
+                    auto it = old_index.find(file_name_part(info.filename));
+                    if (it != old_index.end() &&
+                        old_shard->entries()[it->second].file_size == info.file_size &&
+                        old_shard->entries()[it->second].last_modified == info.last_modified)
+                        reuse[i - begin] = it->second;
+                    else
+                        todo.push_back(i);
+                }
+
+                if (todo.empty() && old_shard && old_shard->entries().size() == end - begin)
+                {
+                    reused_total += end - begin;
+                    continue;
+                }
+
+                // Pull the unchanged images out of the old shard
+                std::vector<std::vector<matrix<rgb_pixel>>> reused(old_shard ? old_shard->entries().size() : 0);
+                if (old_shard)
+                {
+                    std::vector<char> needed(reused.size(), 0);
+                    for (size_t r : reuse)
+                        if (r != none) needed[r] = 1;
+                    for (size_t i = 0; i < reused.size(); ++i)
+                    {
+                        old_shard->read_images(reused[i], options.sizes.size());
+                        if (!needed[i])
+                            reused[i].clear();
+                    }
+                    old_shard.reset();
+                }
+
+                // Decode new and changed images
+                size_t first_ticket = 0;
+                for (size_t i = 0; prefetcher && i < todo.size(); ++i)
+                {
+                    const size_t ticket = prefetcher->add(listing[todo[i]].filename);
+                    if (i == 0)
+                        first_ticket = ticket;
+                }
+                std::vector<processed_image> decoded(todo.size());
+                for (size_t b = 0; b < todo.size(); b += batch_size)
+                {
+                    const size_t n = std::min(batch_size, todo.size() - b);
+                    process_images(pool, listing, todo.data() + b, n, options, results, &stats, prefetcher, first_ticket + b);
+                    for (size_t i = 0; i < n; ++i)
+                        decoded[b + i] = std::move(results[i]);
+                }
+                if (g_terminate_flag.load())
+                    break;
+
+                // Write the new shard in listing order, without the failed images
+                std::vector<checkpoint_entry> entries;
+                std::vector<const std::vector<matrix<rgb_pixel>>*> images;
+                size_t next_todo = 0;
+                for (size_t i = begin; i < end; ++i)
+                {
+                    const auto& info = listing[i];
+                    const std::vector<matrix<rgb_pixel>>* imgs = nullptr;
+                    if (reuse[i - begin] != none)
+                    {
+                        imgs = &reused[reuse[i - begin]];
+                    }
+                    else
+                    {
+                        const auto& r = decoded[next_todo++];
+                        if (r.status == processed_image::processed)
+                        {
+                            imgs = &r.imgs;
+                        }
+                        else
+                        {
+                            std::cerr << "Error processing image " << info.filename << ": " << r.error << std::endl;
+                            if (!r.read_failed)
+                                quarantine.add(info, r.error);
+                        }
+                    }
+
+                    if (imgs)
+                    {
+                        checkpoint_entry e;
+                        e.name = file_name_part(info.filename);
+                        e.file_size = info.file_size;
+                        e.last_modified = info.last_modified;
+                        entries.push_back(e);
+                        images.push_back(imgs);
+                    }
+                }
+                write_checkpoint_shard(shard, entries, images);
+                manifest.shards[class_dir] = entries.size();
+                save_checkpoint_manifest(dir, manifest);
+                // Classes not reached yet keep their entries until the build completes
+                quarantine.save(false);
+
+                reused_total += (end - begin) - todo.size();
+                decoded_total += todo.size();
+                std::cout << "Class " << (k + 1) << "/" << classes.size() << " (" << class_dir << "): "
+                    << (end - begin) - todo.size() << " reused, " << todo.size() << " decoded" << std::endl;
+                if (options.print_stats && !todo.empty())
+                    stats.print(std::cout);
+            }
+
+            std::cout << "Checkpoint: " << reused_total << " images reused, "
+                << decoded_total << " decoded" << std::endl;
+            return !g_terminate_flag.load();
+        }
+    }
+
+    /**
+     * Creates an ImageNet dataset from a directory of images
+     *
+     * Images are decoded and resized in batches. Within a batch the work is spread
+     * across a pool of worker threads, but results are always written in listing
+     * order so the output (images and labels) is identical whatever the thread count.
+     * Each batch is streamed to disk before the next one starts, so peak memory is
+     * about one batch of images. Class directories are listed in the background
+     * (see imagenet_listing_scanner) and decoding starts as soon as the first
+     * classes are known, except with a checkpoint, which needs the whole listing.
+     * The listing is cached in "<output_file>.listing" and reused on the next build
+     * while no directory of the tree changed (see cached_imagenet_listing).
+     *
+     * Every image is decoded once, whatever the number of requested sizes; one
+     * dataset is written per size (see get_sized_output_file for the file names).
+     * With options.io_threads > 0, files are read ahead of the decode threads (see
+     * impl::file_prefetcher) and decoded from memory.
+     *
+     * The dataset is written to "<output_file>.partial" and only renamed to
+     * output_file once complete, so an interrupted build never leaves a truncated
+     * dataset behind. With num_shards > 1, output_file is a shard index and the
+     * images go to num_shards dataset files next to it (see sharded_dataset_writer).
+     * With a checkpoint directory, every class is first stored as a shard there; a
+     * later build reuses all shards whose source files did not change and only
+     * decodes new or modified images.
+     *
+     * Images that fail to decode are recorded in a skip-list, "<output_file>.skip"
+     * (or "skip.dat" in the checkpoint directory), and later builds skip them without
+     * reading them until their size or modification time changes (see
+     * impl::image_quarantine and options.skip_failed).
+     *
+     * With options.dedup, every decoded image is hashed by the worker threads and
+     * only the first copy (in listing order) of each image is written; see
+     * dedup_mode. Checkpoint builds hash the stored images on the pool while
+     * assembling the output, so there exact means identical pixels rather than
+     * identical files.
+     *
+     * @param images_folder Root directory containing class subdirectories
+     * @param output_file Path to save the processed dataset
+     * @param options Build settings (sizes, threads, format, checkpointing, sharding)
+     * @return false if the build was interrupted before completion
+     */
+    bool create_imagenet_dataset(
+        const std::string& images_folder,
+        const std::string& output_file,
+        const imagenet_build_options& options
+    )
+    {
+        check_build_sizes(options.sizes);
+        // Checkpoints reuse images by size and time, which the cache can hold stale
+        cached_imagenet_listing scanner(images_folder, options.listing_cache ? output_file + ".listing" : std::string(),
+            options.scan_threads, !options.checkpoint_dir.empty());
+        if (scanner.from_cache())
+            std::cout << "Image directory unchanged, using the cached listing" << std::endl;
+        else
+            std::cout << "Scanning image directory..." << std::endl;
+
+        std::cout << "Loading and processing images using " << options.num_threads << " thread(s)..." << std::endl;
+        thread_pool pool(options.num_threads);
+        imagenet_build_stats stats;
+        impl::image_quarantine quarantine(options.checkpoint_dir.empty() ? output_file + ".skip" :
+            options.checkpoint_dir + "/skip.dat", options.skip_failed);
+        quarantine.refresh_file_times(scanner.from_cache() && options.checkpoint_dir.empty());
+        impl::image_deduplicator dedup(options.dedup, options.keep_duplicates);
+        const auto dedup_key = [](const imagenet_info& info) { return info.class_dir + "/" + impl::file_name_part(info.filename); };
+        std::unique_ptr<impl::file_prefetcher> prefetcher;
+        if (options.io_threads > 0)
+        {
+            prefetcher.reset(new impl::file_prefetcher(options.io_threads,
+                std::max<size_t>(options.prefetch, 2 * std::max(1ul, options.num_threads)), &stats));
+        }
+        const auto report_stats = [&]()
+        {
+            if (options.print_stats)
+            {
+                std::cout << "Stage timings (" << stats.elapsed_seconds() << " s):" << std::endl;
+                stats.print(std::cout);
+            }
+            if (!options.stats_file.empty())
+                stats.save_json(options.stats_file);
+            quarantine.print_summary(std::cout);
+            dedup.print_summary(std::cout);
+            if (!options.dedup_report.empty() && dedup.enabled())
+                dedup.save_report(options.dedup_report);
+        };
+        using clock = std::chrono::steady_clock;
+
+        if (!options.checkpoint_dir.empty())
+        {
+            // Checkpoint updates need every class listed up front
+            std::vector<imagenet_info> image_listing, class_images;
+            while (scanner.next_class(class_images))
+            {
+                quarantine.filter(class_images);
+                image_listing.insert(image_listing.end(),
+                    std::make_move_iterator(class_images.begin()), std::make_move_iterator(class_images.end()));
+            }
+            std::cout << "Total images found: " << image_listing.size() + quarantine.skipped() << std::endl;
+            if (image_listing.empty() && quarantine.skipped() == 0)
+                throw dlib::error("No images found in directory: " + images_folder);
+
+            // The listing is sorted by class, so each class is a contiguous range
+            std::vector<std::pair<size_t, size_t>> classes;
+            for (size_t i = 0; i < image_listing.size(); ++i)
+            {
+                if (i == 0 || image_listing[i].numeric_label != image_listing[i - 1].numeric_label)
+                    classes.emplace_back(i, i);
+                classes.back().second = i + 1;
+            }
+
+            if (!impl::update_checkpoint(image_listing, classes, options, pool, stats, prefetcher.get(), quarantine))
+            {
+                quarantine.print_summary(std::cout);
+                std::cout << "Build interrupted, completed classes are kept in "
+                    << options.checkpoint_dir << "; run again to resume" << std::endl;
+                return false;
+            }
+
+            std::cout << "Assembling dataset from the checkpoint..." << std::endl;
+            auto writers = make_dataset_writers(output_file, options);
+            // Stored images are read a batch at a time, hashed and measured on the pool and written in order
+            const size_t batch_size = 1000;
+            std::vector<impl::processed_image> batch(batch_size);
+            for (const auto& c : classes)
+            {
+                const auto& info = image_listing[c.first];
+                impl::checkpoint_shard_reader shard(impl::shard_path(options.checkpoint_dir, info.class_dir));
+                const auto& entries = shard.entries();
+                for (size_t first = 0; first < entries.size(); first += batch_size)
+                {
+                    const size_t count = std::min(batch_size, entries.size() - first);
+                    for (size_t i = 0; i < count; ++i)
+                        shard.read_images(batch[i].imgs, writers.size());
+                    parallel_for(pool, 0, static_cast<long>(count), [&](long i)
+                    {
+                        if (dedup.enabled())
+                            batch[i].hash = impl::hash_images(batch[i].imgs, options.dedup, &batch[i].thumbnail);
+                        impl::compute_image_stats(batch[i]);
+                    });
+                    for (size_t i = 0; i < count; ++i)
+                    {
+                        const auto& r = batch[i];
+                        if (!dedup.keep(r.hash, info.class_dir + "/" + entries[first + i].name, r.thumbnail))
+                            continue;
+                        const auto start = clock::now();
+                        for (size_t k = 0; k < writers.size(); ++k)
+                        {
+                            writers[k]->write(r.imgs[k], info.label, info.numeric_label);
+                            writers[k]->add_stats(info.numeric_label, r.stats[k]);
+                        }
+                        stats.record(imagenet_build_stats::write_stage, clock::now() - start);
+                    }
+                }
+            }
+            for (auto& writer : writers)
+                writer->close();
+            quarantine.save();
+            std::cout << "Dataset saved successfully! (" << writers.front()->size() << " images)" << std::endl;
+            report_stats();
+            return true;
+        }
+
+        auto writers = make_dataset_writers(output_file, options);
+
+        // Decoding starts with the first listed classes while the scan goes on
+        const size_t batch_size = 1000;
+        std::vector<size_t> indices(batch_size);
+        for (size_t i = 0; i < indices.size(); ++i) indices[i] = i;
+        std::vector<impl::processed_image> results;
+        std::vector<imagenet_info> pending, class_images;
+        bool listing_done = false;
+        size_t processed = 0;
+
+        while (!g_terminate_flag.load())
+        {
+            // List a little past the batch so that reads run ahead across batches
+            while (!listing_done && pending.size() < batch_size + options.prefetch)
+            {
+                if (scanner.next_class(class_images))
+                {
+                    quarantine.filter(class_images);
+                    // Files are read ahead in listing order, so ticket = listing position
+                    for (size_t i = 0; prefetcher && i < class_images.size(); ++i)
+                        prefetcher->add(class_images[i].filename);
+                    pending.insert(pending.end(),
+                        std::make_move_iterator(class_images.begin()), std::make_move_iterator(class_images.end()));
+                }
+                else
+                {
+                    listing_done = true;
+                    std::cout << "Total images found: " << processed + pending.size() + quarantine.skipped() << std::endl;
+                }
+            }
+            if (pending.empty())
+                break;
+
+            const size_t count = std::min(batch_size, pending.size());
+            stats.set_backlog(pending.size());
+            impl::process_images(pool, pending, indices.data(), count, options, results, &stats, prefetcher.get(), processed);
+            if (g_terminate_flag.load())
+                break;
+
+            // Write results in listing order
+            for (size_t i = 0; i < count; ++i)
+            {
+                const auto& r = results[i];
+                const auto& info = pending[i];
+                if (r.status == impl::processed_image::processed)
+                {
+                    if (!dedup.keep(r.hash, dedup_key(info), r.thumbnail))
+                        continue;
+                    const auto start = clock::now();
+                    for (size_t k = 0; k < writers.size(); ++k)
+                    {
+                        writers[k]->write(r.imgs[k], info.label, info.numeric_label);
+                        writers[k]->add_stats(info.numeric_label, r.stats[k]);
+                    }
+                    stats.record(imagenet_build_stats::write_stage, clock::now() - start);
+                }
+                else
+                {
+                    std::cerr << "Error processing image " << info.filename << ": " << r.error << std::endl;
+                    if (!r.read_failed)
+                        quarantine.add(info, r.error);
+                }
+            }
+            pending.erase(pending.begin(), pending.begin() + count);
+            processed += count;
+
+            // Print progress every 1000 images
+            std::cout << "Progress: " << processed;
+            if (listing_done)
+                std::cout << "/" << processed + pending.size();
+            std::cout << " images processed" << std::endl;
+            if (options.print_stats)
+                stats.print(std::cout);
+        }
+
+        if (g_terminate_flag.load())
+        {
+            // Dropping the writers deletes their partial output
+            writers.clear();
+            quarantine.save(false);
+            quarantine.print_summary(std::cout);
+            std::cout << "Build interrupted, no dataset was written" << std::endl;
+            return false;
+        }
+
+        if (processed == 0 && quarantine.skipped() == 0)
+            throw dlib::error("No images found in directory: " + images_folder);
+
+        for (auto& writer : writers)
+            writer->close();
+        quarantine.save();
+        std::cout << "Dataset saved successfully! (" << writers.front()->size() << " images)" << std::endl;
+        report_stats();
+        return true;
+    }
+
+    /**
+     * Creates an ImageNet dataset from a directory of images
+     *
+     * @param images_folder Root directory containing class subdirectories
+     * @param output_file Path to save the processed dataset
+     * @param resize_rows Height for resizing images (default 224)
+     * @param resize_cols Width for resizing images (default 224)
+     * @param num_threads Number of worker threads used for decoding (default 1)
+     * @param format Output format, stream or fixed (default stream)
+     * @return false if the build was interrupted before completion
+     */
+    bool create_imagenet_dataset(
+        const std::string& images_folder,
+        const std::string& output_file,
+        long resize_rows = 224,
+        long resize_cols = 224,
+        unsigned long num_threads = 1,
+        dataset_format format = dataset_format::stream
+    )
+    {
+        imagenet_build_options options;
+        options.sizes = { { resize_rows, resize_cols } };
+        options.num_threads = num_threads;
+        options.format = format;
+        return create_imagenet_dataset(images_folder, output_file, options);
+    }
+
+    /**
+     * Loads the part of a sharded dataset that belongs to one node
+     * Only the shard files of this rank are opened, so each node reads its own bytes.
+     *
+     * @param index_file Path to the shard index
+     * @param rank Index of this node, in [0, world_size)
+     * @param world_size Number of nodes
+     * @param dataset Receives the images and labels of this rank's shards
+     */
+    void load_imagenet_shards(
+        const std::string& index_file,
+        unsigned long rank,
+        unsigned long world_size,
+        imagenet_dataset& dataset
+    )
+    {
+        dataset = imagenet_dataset();
+        matrix<rgb_pixel> img;
+        std::string label;
+        unsigned long numeric_label;
+        for (const auto& shard : get_rank_shard_files(index_file, rank, world_size))
+        {
+            imagenet_dataset_reader reader(shard);
+            while (reader.read(img, label, numeric_label))
+            {
+                dataset.push_back(std::move(img), label, numeric_label);
+            }
+        }
+    }
+
+    /**
+     * Reads a whole dataset file into memory
+     * The legacy, stream, fixed and compressed formats are all accepted, as well as
+     * a shard index, in which case every shard is loaded. Compressed files are
+     * inflated on all cores, one chunk per task.
+     *
+     * @param dataset_file Path to the saved dataset file
+     * @param dataset Receives the images and labels
+     */
+    void load_imagenet_dataset(
+        const std::string& dataset_file,
+        imagenet_dataset& dataset
+    )
+    {
+        if (is_shard_index(dataset_file))
+        {
+            load_imagenet_shards(dataset_file, 0, 1, dataset);
+            return;
+        }
+
+        if (detect_dataset_format(dataset_file) == dataset_format::compressed)
+        {
+            const impl::compressed_dataset_file file(dataset_file);
+            dataset = imagenet_dataset();
+            dataset.class_names = file.class_names();
+            dataset.images.resize(file.size());
+            dataset.numeric_labels.resize(file.size());
+
+            thread_pool pool(std::max(1u, std::thread::hardware_concurrency()));
+            parallel_for(pool, 0, file.num_chunks(), [&](long k)
+            {
+                std::vector<char> buffer;
+                const size_t begin = file.chunk_begin(k);
+                file.decode_chunk(k, dataset.images.data() + begin, dataset.numeric_labels.data() + begin, buffer);
+            });
+            return;
+        }
+
+        dataset = imagenet_dataset();
+        imagenet_dataset_reader reader(dataset_file);
+        matrix<rgb_pixel> img;
+        std::string label;
+        unsigned long numeric_label;
+        while (reader.read(img, label, numeric_label))
+        {
+            dataset.push_back(std::move(img), label, numeric_label);
+        }
+    }
+
+    /**
+     * Dataset of same-size images whose pixels live in one contiguous block
+     *
+     * Loading allocates the pixel block once instead of one matrix per image, and
+     * consecutive images are adjacent in memory, which keeps iteration cache
+     * friendly. Images are accessed through const_rgb_image_view, which works with
+     * dlib's generic image functions, or copied out with copy_image().
+     */
+    class packed_imagenet_dataset
+    {
+    public:
+        size_t size() const { return m_numeric_labels.size(); }
+        long nr() const { return m_rows; }
+        long nc() const { return m_cols; }
+        const std::vector<std::string>& class_names() const { return m_class_names; }
+        unsigned long numeric_label(size_t i) const { return m_numeric_labels[i]; }
+        const std::string& label(size_t i) const { return m_class_names[m_numeric_labels[i]]; }
+
+        /**
+         * @return Pointer to the first pixel of image i (row-major, interleaved RGB)
+         */
+        const rgb_pixel* pixels(size_t i) const
+        {
+            DLIB_ASSERT(i < size(), "image index out of range");
+            return m_pixels.data() + i * image_size();
+        }
+
+        /**
+         * @return Zero-copy view of image i
+         */
+        const_rgb_image_view image(size_t i) const
+        {
+            const_rgb_image_view view;
+            view.data = pixels(i);
+            view.rows = m_rows;
+            view.cols = m_cols;
+            return view;
+        }
+
+        /**
+         * Copies image i into a regular dlib matrix
+         */
+        void copy_image(size_t i, matrix<rgb_pixel>& img) const
+        {
+            img.set_size(m_rows, m_cols);
+            if (img.size() != 0)
+                std::memcpy(&img(0, 0), pixels(i), image_size() * sizeof(rgb_pixel));
+        }
+
+        /**
+         * Fills a tensor of shape (indices.size(), 3, nr(), nc()) with the given images,
+         * normalized as by input_rgb_image
+         */
+        void copy_to_tensor(const std::vector<size_t>& indices, resizable_tensor& data) const
+        {
+            data.set_size(indices.size(), 3, m_rows, m_cols);
+            float* dest = data.host();
+            for (size_t k = 0; k < indices.size(); ++k)
+                impl::interleaved_to_planar_float(pixels(indices[k]), image_size(), impl::input_rgb_mean,
+                    impl::input_rgb_scale, dest + k * 3 * image_size());
+        }
+
+        /**
+         * Empties the dataset and sets the size of its images
+         *
+         * @param capacity Number of images to allocate room for up front
+         */
+        void reset(long rows, long cols, size_t capacity = 0)
+        {
+            m_rows = rows;
+            m_cols = cols;
+            m_pixels.clear();
+            m_numeric_labels.clear();
+            m_class_names.clear();
+            m_stats = imagenet_dataset_stats();
+            reserve(capacity);
+        }
+
+        void reserve(size_t capacity)
+        {
+            m_pixels.reserve(capacity * image_size());
+            m_numeric_labels.reserve(capacity);
+        }
+
+        /**
+         * Appends an image, recording the class name the first time a label is seen
+         *
+         * @return Where to write the nr() * nc() pixels of the new image
+         */
+        rgb_pixel* append(const std::string& label, unsigned long numeric_label)
+        {
+            if (numeric_label > std::numeric_limits<uint16>::max())
+                throw error("Numeric label " + std::to_string(numeric_label) + " does not fit the 16-bit label table");
+            if (numeric_label >= m_class_names.size())
+                m_class_names.resize(numeric_label + 1);
+            if (m_class_names[numeric_label].empty())
+                m_class_names[numeric_label] = label;
+            m_numeric_labels.push_back(static_cast<uint16>(numeric_label));
+            // rgb_pixel's default constructor leaves the memory untouched
+            m_pixels.resize(m_pixels.size() + image_size());
+            return m_pixels.data() + m_pixels.size() - image_size();
+        }
+
+        void push_back(const matrix<rgb_pixel>& img, const std::string& label, unsigned long numeric_label)
+        {
+            if (img.nr() != m_rows || img.nc() != m_cols)
+                throw error("packed_imagenet_dataset holds " + std::to_string(m_rows) + "x" + std::to_string(m_cols) +
+                    " images, got one of " + std::to_string(img.nr()) + "x" + std::to_string(img.nc()));
+            rgb_pixel* dest = append(label, numeric_label);
+            if (img.size() != 0)
+                std::memcpy(dest, &img(0, 0), image_size() * sizeof(rgb_pixel));
+        }
+
+        void set_class_names(const std::vector<std::string>& names) { m_class_names = names; }
+        void set_numeric_labels(const uint16* labels, size_t count) { m_numeric_labels.assign(labels, labels + count); }
+
+        /**
+         * @return Pixel statistics stored with the file (set by load_stable_imagenet_1k),
+         *         empty() if there are none
+         */
+        const imagenet_dataset_stats& stats() const { return m_stats; }
+        void set_stats(const imagenet_dataset_stats& stats) { m_stats = stats; }
+        rgb_pixel* resize_pixels(size_t count)
+        {
+            m_pixels.resize(count * image_size());
+            return m_pixels.data();
+        }
+
+    private:
+        size_t image_size() const { return static_cast<size_t>(m_rows * m_cols); }
+
+        long m_rows = 0;
+        long m_cols = 0;
+        std::vector<rgb_pixel> m_pixels;
+        std::vector<uint16> m_numeric_labels;
+        std::vector<std::string> m_class_names;
+        imagenet_dataset_stats m_stats;
+    };
+
+    /**
+     * Reads a whole dataset of same-size images into one contiguous pixel block
+     *
+     * The number of images is known up front for fixed, compressed and sharded
+     * files, so the block is allocated exactly once (compressed chunks are then
+     * inflated in parallel straight into it); stream and legacy files reserve an
+     * estimate from the file size. Images are read one at a time into a single
+     * reusable buffer, so loading does not allocate per image.
+     *
+     * @param dataset_file Path to the saved dataset file
+     * @param dataset Receives the images and labels
+     */
+    void load_imagenet_dataset(
+        const std::string& dataset_file,
+        packed_imagenet_dataset& dataset
+    )
+    {
+        const auto read_all = [&](const std::vector<std::string>& files, size_t expected)
+        {
+            matrix<rgb_pixel> img;
+            std::string label;
+            unsigned long numeric_label;
+            bool first = true;
+            for (const auto& file : files)
+            {
+                imagenet_dataset_reader reader(file);
+                while (reader.read(img, label, numeric_label))
+                {
+                    if (first)
+                    {
+                        // Records are at least as large as their pixels
+                        uint64 estimate = expected;
+                        if (estimate == 0 && img.size() != 0)
+                            estimate = impl::file_size_bytes(file) / (img.size() * sizeof(rgb_pixel));
+                        dataset.reset(img.nr(), img.nc(), static_cast<size_t>(estimate));
+                        first = false;
+                    }
+                    dataset.push_back(img, label, numeric_label);
+                }
+            }
+            if (first)
+                dataset.reset(0, 0);
+        };
+
+        if (is_shard_index(dataset_file))
+        {
+            const imagenet_shard_index index = load_imagenet_shard_index(dataset_file);
+            std::vector<std::string> files;
+            uint64 total = 0;
+            for (size_t s = 0; s < index.shard_files.size(); ++s)
+            {
+                files.push_back(impl::directory_part(dataset_file) + index.shard_files[s]);
+                total += s < index.shard_sizes.size() ? index.shard_sizes[s] : 0;
+            }
+            read_all(files, static_cast<size_t>(total));
+            return;
+        }
+
+        const dataset_format format = detect_dataset_format(dataset_file);
+        if (format == dataset_format::fixed)
+        {
+            const mapped_imagenet_dataset file(dataset_file);
+            dataset.reset(file.nr(), file.nc());
+            dataset.set_class_names(file.class_names());
+            rgb_pixel* dest = dataset.resize_pixels(file.size());
+            std::vector<uint16> labels(file.size());
+            for (size_t i = 0; i < file.size(); ++i)
+            {
+                file.copy_pixels(i, dest + i * file.nr() * file.nc());
+                labels[i] = static_cast<uint16>(file.numeric_label(i));
+            }
+            dataset.set_numeric_labels(labels.data(), labels.size());
+            return;
+        }
+
+        if (format == dataset_format::compressed)
+        {
+            const impl::compressed_dataset_file file(dataset_file);
+            if (file.num_chunks() == 0)
+            {
+                dataset.reset(0, 0);
+                dataset.set_class_names(file.class_names());
+                return;
+            }
+
+            // The image size is only known once the first record is inflated
+            std::vector<char> buffer;
+            std::vector<uint16> labels(file.size());
+            rgb_pixel* dest = nullptr;
+            file.decode_records(0, labels.data(), buffer, [&](size_t i, long rows, long cols) {
+                if (i == 0)
+                {
+                    dataset.reset(rows, cols);
+                    dataset.set_class_names(file.class_names());
+                    dest = dataset.resize_pixels(file.size());
+                }
+                else if (rows != dataset.nr() || cols != dataset.nc())
+                    throw dlib::error("Images of different sizes in compressed dataset file: " + dataset_file);
+                return reinterpret_cast<unsigned char*>(dest + i * rows * cols);
+            });
+            const size_t image_size = static_cast<size_t>(dataset.nr() * dataset.nc());
+
+            thread_pool pool(std::max(1u, std::thread::hardware_concurrency()));
+            parallel_for(pool, 1, file.num_chunks(), [&](long k)
+            {
+                std::vector<char> chunk_buffer;
+                const size_t begin = file.chunk_begin(k);
+                file.decode_chunk(k, dest + begin * image_size, dataset.nr(), dataset.nc(),
+                    labels.data() + begin, chunk_buffer);
+            });
+            dataset.set_numeric_labels(labels.data(), labels.size());
+            return;
+        }
+
+        read_all(std::vector<std::string>(1, dataset_file), 0);
+    }
+
+    /**
+     * Which images of a dataset file load_imagenet_dataset() should read
+     */
+    struct imagenet_selection
+    {
+        std::vector<unsigned long> classes;  // Numeric labels to keep, every class if empty
+        size_t max_per_class = 0;            // Keep the first images of each class only, 0 for no limit
+    };
+
+    namespace impl
+    {
+        /**
+         * Reads the class index at the end of a stream file, and the pixel
+         * statistics that follow it if stats is given and the file has them
+         *
+         * @return false if the file has none (legacy or version 1 files, or files
+         *         written before the index was added)
+         */
+        bool read_stream_class_index(
+            const std::string& filename,
+            std::vector<std::string>& class_names,
+            class_index& index,
+            imagenet_dataset_stats* stats = nullptr
+        )
+        {
+            std::ifstream in(filename, std::ios::binary);
+            in.seekg(0, std::ios::end);
+            const uint64 size = static_cast<uint64>(in.tellg());
+            if (!in || size < sizeof(stream_magic) + stream_index_trailer_size)
+                return false;
+
+            char trailer[stream_index_trailer_size];
+            in.seekg(size - sizeof(trailer));
+            in.read(trailer, sizeof(trailer));
+            if (!in || !std::equal(stream_index_magic, stream_index_magic + sizeof(stream_index_magic), trailer + 8))
+                return false;
+
+            const uint64 index_offset = load_le(trailer, 8);
+            if (index_offset >= size - sizeof(trailer))
+                throw dlib::error("Corrupted class index in dataset file: " + filename);
+            in.seekg(index_offset);
+            dlib::deserialize(class_names, in);
+            dlib::deserialize(index.labels, in);
+            dlib::deserialize(index.first, in);
+            dlib::deserialize(index.counts, in);
+            dlib::deserialize(index.offsets, in);
+            if (index.first.size() != index.size() || index.counts.size() != index.size() ||
+                index.offsets.size() != index.size())
+                throw dlib::error("Corrupted class index in dataset file: " + filename);
+            for (size_t r = 0; r < index.size(); ++r)
+            {
+                if (index.offsets[r] >= index_offset || index.labels[r] >= class_names.size())
+                    throw dlib::error("Corrupted class index in dataset file: " + filename);
+            }
+            if (stats && static_cast<uint64>(in.tellg()) < size - sizeof(trailer))
+                dlib::deserialize(*stats, in);
+            return true;
+        }
+
+        /**
+         * Tracks what an imagenet_selection still accepts while files are read
+         */
+        class selection_state
+        {
+        public:
+            explicit selection_state(const imagenet_selection& selection)
+                : m_all(selection.classes.empty()), m_cap(selection.max_per_class)
+            {
+                for (const auto c : selection.classes)
+                {
+                    if (c >= m_wanted.size())
+                        m_wanted.resize(c + 1, 0);
+                    m_wanted[c] = 1;
+                }
+            }
+
+            /**
+             * @return true if another image of class label would be kept
+             */
+            bool wants(unsigned long label) const
+            {
+                if (!m_all && (label >= m_wanted.size() || !m_wanted[label]))
+                    return false;
+                return m_cap == 0 || taken(label) < m_cap;
+            }
+
+            /**
+             * Accepts up to count images of class label
+             *
+             * @return Number of images accepted, the first ones of the count
+             */
+            uint64 take(unsigned long label, uint64 count = 1)
+            {
+                if (!wants(label))
+                    return 0;
+                if (m_cap != 0)
+                    count = std::min<uint64>(count, m_cap - taken(label));
+                if (label >= m_taken.size())
+                    m_taken.resize(label + 1, 0);
+                m_taken[label] += count;
+                return count;
+            }
+
+            /**
+             * @return true once nothing more can be accepted, which is only known when
+             *         the classes are listed and capped
+             */
+            bool done() const
+            {
+                if (m_all || m_cap == 0)
+                    return false;
+                for (size_t c = 0; c < m_wanted.size(); ++c)
+                {
+                    if (m_wanted[c] && taken(c) < m_cap)
+                        return false;
+                }
+                return true;
+            }
+
+        private:
+            uint64 taken(unsigned long label) const { return label < m_taken.size() ? m_taken[label] : 0; }
+
+            std::vector<char> m_wanted;
+            std::vector<uint64> m_taken;
+            bool m_all;
+            size_t m_cap;
+        };
+
+        void merge_class_names(std::vector<std::string>& into, const std::vector<std::string>& from)
+        {
+            if (from.size() > into.size())
+                into.resize(from.size());
+            for (size_t c = 0; c < from.size(); ++c)
+            {
+                if (into[c].empty())
+                    into[c] = from[c];
+            }
+        }
+
+        /**
+         * Appends the selected images of one dataset file (not a shard index)
+         */
+        void load_selected_images(
+            const std::string& filename,
+            selection_state& selection,
+            imagenet_dataset& dataset
+        )
+        {
+            const dataset_format format = detect_dataset_format(filename);
+            if (format == dataset_format::fixed)
+            {
+                // The label array tells which images to copy, the others are never paged in
+                const mapped_imagenet_dataset file(filename);
+                merge_class_names(dataset.class_names, file.class_names());
+                for (size_t i = 0; i < file.size() && !selection.done(); ++i)
+                {
+                    const unsigned long label = file.numeric_label(i);
+                    if (selection.take(label) == 0)
+                        continue;
+                    dataset.images.emplace_back();
+                    file.copy_image(i, dataset.images.back());
+                    dataset.numeric_labels.push_back(static_cast<uint16>(label));
+                }
+                return;
+            }
+
+            if (format == dataset_format::compressed)
+            {
+                const compressed_dataset_file file(filename);
+                if (file.has_class_index())
+                {
+                    // Find where each selected record goes, then inflate only the chunks holding one
+                    const class_index& index = file.classes();
+                    const size_t base = dataset.size();
+                    std::vector<size_t> dest(file.size(), 0);
+                    size_t selected = 0;
+                    for (size_t r = 0; r < index.size(); ++r)
+                    {
+                        const uint64 n = selection.take(index.labels[r], index.counts[r]);
+                        for (uint64 j = 0; j < n; ++j)
+                            dest[index.first[r] + j] = ++selected;
+                    }
+                    std::vector<long> chunks;
+                    for (size_t k = 0; k < file.num_chunks(); ++k)
+                    {
+                        const size_t begin = file.chunk_begin(k);
+                        if (std::any_of(dest.begin() + begin, dest.begin() + begin + file.chunk_size(k),
+                            [](size_t d) { return d != 0; }))
+                            chunks.push_back(static_cast<long>(k));
+                    }
+
+                    merge_class_names(dataset.class_names, file.class_names());
+                    dataset.images.resize(base + selected);
+                    dataset.numeric_labels.resize(base + selected);
+                    thread_pool pool(std::max(1u, std::thread::hardware_concurrency()));
+                    parallel_for(pool, 0, chunks.size(), [&](long i)
+                    {
+                        const size_t k = chunks[i];
+                        const size_t begin = file.chunk_begin(k);
+                        std::vector<matrix<rgb_pixel>> imgs(file.chunk_size(k));
+                        std::vector<uint16> labels(file.chunk_size(k));
+                        std::vector<char> buffer;
+                        file.decode_chunk(k, imgs.data(), labels.data(), buffer);
+                        for (size_t j = 0; j < imgs.size(); ++j)
+                        {
+                            const size_t d = dest[begin + j];
+                            if (d == 0)
+                                continue;
+                            dataset.images[base + d - 1] = std::move(imgs[j]);
+                            dataset.numeric_labels[base + d - 1] = labels[j];
+                        }
+                    });
+                    return;
+                }
+            }
+
+            if (format == dataset_format::stream)
+            {
+                std::vector<std::string> class_names;
+                class_index index;
+                if (read_stream_class_index(filename, class_names, index))
+                {
+                    // Seek to each selected run and read only its records
+                    merge_class_names(dataset.class_names, class_names);
+                    std::ifstream in(filename, std::ios::binary);
+                    matrix<rgb_pixel> img;
+                    for (size_t r = 0; r < index.size() && !selection.done(); ++r)
+                    {
+                        const uint64 n = selection.take(index.labels[r], index.counts[r]);
+                        if (n == 0)
+                            continue;
+                        in.seekg(index.offsets[r]);
+                        for (uint64 j = 0; j < n; ++j)
+                        {
+                            uint16 id;
+                            if (in.get() != stream_record_tag)
+                                throw dlib::error("Corrupted class index in dataset file: " + filename);
+                            dlib::deserialize(img, in);
+                            dlib::deserialize(id, in);
+                            if (id != index.labels[r])
+                                throw dlib::error("Corrupted class index in dataset file: " + filename);
+                            dataset.images.push_back(std::move(img));
+                            dataset.numeric_labels.push_back(id);
+                        }
+                    }
+                    return;
+                }
+            }
+
+            // No index: read every record and keep the selected ones
+            imagenet_dataset_reader reader(filename);
+            matrix<rgb_pixel> img;
+            std::string label;
+            unsigned long numeric_label;
+            while (!selection.done() && reader.read(img, label, numeric_label))
+            {
+                if (selection.take(numeric_label) != 0)
+                    dataset.push_back(std::move(img), label, numeric_label);
+            }
+        }
+    }
+
+    /**
+     * Reads part of a dataset into memory: some classes, or the first images of
+     * each class, or both
+     *
+     * Stream and compressed files carry a class index giving the position of the
+     * images of each class, so only the selected records are read (stream) or the
+     * chunks that hold them inflated (compressed). Fixed-stride files select from
+     * their label array and only copy the selected images; the shards of an index
+     * that hold no selected class are not opened. Files without an index (legacy,
+     * or written by an older version) are read in full and filtered.
+     *
+     * Images keep their file order and numeric labels; class_names holds the whole
+     * class table when the file records it, at least the selected classes otherwise.
+     *
+     * @param dataset_file Path to the saved dataset file or shard index
+     * @param selection Classes to keep and per-class cap
+     * @param dataset Receives the selected images and their labels
+     */
+    void load_imagenet_dataset(
+        const std::string& dataset_file,
+        const imagenet_selection& selection,
+        imagenet_dataset& dataset
+    )
+    {
+        dataset = imagenet_dataset();
+        impl::selection_state state(selection);
+        if (!is_shard_index(dataset_file))
+        {
+            impl::load_selected_images(dataset_file, state, dataset);
+            return;
+        }
+
+        const imagenet_shard_index index = load_imagenet_shard_index(dataset_file);
+        impl::merge_class_names(dataset.class_names, index.class_names);
+        for (size_t s = 0; s < index.shard_files.size() && !state.done(); ++s)
+        {
+            bool useful = s >= index.class_counts.size();
+            for (size_t c = 0; !useful && c < index.class_counts[s].size(); ++c)
+                useful = index.class_counts[s][c] != 0 && state.wants(c);
+            if (useful)
+                impl::load_selected_images(impl::directory_part(dataset_file) + index.shard_files[s], state, dataset);
+        }
+    }
+
+    /**
+     * Outcome of verify_imagenet_dataset()
+     */
+    struct imagenet_verify_report
+    {
+        size_t images = 0;
+        long rows = 0, cols = 0;                 // Size of the images (of the first one if sizes differ)
+        std::vector<size_t> class_counts;        // Number of images per numeric label
+        std::vector<std::string> class_names;    // Name seen for each numeric label
+        std::vector<std::string> problems;       // Empty if the file is sound
+
+        bool ok() const { return problems.empty(); }
+    };
+
+    namespace impl
+    {
+        /**
+         * Checks every record of one dataset file, one record in memory at a time
+         */
+        void verify_dataset_file(const std::string& filename, imagenet_verify_report& report)
+        {
+            const size_t max_problems = 20;
+            const auto problem = [&](const std::string& msg)
+            {
+                if (report.problems.size() < max_problems)
+                    report.problems.push_back(filename + ": " + msg);
+            };
+
+            size_t record = 0;
+            try
+            {
+                imagenet_dataset_reader reader(filename);
+                matrix<rgb_pixel> img;
+                std::string label;
+                unsigned long numeric_label;
+                while (reader.read(img, label, numeric_label))
+                {
+                    if (img.size() == 0)
+                        problem("record " + std::to_string(record) + " has an empty image");
+                    if (report.images == 0)
+                    {
+                        report.rows = img.nr();
+                        report.cols = img.nc();
+                    }
+                    else if (img.nr() != report.rows || img.nc() != report.cols)
+                    {
+                        problem("record " + std::to_string(record) + " is " + std::to_string(img.nr()) + "x" +
+                            std::to_string(img.nc()) + ", expected " + std::to_string(report.rows) + "x" + std::to_string(report.cols));
+                    }
+
+                    if (numeric_label > std::numeric_limits<uint16>::max())
+                    {
+                        problem("record " + std::to_string(record) + " has out of range label " + std::to_string(numeric_label));
+                    }
+                    else
+                    {
+                        if (numeric_label >= report.class_counts.size())
+                        {
+                            report.class_counts.resize(numeric_label + 1, 0);
+                            report.class_names.resize(numeric_label + 1);
+                        }
+                        if (report.class_counts[numeric_label] == 0 && report.class_names[numeric_label].empty())
+                            report.class_names[numeric_label] = label;
+                        else if (report.class_names[numeric_label] != label)
+                            problem("record " + std::to_string(record) + " labels class " + std::to_string(numeric_label) +
+                                " as \"" + label + "\" instead of \"" + report.class_names[numeric_label] + "\"");
+                        ++report.class_counts[numeric_label];
+                    }
+                    ++report.images;
+                    ++record;
+                }
+            }
+            catch (const std::exception& e)
+            {
+                problem("unreadable after " + std::to_string(record) + " records: " + e.what());
+            }
+        }
+    }
+
+    /**
+     * Streams through a dataset file and checks its records without loading it
+     *
+     * Every record is read and checked (non-empty image, same size as the others,
+     * label name consistent with the numeric label), holding one image in memory at
+     * a time, except for legacy files which can only be read as a whole. A shard
+     * index is checked shard by shard against the image and class counts it
+     * records.
+     *
+     * @param dataset_file Path to the dataset file or shard index
+     * @return Image and class counts, and the problems found
+     */
+    imagenet_verify_report verify_imagenet_dataset(const std::string& dataset_file)
+    {
+        imagenet_verify_report report;
+        if (!is_shard_index(dataset_file))
+        {
+            impl::verify_dataset_file(dataset_file, report);
+            return report;
+        }
+
+        const imagenet_shard_index index = load_imagenet_shard_index(dataset_file);
+        if (index.shard_sizes.size() != index.shard_files.size() || index.class_counts.size() != index.shard_files.size())
+            throw dlib::error("Inconsistent shard index: " + dataset_file);
+        for (size_t s = 0; s < index.shard_files.size(); ++s)
+        {
+            const std::string& name = index.shard_files[s];
+            imagenet_verify_report part;
+            impl::verify_dataset_file(impl::directory_part(dataset_file) + name, part);
+            if (part.images != index.shard_sizes[s])
+                part.problems.push_back(name + ": " + std::to_string(part.images) +
+                    " images, the index records " + std::to_string(index.shard_sizes[s]));
+            const auto& expected = index.class_counts[s];
+            for (size_t c = 0; c < std::max(expected.size(), part.class_counts.size()); ++c)
+            {
+                const uint64 want = c < expected.size() ? expected[c] : 0;
+                const uint64 found = c < part.class_counts.size() ? part.class_counts[c] : 0;
+                if (want != found)
+                    part.problems.push_back(name + ": class " + std::to_string(c) + " has " + std::to_string(found) +
+                        " images, the index records " + std::to_string(want));
+            }
+
+            // Merge the shard into the overall report
+            if (report.images == 0)
+            {
+                report.rows = part.rows;
+                report.cols = part.cols;
+            }
+            else if (part.images != 0 && (part.rows != report.rows || part.cols != report.cols))
+                report.problems.push_back(name + ": images are " + std::to_string(part.rows) + "x" + std::to_string(part.cols) +
+                    ", other shards have " + std::to_string(report.rows) + "x" + std::to_string(report.cols));
+            report.images += part.images;
+            if (part.class_counts.size() > report.class_counts.size())
+            {
+                report.class_counts.resize(part.class_counts.size(), 0);
+                report.class_names.resize(part.class_counts.size());
+            }
+            for (size_t c = 0; c < part.class_counts.size(); ++c)
+            {
+                if (part.class_counts[c] == 0)
+                    continue;
+                if (report.class_counts[c] == 0)
+                    report.class_names[c] = part.class_names[c];
+                else if (report.class_names[c] != part.class_names[c])
+                    report.problems.push_back(name + ": class " + std::to_string(c) + " is named \"" +
+                        part.class_names[c] + "\" instead of \"" + report.class_names[c] + "\"");
+                report.class_counts[c] += part.class_counts[c];
+            }
+            report.problems.insert(report.problems.end(), part.problems.begin(), part.problems.end());
+        }
+        return report;
+    }
+
+    /**
+     * Prints a verification report
+     */
+    void print_verify_report(const imagenet_verify_report& report, std::ostream& out)
+    {
+        size_t classes = 0;
+        for (size_t n : report.class_counts)
+            if (n != 0) ++classes;
+        out << "  " << report.images << " images of " << report.rows << "x" << report.cols
+            << ", " << classes << " classes" << std::endl;
+        if (classes != 0)
+        {
+            const auto minmax = std::minmax_element(report.class_counts.begin(), report.class_counts.end());
+            out << "  Images per class: " << *minmax.first << " to " << *minmax.second << std::endl;
+        }
+        for (const auto& p : report.problems)
+            out << "  Problem: " << p << std::endl;
+        out << (report.ok() ? "  OK" : "  FAILED") << std::endl;
+    }
+
+    /**
+     * Prints the channel means and standard deviations of a dataset, if it has them
+     */
+    void print_imagenet_stats(const imagenet_dataset_stats& stats, std::ostream& out)
+    {
+        if (stats.empty())
+            return;
+        const auto flags = out.flags();
+        const auto precision = out.precision();
+        out << std::fixed << std::setprecision(2);
+        out << "  Channel mean (R, G, B): " << stats.overall.mean(0) << ", "
+            << stats.overall.mean(1) << ", " << stats.overall.mean(2) << std::endl;
+        out << "  Channel std  (R, G, B): " << stats.overall.stddev(0) << ", "
+            << stats.overall.stddev(1) << ", " << stats.overall.stddev(2) << std::endl;
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    namespace impl
+    {
+        /**
+         * Class table of a merged dataset
+         * The first file keeps its numeric labels. Classes of the next files are
+         * matched by name and unknown ones get the next free label. When a file has
+         * several classes of the same name (ImageNet has two "crane" and two
+         * "maillot" classes), the k-th of them, in label order, matches the k-th one
+         * of the table.
+         */
+        class merged_class_table
+        {
+        public:
+            /**
+             * Starts the next input file
+             */
+            void next_file()
+            {
+                m_map.clear();
+                m_seen.clear();
+                m_keep_labels = m_files++ == 0;
+            }
+
+            /**
+             * @return Merged label of class label, named name, of the current file
+             */
+            uint16 map(unsigned long label, const std::string& name)
+            {
+                if (label < m_map.size() && m_map[label] >= 0)
+                    return static_cast<uint16>(m_map[label]);
+
+                long merged;
+                auto& same = m_by_name[name];
+                if (m_keep_labels)
+                {
+                    merged = static_cast<long>(label);
+                    same.insert(std::upper_bound(same.begin(), same.end(), merged), merged);
+                }
+                else
+                {
+                    const size_t k = m_seen[name]++;
+                    merged = k < same.size() ? same[k] : static_cast<long>(m_names.size());
+                    if (k >= same.size())
+                        same.push_back(merged);
+                }
+                if (merged > std::numeric_limits<uint16>::max())
+                    throw dlib::error("Merged dataset has more classes than the 16-bit label table can hold");
+                if (static_cast<size_t>(merged) >= m_names.size())
+                    m_names.resize(merged + 1);
+                m_names[merged] = name;
+                if (label >= m_map.size())
+                    m_map.resize(label + 1, -1);
+                m_map[label] = merged;
+                return static_cast<uint16>(merged);
+            }
+
+            /**
+             * Maps every named class of a file's class table, in label order
+             */
+            void map_all(const std::vector<std::string>& names)
+            {
+                for (size_t c = 0; c < names.size(); ++c)
+                {
+                    if (!names[c].empty())
+                        map(c, names[c]);
+                }
+            }
+
+            /**
+             * @return true if no mapped label of the current file changes
+             */
+            bool keeps_labels() const
+            {
+                for (size_t c = 0; c < m_map.size(); ++c)
+                {
+                    if (m_map[c] >= 0 && m_map[c] != static_cast<long>(c))
+                        return false;
+                }
+                return true;
+            }
+
+            const std::vector<std::string>& names() const { return m_names; }
+
+        private:
+            std::vector<std::string> m_names;
+            std::map<std::string, std::vector<long>> m_by_name;
+            std::map<std::string, size_t> m_seen;
+            std::vector<long> m_map;
+            size_t m_files = 0;
+            bool m_keep_labels = true;
+        };
+
+        /**
+         * Checks that every merged file has the image size of the first one
+         */
+        inline void check_merged_size(long rows, long cols, long& expected_rows, long& expected_cols, const std::string& filename)
+        {
+            if (expected_rows < 0)
+            {
+                expected_rows = rows;
+                expected_cols = cols;
+            }
+            else if (rows != expected_rows || cols != expected_cols)
+            {
+                throw dlib::error(filename + " has " + std::to_string(rows) + "x" + std::to_string(cols) +
+                    " images, the merged dataset " + std::to_string(expected_rows) + "x" + std::to_string(expected_cols));
+            }
+        }
+
+        /**
+         * Gives the writer the statistics of a merged file, under the merged labels
+         *
+         * The output only stores statistics if every merged file had them.
+         */
+        inline void merge_stats(
+            const imagenet_dataset_stats& stats,
+            const std::vector<std::string>& class_names,
+            merged_class_table& classes,
+            imagenet_dataset_writer& writer
+        )
+        {
+            for (size_t c = 0; c < stats.classes.size() && c < class_names.size(); ++c)
+            {
+                if (stats.classes[c].images != 0)
+                    writer.add_stats(classes.map(c, class_names[c]), stats.classes[c]);
+            }
+        }
+
+        void merge_fixed_file(
+            const std::string& filename,
+            merged_class_table& classes,
+            std::unique_ptr<fixed_dataset_writer>& writer,
+            const std::string& output_file,
+            long& rows,
+            long& cols
+        )
+        {
+            const mapped_imagenet_dataset input(filename);
+            check_merged_size(input.nr(), input.nc(), rows, cols, filename);
+            const fixed_header& h = input.header();
+            if (h.layout == pixel_layout::planar_float &&
+                (!std::equal(h.mean, h.mean + 3, input_rgb_mean) || h.scale != input_rgb_scale))
+                throw dlib::error(filename + " was normalized with other channel means than the merged dataset");
+            if (!writer)
+                writer.reset(new fixed_dataset_writer(output_file, rows, cols, h.layout));
+            else if (h.layout != writer->layout())
+                throw dlib::error(filename + " does not have the pixel layout of the other merged files");
+
+            classes.map_all(input.class_names());
+            // One block write per run of same-class images
+            for (size_t i = 0, j; i < input.size(); i = j)
+            {
+                const unsigned long label = input.numeric_label(i);
+                if (label >= input.class_names().size())
+                    throw dlib::error("Corrupted dataset file (image of an unknown class): " + filename);
+                for (j = i + 1; j < input.size() && input.numeric_label(j) == label; ++j) {}
+                const uint16 merged = classes.map(label, input.class_names()[label]);
+                writer->write_raw(input.raw_image(i), j - i, classes.names()[merged], merged);
+            }
+            merge_stats(input.stats(), input.class_names(), classes, *writer);
+        }
+
+        void merge_compressed_file(
+            const std::string& filename,
+            merged_class_table& classes,
+            compressed_dataset_writer& writer,
+            long& rows,
+            long& cols
+        )
+        {
+            const compressed_dataset_file input(filename);
+            classes.map_all(input.class_names());
+            const bool same_labels = classes.keeps_labels();
+
+            std::vector<uint16> labels;
+            if (input.has_class_index())
+            {
+                const class_index& index = input.classes();
+                labels.resize(input.size());
+                for (size_t r = 0; r < index.size(); ++r)
+                    std::fill_n(labels.begin() + index.first[r], index.counts[r], index.labels[r]);
+            }
+
+            std::vector<char> raw;
+            std::vector<uint16> chunk_labels;
+            for (size_t k = 0; k < input.num_chunks(); ++k)
+            {
+                // Chunks whose labels stay the same are copied without being inflated,
+                // except the first one, whose records give the image size. Without
+                // a class index the labels are only known once the chunk is inflated.
+                if (same_labels && input.has_class_index() && k != 0)
+                {
+                    writer.write_chunk(input.chunk_data(k), input.chunk_bytes(k), input.chunk_raw_size(k),
+                        labels.data() + input.chunk_begin(k), input.chunk_size(k), classes.names());
+                    continue;
+                }
+
+                raw.resize(input.chunk_raw_size(k));
+                inflate_chunk(input.chunk_data(k), input.chunk_bytes(k), raw);
+                chunk_labels.resize(input.chunk_size(k));
+                bool relabeled = false;
+                char* in = raw.data();
+                const char* const end = in + raw.size();
+                for (size_t i = 0; i < chunk_labels.size(); ++i)
+                {
+                    if (end - in < static_cast<std::ptrdiff_t>(compressed_record_header_size))
+                        throw dlib::error("Corrupted chunk in compressed dataset file: " + filename);
+                    const long r = static_cast<long>(load_le(in, 4));
+                    const long c = static_cast<long>(load_le(in + 4, 4));
+                    const unsigned long label = static_cast<unsigned long>(load_le(in + 8, 2));
+                    if (label >= input.class_names().size() ||
+                        !compressed_record_fits(end - in - compressed_record_header_size, r, c))
+                        throw dlib::error("Corrupted chunk in compressed dataset file: " + filename);
+                    check_merged_size(r, c, rows, cols, filename);
+                    chunk_labels[i] = classes.map(label, input.class_names()[label]);
+                    if (chunk_labels[i] != label)
+                    {
+                        store_le(in + 8, chunk_labels[i], 2);
+                        relabeled = true;
+                    }
+                    in += compressed_record_header_size + r * c * 3;
+                }
+
+                if (!relabeled)
+                {
+                    writer.write_chunk(input.chunk_data(k), input.chunk_bytes(k), input.chunk_raw_size(k),
+                        chunk_labels.data(), chunk_labels.size(), classes.names());
+                }
+                else
+                {
+                    // Only the record headers changed, the filtered pixels stay as they are
+                    const std::vector<char> packed = deflate_chunk(raw, 6);
+                    writer.write_chunk(packed.data(), packed.size(), raw.size(),
+                        chunk_labels.data(), chunk_labels.size(), classes.names());
+                }
+            }
+            merge_stats(input.stats(), input.class_names(), classes, writer);
+        }
+
+        void merge_stream_file(
+            const std::string& filename,
+            merged_class_table& classes,
+            stream_dataset_writer& writer,
+            long& rows,
+            long& cols
+        )
+        {
+            std::vector<std::string> names;
+            class_index index;
+            imagenet_dataset_stats stats;
+            if (read_stream_class_index(filename, names, index, &stats))
+                classes.map_all(names);
+
+            std::ifstream in(filename, std::ios::binary);
+            in.ignore(sizeof(stream_magic));
+            unsigned long version;
+            dlib::deserialize(version, in);
+            if (version != 1 && version != stream_version)
+                throw dlib::error("Unsupported dataset version " + std::to_string(version) + " in file: " + filename);
+
+            std::vector<char> pixels;
+            size_t count = 0;
+            while (true)
+            {
+                const int tag = in.get();
+                if (tag == stream_class_tag && version >= 2)
+                {
+                    uint16 id;
+                    dlib::deserialize(id, in);
+                    if (id >= names.size())
+                        names.resize(id + 1);
+                    dlib::deserialize(names[id], in);
+                    classes.map(id, names[id]);
+                }
+                else if (tag == stream_record_tag)
+                {
+                    // Read the header of the serialized matrix, then its bytes as they are
+                    long r, c;
+                    dlib::deserialize(r, in);
+                    dlib::deserialize(c, in);
+                    if (r < 0 || c < 0)
+                    {
+                        r = -r;
+                        c = -c;
+                    }
+                    check_merged_size(r, c, rows, cols, filename);
+                    pixels.resize(r * c * sizeof(rgb_pixel));
+                    in.read(pixels.data(), pixels.size());
+                    if (!in)
+                        throw dlib::error("Incomplete or corrupted dataset file: " + filename);
+
+                    uint16 merged;
+                    if (version == 1)
+                    {
+                        std::string label;
+                        unsigned long numeric_label;
+                        dlib::deserialize(label, in);
+                        dlib::deserialize(numeric_label, in);
+                        merged = classes.map(numeric_label, label);
+                    }
+                    else
+                    {
+                        uint16 id;
+                        dlib::deserialize(id, in);
+                        if (id >= names.size() || names[id].empty())
+                            throw dlib::error("Corrupted dataset file (image of an unknown class): " + filename);
+                        merged = classes.map(id, names[id]);
+                    }
+                    writer.write_raw(pixels.data(), r, c, classes.names()[merged], merged);
+                    ++count;
+                }
+                else if (tag == stream_end_tag)
+                {
+                    size_t expected;
+                    dlib::deserialize(expected, in);
+                    if (expected != count)
+                        throw dlib::error("Corrupted dataset file (record count mismatch): " + filename);
+                    merge_stats(stats, names, classes, writer);
+                    return;
+                }
+                else
+                {
+                    throw dlib::error("Incomplete or corrupted dataset file: " + filename);
+                }
+            }
+        }
+    }
+
+    /**
+     * Concatenates dataset files into a new one without decoding their images
+     *
+     * The inputs must all be stream, all fixed-stride (same pixel layout) or all
+     * compressed files, with the same image size. Their records are written in
+     * order, file after file, and pixel bytes are copied as stored: fixed-stride
+     * images in one block per class run, stream records byte for byte, compressed
+     * chunks as they are when their labels do not change. Otherwise a chunk is
+     * inflated, its record headers relabeled and the chunk deflated again, with the
+     * filtered pixels left untouched. Growing a dataset thus mostly costs I/O.
+     *
+     * The first file keeps its numeric labels. Classes of the other files are
+     * matched by class name, and classes that are not in the dataset yet get the
+     * next free labels, in the order of their own labels. Pixel statistics are
+     * carried over if every input has them.
+     *
+     * @param input_files Dataset files to concatenate (not legacy files or shard indexes)
+     * @param output_file Path of the merged file, written in the format of the inputs
+     * @return Number of images written
+     */
+    size_t merge_imagenet_datasets(
+        const std::vector<std::string>& input_files,
+        const std::string& output_file
+    )
+    {
+        if (input_files.empty())
+            throw dlib::error("No dataset file to merge");
+
+        dataset_format format = dataset_format::legacy;
+        for (const auto& filename : input_files)
+        {
+            if (is_shard_index(filename))
+                throw dlib::error("Shard indexes cannot be merged, merge the shard files instead: " + filename);
+            const dataset_format f = detect_dataset_format(filename);
+            if (f == dataset_format::legacy)
+                throw dlib::error("Legacy dataset files cannot be merged without decoding them: " + filename);
+            if (filename != input_files.front() && f != format)
+                throw dlib::error("All merged files must have the same format: " + filename);
+            format = f;
+        }
+
+        impl::merged_class_table classes;
+        long rows = -1, cols = -1;
+        if (format == dataset_format::fixed)
+        {
+            std::unique_ptr<fixed_dataset_writer> writer;
+            for (const auto& filename : input_files)
+            {
+                classes.next_file();
+                impl::merge_fixed_file(filename, classes, writer, output_file, rows, cols);
+            }
+            writer->close();
+            return writer->size();
+        }
+
+        std::unique_ptr<imagenet_dataset_writer> writer = make_dataset_writer(output_file, format, 0, 0);
+        for (const auto& filename : input_files)
+        {
+            classes.next_file();
+            if (format == dataset_format::compressed)
+                impl::merge_compressed_file(filename, classes, static_cast<compressed_dataset_writer&>(*writer), rows, cols);
+            else
+                impl::merge_stream_file(filename, classes, static_cast<stream_dataset_writer&>(*writer), rows, cols);
+        }
+        writer->close();
+        return writer->size();
+    }
+
+    /**
+     * Draws a uniform random sample of the records of a dataset in one streaming pass
+     *
+     * @param dataset_file Path to the dataset file
+     * @param count Number of records to draw (fewer if the file is smaller)
+     * @param seed Seed of the draw
+     * @param images Receives the sampled images
+     * @param labels Receives their textual labels
+     * @param numeric_labels Receives their numeric labels
+     */
+    void sample_imagenet_dataset(
+        const std::string& dataset_file,
+        size_t count,
+        unsigned long seed,
+        std::vector<matrix<rgb_pixel>>& images,
+        std::vector<std::string>& labels,
+        std::vector<unsigned long>& numeric_labels
+    )
+    {
+        images.clear();
+        labels.clear();
+        numeric_labels.clear();
+
+        // Reservoir sampling: record i replaces a random slot with probability count/(i+1)
+        std::mt19937_64 rng(seed);
+        imagenet_dataset_reader reader(dataset_file);
+        matrix<rgb_pixel> img;
+        std::string label;
+        unsigned long numeric_label;
+        for (uint64 i = 0; reader.read(img, label, numeric_label); ++i)
+        {
+            if (images.size() < count)
+            {
+                images.push_back(std::move(img));
+                labels.push_back(label);
+                numeric_labels.push_back(numeric_label);
+                continue;
+            }
+            const uint64 slot = rng() % (i + 1);
+            if (slot < count)
+            {
+                images[slot] = std::move(img);
+                labels[slot] = label;
+                numeric_labels[slot] = numeric_label;
+            }
+        }
+    }
+
+    /**
+     * Indices of the training and testing records of a dataset
+     * A split can be saved with serialize() and reused by later runs.
+     */
+    struct imagenet_split
+    {
+        std::vector<size_t> training;
+        std::vector<size_t> testing;
+    };
+
+    inline void serialize(const imagenet_split& item, std::ostream& out)
+    {
+        int version = 1;
+        serialize(version, out);
+        serialize(item.training, out);
+        serialize(item.testing, out);
+    }
+
+    inline void deserialize(imagenet_split& item, std::istream& in)
+    {
+        int version = 0;
+        deserialize(version, in);
+        if (version != 1)
+            throw serialization_error("Unexpected version found while deserializing dlib::imagenet_split.");
+        deserialize(item.training, in);
+        deserialize(item.testing, in);
+    }
+
+    namespace impl
+    {
+        /**
+         * Fisher-Yates shuffle driven directly by mt19937_64
+         * std::shuffle's algorithm is implementation-defined, so using it would give
+         * different permutations for the same seed with different standard libraries.
+         */
+        inline void shuffle_indices(std::vector<size_t>& indices, unsigned long seed)
+        {
+            std::mt19937_64 g(seed);
+            for (size_t i = indices.size(); i > 1; --i)
+                std::swap(indices[i - 1], indices[static_cast<size_t>(g() % i)]);
+        }
+    }
+
+    /**
+     * Randomly splits the records of a dataset into training and testing sets
+     * Only indices are produced, no image is touched. The same seed always gives the
+     * same split, on every platform.
+     *
+     * @param num_images Number of records in the dataset
+     * @param test_fraction Fraction of data to use for testing (default 0.05)
+     * @param seed Seed of the shuffle (default: drawn from std::random_device)
+     * @return The training and testing indices
+     */
+    imagenet_split split_imagenet_dataset(
+        size_t num_images,
+        double test_fraction = 0.05,
+        unsigned long seed = std::random_device()()
+    )
+    {
+        // Create indices for shuffling
+        std::vector<size_t> indices(num_images);
+        for (size_t i = 0; i < indices.size(); ++i) indices[i] = i;
+
+        // Shuffle indices for random train/test split
+        impl::shuffle_indices(indices, seed);
+
+        size_t split_point = static_cast<size_t>(num_images * (1.0 - test_fraction));
+
+        imagenet_split split;
+        split.training.assign(indices.begin(), indices.begin() + split_point);
+        split.testing.assign(indices.begin() + split_point, indices.end());
+        return split;
+    }
+
+    /**
+     * Splits the records of a dataset into training and testing sets, class by class
+     *
+     * Every class gets its share of the testing set: the number of testing images
+     * (the same as split_imagenet_dataset() gives) is divided between the classes in
+     * proportion to their sizes, by largest remainder, and each class draws its
+     * testing images at random among its own. Only the labels are needed, so the
+     * split can be computed with read_imagenet_labels() before any pixel is read.
+     * It runs in O(N): records are bucketed by class and only the drawn images are
+     * swapped. Both index lists come out in increasing order, i.e. in file order.
+     *
+     * @param numeric_labels Numeric label of each record, in file order
+     * @param test_fraction Fraction of data to use for testing (default 0.05)
+     * @param seed Seed of the draw (default: drawn from std::random_device)
+     * @return The training and testing indices
+     */
+    imagenet_split stratified_split_imagenet_dataset(
+        const std::vector<uint16>& numeric_labels,
+        double test_fraction = 0.05,
+        unsigned long seed = std::random_device()()
+    )
+    {
+        const size_t num_images = numeric_labels.size();
+        const size_t num_testing = num_images - static_cast<size_t>(num_images * (1.0 - test_fraction));
+
+        // Bucket the records by class (counting sort)
+        std::vector<size_t> begin(std::numeric_limits<uint16>::max() + 2, 0);
+        for (const auto label : numeric_labels)
+            ++begin[label + 1];
+        for (size_t c = 1; c < begin.size(); ++c)
+            begin[c] += begin[c - 1];
+        std::vector<size_t> by_class(num_images);
+        {
+            std::vector<size_t> next(begin.begin(), begin.end() - 1);
+            for (size_t i = 0; i < num_images; ++i)
+                by_class[next[numeric_labels[i]]++] = i;
+        }
+
+        // Share the testing images between the classes by largest remainder
+        std::vector<size_t> quota(begin.size() - 1, 0);
+        std::vector<std::pair<double, size_t>> remainders;
+        size_t assigned = 0;
+        for (size_t c = 0; c < quota.size(); ++c)
+        {
+            const size_t n = begin[c + 1] - begin[c];
+            if (n == 0)
+                continue;
+            const double exact = num_images == 0 ? 0.0 : static_cast<double>(num_testing) * n / num_images;
+            quota[c] = std::min(n, static_cast<size_t>(exact));
+            assigned += quota[c];
+            if (quota[c] < n)
+                remainders.emplace_back(exact - quota[c], c);
+        }
+        std::sort(remainders.begin(), remainders.end(),
+            [](const std::pair<double, size_t>& a, const std::pair<double, size_t>& b) {
+                return a.first != b.first ? a.first > b.first : a.second < b.second;
+            });
+        for (size_t k = 0; k < remainders.size() && assigned < num_testing; ++k, ++assigned)
+            ++quota[remainders[k].second];
+
+        // Draw each class's testing images with a partial Fisher-Yates shuffle
+        std::mt19937_64 g(seed);
+        std::vector<char> testing(num_images, 0);
+        for (size_t c = 0; c < quota.size(); ++c)
+        {
+            size_t* records = by_class.data() + begin[c];
+            const size_t n = begin[c + 1] - begin[c];
+            for (size_t i = 0; i < quota[c]; ++i)
+            {
+                std::swap(records[i], records[i + static_cast<size_t>(g() % (n - i))]);
+                testing[records[i]] = 1;
+            }
+        }
+
+        imagenet_split split;
+        split.testing.reserve(num_testing);
+        split.training.reserve(num_images - num_testing);
+        for (size_t i = 0; i < num_images; ++i)
+            (testing[i] ? split.testing : split.training).push_back(i);
+        return split;
+    }
+
+    namespace impl
+    {
+        /**
+         * Appends the numeric labels of one dataset file (not a shard index)
+         */
+        void read_file_labels(const std::string& filename, std::vector<uint16>& labels)
+        {
+            const dataset_format format = detect_dataset_format(filename);
+            if (format == dataset_format::fixed)
+            {
+                const mapped_imagenet_dataset file(filename);
+                for (size_t i = 0; i < file.size(); ++i)
+                    labels.push_back(static_cast<uint16>(file.numeric_label(i)));
+                return;
+            }
+
+            class_index index;
+            size_t total = 0;
+            bool indexed = false;
+            if (format == dataset_format::compressed)
+            {
+                const compressed_dataset_file file(filename);
+                if (file.has_class_index())
+                {
+                    index = file.classes();
+                    total = file.size();
+                    indexed = true;
+                }
+            }
+            else if (format == dataset_format::stream)
+            {
+                std::vector<std::string> class_names;
+                if (read_stream_class_index(filename, class_names, index))
+                {
+                    for (size_t r = 0; r < index.size(); ++r)
+                        total = std::max<size_t>(total, index.first[r] + index.counts[r]);
+                    indexed = true;
+                }
+            }
+
+            if (indexed)
+            {
+                const size_t base = labels.size();
+                labels.resize(base + total, 0);
+                for (size_t r = 0; r < index.size(); ++r)
+                    std::fill_n(labels.begin() + base + index.first[r], index.counts[r], index.labels[r]);
+                return;
+            }
+
+            // No index, the labels are only known by reading the records
+            imagenet_dataset_reader reader(filename);
+            matrix<rgb_pixel> img;
+            std::string label;
+            unsigned long numeric_label;
+            while (reader.read(img, label, numeric_label))
+                labels.push_back(static_cast<uint16>(numeric_label));
+        }
+
+        /**
+         * Lists the dataset files of a path: the shards of an index, in order, or the file itself
+         */
+        std::vector<std::string> dataset_files(const std::string& dataset_file)
+        {
+            if (!is_shard_index(dataset_file))
+                return std::vector<std::string>(1, dataset_file);
+            const imagenet_shard_index index = load_imagenet_shard_index(dataset_file);
+            std::vector<std::string> files;
+            for (const auto& name : index.shard_files)
+                files.push_back(directory_part(dataset_file) + name);
+            return files;
+        }
+    }
+
+    /**
+     * Reads the numeric label of every record of a dataset without reading its pixels
+     *
+     * Fixed-stride files hold a label array and stream and compressed files a class
+     * index, so only that is read. Files without one (legacy, or written by an older
+     * version) have to be read in full. A shard index gives the labels of all its
+     * shards, concatenated in shard order.
+     *
+     * @param dataset_file Path to the saved dataset file or shard index
+     * @return The numeric label of each record, in file order
+     */
+    std::vector<uint16> read_imagenet_labels(const std::string& dataset_file)
+    {
+        std::vector<uint16> labels;
+        for (const auto& file : impl::dataset_files(dataset_file))
+            impl::read_file_labels(file, labels);
+        return labels;
+    }
+
+    /**
+     * Reads the pixel statistics stored with a dataset, without reading its images
+     *
+     * They give the channel means and standard deviations to normalize with, for
+     * the whole dataset and for each class. Legacy files and files written before
+     * statistics were stored have none; a shard index has them only if all its
+     * shards do.
+     *
+     * @param dataset_file Path to the saved dataset file or shard index
+     * @return The statistics of the dataset, empty() if it does not store them
+     */
+    imagenet_dataset_stats read_imagenet_stats(const std::string& dataset_file)
+    {
+        imagenet_dataset_stats stats;
+        for (const auto& file : impl::dataset_files(dataset_file))
+        {
+            imagenet_dataset_stats file_stats;
+            const dataset_format format = detect_dataset_format(file);
+            if (format == dataset_format::fixed)
+            {
+                file_stats = mapped_imagenet_dataset(file).stats();
+            }
+            else if (format == dataset_format::compressed)
+            {
+                file_stats = impl::compressed_dataset_file(file).stats();
+            }
+            else if (format == dataset_format::stream)
+            {
+                std::vector<std::string> class_names;
+                impl::class_index index;
+                impl::read_stream_class_index(file, class_names, index, &file_stats);
+            }
+            if (file_stats.empty())
+                return imagenet_dataset_stats();
+            stats.add(file_stats);
+        }
+        return stats;
+    }
+
+    /**
+     * Reads a dataset once, sending each record to the training or testing set
+     *
+     * Records are numbered as by read_imagenet_labels(); those in neither list are
+     * skipped (fixed-stride files do not even page them in). Each set receives its
+     * images in file order, whatever the order of the indices in split.
+     *
+     * @param dataset_file Path to the saved dataset file or shard index
+     * @param split Indices of the training and testing records
+     * @param training Receives the training images
+     * @param testing Receives the testing images
+     */
+    void load_imagenet_split(
+        const std::string& dataset_file,
+        const imagenet_split& split,
+        imagenet_dataset& training,
+        imagenet_dataset& testing
+    )
+    {
+        training = imagenet_dataset();
+        testing = imagenet_dataset();
+
+        // 0: skipped, 1: training, 2: testing
+        std::vector<char> destination;
+        const auto assign = [&](const std::vector<size_t>& indices, char value)
+        {
+            for (const auto i : indices)
+            {
+                if (i >= destination.size())
+                    destination.resize(i + 1, 0);
+                destination[i] = value;
+            }
+        };
+        assign(split.training, 1);
+        assign(split.testing, 2);
+        const auto target = [&](size_t record) -> imagenet_dataset*
+        {
+            const char d = record < destination.size() ? destination[record] : 0;
+            return d == 1 ? &training : d == 2 ? &testing : nullptr;
+        };
+
+        size_t record = 0;
+        matrix<rgb_pixel> img;
+        std::string label;
+        unsigned long numeric_label;
+        for (const auto& file : impl::dataset_files(dataset_file))
+        {
+            if (detect_dataset_format(file) == dataset_format::fixed)
+            {
+                const mapped_imagenet_dataset mapped(file);
+                impl::merge_class_names(training.class_names, mapped.class_names());
+                impl::merge_class_names(testing.class_names, mapped.class_names());
+                for (size_t i = 0; i < mapped.size(); ++i, ++record)
+                {
+                    if (imagenet_dataset* dest = target(record))
+                    {
+                        mapped.copy_image(i, img);
+                        dest->push_back(std::move(img), mapped.label(i), mapped.numeric_label(i));
+                    }
+                }
+                continue;
+            }
+
+            imagenet_dataset_reader reader(file);
+            for (; reader.read(img, label, numeric_label); ++record)
+            {
+                if (imagenet_dataset* dest = target(record))
+                    dest->push_back(std::move(img), label, numeric_label);
+            }
+        }
+        if (destination.size() > record)
+            throw dlib::error("The split refers to record " + std::to_string(destination.size() - 1) +
+                " but " + dataset_file + " only has " + std::to_string(record));
+    }
+
+    /**
+     * Lightweight view of a subset of a dataset, defined by a list of record indices
+     * Works with imagenet_dataset as well as mapped_imagenet_dataset; neither the
+     * dataset nor the indices are copied, so both must outlive the view.
+     */
+    template <typename dataset_type>
+    class imagenet_subset
+    {
+    public:
+        imagenet_subset(
+            const dataset_type& dataset,
+            const std::vector<size_t>& indices
+        ) : m_dataset(&dataset), m_indices(&indices) {}
+
+        size_t size() const { return m_indices->size(); }
+        size_t index(size_t i) const { return (*m_indices)[i]; }
+        auto image(size_t i) const -> decltype(std::declval<const dataset_type&>().image(0)) { return m_dataset->image(index(i)); }
+        unsigned long numeric_label(size_t i) const { return m_dataset->numeric_label(index(i)); }
+
+    private:
+        const dataset_type* m_dataset;
+        const std::vector<size_t>* m_indices;
+    };
+
+    template <typename dataset_type>
+    imagenet_subset<dataset_type> make_subset(
+        const dataset_type& dataset,
+        const std::vector<size_t>& indices
+    )
+    {
+        return imagenet_subset<dataset_type>(dataset, indices);
+    }
+
+    namespace impl
+    {
+        // Decoded size aimed at for the blocks of fixed-stride and stream files
+        // (compressed files are cached one chunk at a time)
+        const uint64 cached_block_bytes = 4 << 20;
+
+        /**
+         * Consecutive records of one file that cached_imagenet_dataset reads and
+         * evicts together
+         */
+        struct cached_block
+        {
+            size_t part = 0;      // File holding the records
+            size_t first = 0;     // First record, numbered over the whole dataset
+            size_t count = 0;     // Number of records
+            uint64 position = 0;  // Fixed: first record of the file; compressed: chunk;
+                                  // stream: byte offset of the first record
+        };
+    }
+
+    /**
+     * Dataset that holds at most a given number of bytes of decoded images
+     *
+     * Only the labels are loaded when the dataset is opened. Images are read from
+     * the file in blocks of consecutive records (a chunk of a compressed file,
+     * about cached_block_bytes of pixels for the other formats) and kept in an LRU
+     * cache whose decoded size stays within the memory budget; the least recently
+     * used blocks are dropped to make room. Sequential passes read each block once,
+     * random access costs at most one block read per miss. Pages of memory-mapped
+     * files are released once their images are copied out, so the resident size
+     * stays close to the budget whatever the size of the file.
+     *
+     * Fixed-stride, compressed and stream files (and shard indexes of them) are
+     * accepted; legacy files can only be read as a whole. Stream files without a
+     * class index (written by older versions) are scanned once on open to locate
+     * their records. The const members can be called from several threads: blocks
+     * are read outside the lock, so concurrent misses may briefly exceed the budget
+     * by the blocks being read.
+     */
+    class cached_imagenet_dataset
+    {
+    public:
+        cached_imagenet_dataset() = default;
+
+        /**
+         * @param dataset_file Path to the saved dataset file or shard index
+         * @param memory_budget Bytes of decoded pixels to keep in memory (the last
+         *        block read is kept even if it is larger)
+         */
+        cached_imagenet_dataset(const std::string& dataset_file, uint64 memory_budget)
+        {
+            open(dataset_file, memory_budget);
+        }
+
+        cached_imagenet_dataset(const cached_imagenet_dataset&) = delete;
+        cached_imagenet_dataset& operator=(const cached_imagenet_dataset&) = delete;
+
+        /**
+         * Reads the labels of a dataset and empties the cache
+         * Must not be called while other threads use the dataset.
+         */
+        void open(const std::string& dataset_file, uint64 memory_budget)
+        {
+            m_parts.clear();
+            m_blocks.clear();
+            m_entries.clear();
+            m_lru.clear();
+            m_labels.clear();
+            m_class_names.clear();
+            m_budget = memory_budget;
+            m_cached_bytes = 0;
+            m_blocks_read = 0;
+
+            for (const auto& filename : impl::dataset_files(dataset_file))
+            {
+                part p;
+                p.filename = filename;
+                p.format = detect_dataset_format(filename);
+                m_parts.push_back(std::move(p));
+                if (m_parts.back().format == dataset_format::fixed)
+                    open_fixed(m_parts.size() - 1);
+                else if (m_parts.back().format == dataset_format::compressed)
+                    open_compressed(m_parts.size() - 1);
+                else if (m_parts.back().format == dataset_format::stream)
+                    open_stream(m_parts.size() - 1);
+                else
+                    throw dlib::error("Legacy dataset files cannot be read in blocks, load them whole: " + filename);
+            }
+            m_entries.resize(m_blocks.size());
+            m_stats = read_imagenet_stats(dataset_file);
+        }
+
+        size_t size() const { return m_labels.size(); }
+        const std::vector<std::string>& class_names() const { return m_class_names; }
+
+        /**
+         * @return Pixel statistics stored with the file, empty() if there are none
+         */
+        const imagenet_dataset_stats& stats() const { return m_stats; }
+
+        unsigned long numeric_label(size_t i) const
+        {
+            DLIB_ASSERT(i < size(), "image index out of range");
+            return m_labels[i];
+        }
+
+        const std::string& label(size_t i) const { return m_class_names[numeric_label(i)]; }
+
+        /**
+         * @return A copy of image i, read from the file if its block is not cached
+         */
+        matrix<rgb_pixel> image(size_t i) const
+        {
+            matrix<rgb_pixel> img;
+            copy_image(i, img);
+            return img;
+        }
+
+        void copy_image(size_t i, matrix<rgb_pixel>& img) const
+        {
+            DLIB_ASSERT(i < size(), "image index out of range");
+            const size_t b = block_of(i);
+            img = (*block(b))[i - m_blocks[b].first];
+        }
+
+        /**
+         * Fills a tensor of shape (indices.size(), 3, rows, cols) with the given
+         * images, which must all have the same size, normalized as by input_rgb_image
+         */
+        void copy_to_tensor(const std::vector<size_t>& indices, resizable_tensor& data) const
+        {
+            matrix<rgb_pixel> img;
+            float* dest = nullptr;
+            for (size_t k = 0; k < indices.size(); ++k)
+            {
+                copy_image(indices[k], img);
+                if (k == 0)
+                {
+                    data.set_size(indices.size(), 3, img.nr(), img.nc());
+                    dest = data.host();
+                }
+                else if (img.nr() != data.nr() || img.nc() != data.nc())
+                {
+                    throw dlib::error("copy_to_tensor() needs images of the same size");
+                }
+                if (img.size() != 0)
+                    impl::interleaved_to_planar_float(&img(0, 0), img.size(), impl::input_rgb_mean,
+                        impl::input_rgb_scale, dest + k * 3 * img.size());
+            }
+        }
+
+        uint64 memory_budget() const { return m_budget; }
+
+        /**
+         * @return Bytes of decoded pixels currently cached
+         */
+        uint64 cached_bytes() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_cached_bytes;
+        }
+
+        /**
+         * @return Number of blocks read from the files since open(), to size the budget
+         *         (a block two threads read at once counts once)
+         */
+        size_t blocks_read() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_blocks_read;
+        }
+
+    private:
+        typedef std::vector<matrix<rgb_pixel>> block_images;
+
+        struct part
+        {
+            std::string filename;
+            dataset_format format = dataset_format::legacy;
+            unsigned long version = 0;  // Stream files
+            std::unique_ptr<mapped_imagenet_dataset> fixed;
+            std::unique_ptr<impl::compressed_dataset_file> compressed;
+        };
+
+        struct cache_entry
+        {
+            std::shared_ptr<const block_images> images;  // Null when not cached
+            uint64 bytes = 0;
+            std::list<size_t>::iterator position;        // In m_lru
+        };
+
+        /**
+         * Number of records per block for images of rows x cols
+         */
+        size_t block_records(long rows, long cols) const
+        {
+            const uint64 target = std::min<uint64>(impl::cached_block_bytes, m_budget / 8);
+            const uint64 image_bytes = std::max<uint64>(1, static_cast<uint64>(rows * cols) * sizeof(rgb_pixel));
+            return static_cast<size_t>(std::max<uint64>(1, target / image_bytes));
+        }
+
+        /**
+         * Cuts count records starting at first (both numbered within part p) into blocks
+         * position(j) gives the block position of record first + j.
+         */
+        template <typename position_fn>
+        void add_blocks(size_t p, size_t base, size_t first, size_t count, size_t per_block, position_fn position)
+        {
+            for (size_t j = 0; j < count; j += per_block)
+            {
+                impl::cached_block block;
+                block.part = p;
+                block.first = base + first + j;
+                block.count = std::min(per_block, count - j);
+                block.position = position(j);
+                m_blocks.push_back(block);
+            }
+        }
+
+        void open_fixed(size_t p)
+        {
+            part& f = m_parts[p];
+            f.fixed.reset(new mapped_imagenet_dataset(f.filename));
+            impl::merge_class_names(m_class_names, f.fixed->class_names());
+            const size_t base = m_labels.size();
+            for (size_t i = 0; i < f.fixed->size(); ++i)
+                m_labels.push_back(static_cast<uint16>(f.fixed->numeric_label(i)));
+            f.fixed->drop_pages();
+            add_blocks(p, base, 0, f.fixed->size(), block_records(f.fixed->nr(), f.fixed->nc()),
+                [](size_t j) { return j; });
+        }
+
+        void open_compressed(size_t p)
+        {
+            part& f = m_parts[p];
+            f.compressed.reset(new impl::compressed_dataset_file(f.filename));
+            const impl::compressed_dataset_file& file = *f.compressed;
+            impl::merge_class_names(m_class_names, file.class_names());
+            const size_t base = m_labels.size();
+            m_labels.resize(base + file.size());
+            if (file.has_class_index())
+            {
+                const impl::class_index& index = file.classes();
+                for (size_t r = 0; r < index.size(); ++r)
+                    std::fill_n(m_labels.begin() + base + index.first[r], index.counts[r], index.labels[r]);
+            }
+            for (size_t k = 0; k < file.num_chunks(); ++k)
+            {
+                if (!file.has_class_index())
+                {
+                    // Older files: the labels are only known once the chunks are inflated
+                    block_images images(file.chunk_size(k));
+                    std::vector<char> buffer;
+                    file.decode_chunk(k, images.data(), m_labels.data() + base + file.chunk_begin(k), buffer);
+                    file.drop_chunk_pages(k);
+                }
+                add_blocks(p, base, file.chunk_begin(k), file.chunk_size(k), file.chunk_size(k),
+                    [k](size_t) { return k; });
+            }
+        }
+
+        void open_stream(size_t p)
+        {
+            part& f = m_parts[p];
+            std::ifstream in(f.filename, std::ios::binary);
+            in.ignore(sizeof(impl::stream_magic));
+            deserialize(f.version, in);
+            if (f.version != 1 && f.version != impl::stream_version)
+                throw dlib::error("Unsupported dataset version " + std::to_string(f.version) + " in file: " + f.filename);
+
+            const size_t base = m_labels.size();
+            const std::streampos records = in.tellg();
+            std::vector<std::string> names;
+            impl::class_index index;
+            std::vector<stream_run> runs;
+            if (impl::read_stream_class_index(f.filename, names, index))
+            {
+                if (measure_stream_runs(in, f.filename, names, index, runs))
+                {
+                    impl::merge_class_names(m_class_names, names);
+                    for (size_t r = 0; r < index.size(); ++r)
+                    {
+                        const uint64 begin = index.offsets[r], length = runs[r].length;
+                        if (m_labels.size() < base + index.first[r] + index.counts[r])
+                            m_labels.resize(base + index.first[r] + index.counts[r]);
+                        std::fill_n(m_labels.begin() + base + index.first[r], index.counts[r], index.labels[r]);
+                        add_blocks(p, base, index.first[r], index.counts[r], block_records(runs[r].rows, runs[r].cols),
+                            [&](size_t j) { return begin + j * length; });
+                    }
+                    return;
+                }
+                // Runs of several image sizes: walk the records as without an index
+                in.clear();
+                in.seekg(records);
+                names.clear();
+            }
+
+            // No index: walk the records, skipping their pixels
+            size_t count = 0, per_block = 0, in_block = 0;
+            while (true)
+            {
+                const uint64 position = static_cast<uint64>(in.tellg());
+                const int tag = in.get();
+                if (tag == impl::stream_class_tag && f.version >= 2)
+                {
+                    uint16 id;
+                    deserialize(id, in);
+                    if (id >= names.size())
+                        names.resize(id + 1);
+                    deserialize(names[id], in);
+                    impl::merge_class_names(m_class_names, names);
+                }
+                else if (tag == impl::stream_record_tag)
+                {
+                    long rows, cols;
+                    if (!skip_stream_pixels(in, rows, cols))
+                        throw dlib::error("Incomplete or corrupted dataset file: " + f.filename);
+                    unsigned long label;
+                    if (f.version == 1)
+                    {
+                        std::string name;
+                        deserialize(name, in);
+                        deserialize(label, in);
+                        if (label > std::numeric_limits<uint16>::max())
+                            throw error("Numeric label " + std::to_string(label) + " does not fit the 16-bit label table");
+                        if (label >= m_class_names.size())
+                            m_class_names.resize(label + 1);
+                        if (m_class_names[label].empty())
+                            m_class_names[label] = name;
+                    }
+                    else
+                    {
+                        uint16 id;
+                        deserialize(id, in);
+                        if (id >= names.size() || names[id].empty())
+                            throw dlib::error("Corrupted dataset file (image of an unknown class): " + f.filename);
+                        label = id;
+                    }
+                    if (in_block == per_block)
+                    {
+                        impl::cached_block block;
+                        block.part = p;
+                        block.first = base + count;
+                        block.position = position;
+                        m_blocks.push_back(block);
+                        per_block = block_records(rows, cols);
+                        in_block = 0;
+                    }
+                    ++m_blocks.back().count;
+                    ++in_block;
+                    m_labels.push_back(static_cast<uint16>(label));
+                    ++count;
+                }
+                else if (tag == impl::stream_end_tag)
+                {
+                    size_t expected;
+                    deserialize(expected, in);
+                    if (expected != count)
+                        throw dlib::error("Corrupted dataset file (record count mismatch): " + f.filename);
+                    return;
+                }
+                else
+                {
+                    throw dlib::error("Incomplete or corrupted dataset file: " + f.filename);
+                }
+            }
+        }
+
+        struct stream_run
+        {
+            uint64 length = 0; // Bytes per record
+            long rows = 0;
+            long cols = 0;
+        };
+
+        /**
+         * Measures the records of each run of a stream class index from its first
+         * record. The writer only splits runs by class, so a run may hold images of
+         * several sizes; the record length then does not hold for the whole run.
+         *
+         * @return false unless the last record of each run has the size of its first
+         *         one and ends exactly where the next run (after the class record of
+         *         a new class) or the end marker starts
+         * @throw dlib::error if a run does not start with an image record
+         */
+        static bool measure_stream_runs(
+            std::istream& in,
+            const std::string& filename,
+            const std::vector<std::string>& names,
+            const impl::class_index& index,
+            std::vector<stream_run>& runs
+        )
+        {
+            runs.assign(index.size(), stream_run());
+            std::vector<bool> seen(names.size(), false);
+            for (size_t r = 0; r < index.size(); ++r)
+            {
+                const uint64 begin = index.offsets[r];
+                stream_run& run = runs[r];
+                in.seekg(begin);
+                uint16 id;
+                if (in.get() != impl::stream_record_tag || !skip_stream_pixels(in, run.rows, run.cols))
+                    throw dlib::error("Corrupted class index in dataset file: " + filename);
+                deserialize(id, in);
+                run.length = static_cast<uint64>(in.tellg()) - begin;
+                if (index.labels[r] < seen.size())
+                    seen[index.labels[r]] = true;
+
+                if (index.counts[r] > 1)
+                {
+                    long rows, cols;
+                    in.seekg(begin + (index.counts[r] - 1) * run.length);
+                    if (in.get() != impl::stream_record_tag || !skip_stream_pixels(in, rows, cols) ||
+                        rows != run.rows || cols != run.cols)
+                        return false;
+                }
+
+                const uint64 end = begin + index.counts[r] * run.length;
+                if (r + 1 == index.size())
+                {
+                    in.seekg(end);
+                    if (in.get() != impl::stream_end_tag)
+                        return false;
+                }
+                else if (end != index.offsets[r + 1])
+                {
+                    // A class seen for the first time is announced by its class record
+                    const uint16 next = index.labels[r + 1];
+                    if (next >= names.size() || seen[next])
+                        return false;
+                    std::ostringstream record;
+                    record.put(impl::stream_class_tag);
+                    serialize(next, record);
+                    serialize(names[next], record);
+                    if (end + record.str().size() != index.offsets[r + 1])
+                        return false;
+                }
+            }
+            in.clear();
+            return true;
+        }
+
+        /**
+         * Reads the size of a serialized matrix<rgb_pixel> and seeks past its pixels
+         */
+        static bool skip_stream_pixels(std::istream& in, long& rows, long& cols)
+        {
+            deserialize(rows, in);
+            deserialize(cols, in);
+            if (rows < 0 || cols < 0)
+            {
+                rows = -rows;
+                cols = -cols;
+            }
+            in.seekg(rows * cols * sizeof(rgb_pixel), std::ios::cur);
+            return static_cast<bool>(in);
+        }
+
+        size_t block_of(size_t i) const
+        {
+            const auto next = std::upper_bound(m_blocks.begin(), m_blocks.end(), i,
+                [](size_t record, const impl::cached_block& b) { return record < b.first; });
+            return static_cast<size_t>(next - m_blocks.begin()) - 1;
+        }
+
+        /**
+         * @return The images of block b, from the cache or read from the file
+         */
+        std::shared_ptr<const block_images> block(size_t b) const
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                cache_entry& entry = m_entries[b];
+                if (entry.images)
+                {
+                    m_lru.splice(m_lru.begin(), m_lru, entry.position);
+                    return entry.images;
+                }
+            }
+
+            std::shared_ptr<block_images> images = std::make_shared<block_images>(m_blocks[b].count);
+            read_block(m_blocks[b], *images);
+            uint64 bytes = 0;
+            for (const auto& img : *images)
+                bytes += static_cast<uint64>(img.size()) * sizeof(rgb_pixel);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            cache_entry& entry = m_entries[b];
+            if (entry.images)
+                return entry.images;  // Read by another thread in the meantime
+            ++m_blocks_read;
+            while (!m_lru.empty() && m_cached_bytes + bytes > m_budget)
+            {
+                cache_entry& oldest = m_entries[m_lru.back()];
+                m_cached_bytes -= oldest.bytes;
+                oldest.images.reset();
+                m_lru.pop_back();
+            }
+            entry.images = images;
+            entry.bytes = bytes;
+            m_lru.push_front(b);
+            entry.position = m_lru.begin();
+            m_cached_bytes += bytes;
+            return entry.images;
+        }
+
+        void read_block(const impl::cached_block& block, block_images& images) const
+        {
+            const part& f = m_parts[block.part];
+            if (f.format == dataset_format::fixed)
+            {
+                for (size_t j = 0; j < block.count; ++j)
+                    f.fixed->copy_image(block.position + j, images[j]);
+                f.fixed->drop_pages(block.position, block.count);
+                return;
+            }
+
+            if (f.format == dataset_format::compressed)
+            {
+                std::vector<uint16> labels(block.count);
+                std::vector<char> buffer;
+                f.compressed->decode_chunk(block.position, images.data(), labels.data(), buffer);
+                f.compressed->drop_chunk_pages(block.position);
+                return;
+            }
+
+            std::ifstream in(f.filename, std::ios::binary);
+            in.seekg(block.position);
+            for (size_t j = 0; j < block.count; ++j)
+            {
+                int tag = in.get();
+                while (tag == impl::stream_class_tag && f.version >= 2)
+                {
+                    uint16 id;
+                    std::string name;
+                    deserialize(id, in);
+                    deserialize(name, in);
+                    tag = in.get();
+                }
+                if (tag != impl::stream_record_tag)
+                    throw dlib::error("Incomplete or corrupted dataset file: " + f.filename);
+                deserialize(images[j], in);
+                unsigned long label;
+                if (f.version == 1)
+                {
+                    std::string name;
+                    deserialize(name, in);
+                    deserialize(label, in);
+                }
+                else
+                {
+                    uint16 id;
+                    deserialize(id, in);
+                    label = id;
+                }
+                if (label != m_labels[block.first + j])
+                    throw dlib::error("Dataset file changed since it was opened: " + f.filename);
+            }
+        }
+
+        std::vector<part> m_parts;
+        std::vector<impl::cached_block> m_blocks;
+        std::vector<uint16> m_labels;
+        std::vector<std::string> m_class_names;
+        imagenet_dataset_stats m_stats;
+        uint64 m_budget = 0;
+
+        mutable std::mutex m_mutex;
+        mutable std::vector<cache_entry> m_entries;  // One per block
+        mutable std::list<size_t> m_lru;             // Cached blocks, most recently used first
+        mutable uint64 m_cached_bytes = 0;
+        mutable size_t m_blocks_read = 0;
+    };
+
+    /**
+     * Loads a preprocessed ImageNet dataset and computes a train/test split as indices
+     * This costs no pixel copy; use make_subset() to iterate over either set.
+     * dataset.stats receives the pixel statistics stored with the file (see
+     * read_imagenet_stats), empty() if it has none.
+     *
+     * @param dataset_file Path to the saved dataset file
+     * @param dataset Receives the whole dataset
+     * @param split Receives the training and testing indices
+     * @param test_fraction Fraction of data to use for testing (default 0.05)
+     * @param seed Seed of the split (default: drawn from std::random_device)
+     */
+    void load_stable_imagenet_1k(
+        const std::string& dataset_file,
+        imagenet_dataset& dataset,
+        imagenet_split& split,
+        double test_fraction = 0.05,
+        unsigned long seed = std::random_device()()
+    )
+    {
+        load_imagenet_dataset(dataset_file, dataset);
+        dataset.stats = read_imagenet_stats(dataset_file);
+        split = split_imagenet_dataset(dataset.size(), test_fraction, seed);
+    }
+
+    /**
+     * Same as above but only loads the images picked by selection (see
+     * load_imagenet_dataset()); the split is computed over the selected images.
+     * The statistics remain those of the whole file.
+     */
+    void load_stable_imagenet_1k(
+        const std::string& dataset_file,
+        const imagenet_selection& selection,
+        imagenet_dataset& dataset,
+        imagenet_split& split,
+        double test_fraction = 0.05,
+        unsigned long seed = std::random_device()()
+    )
+    {
+        load_imagenet_dataset(dataset_file, selection, dataset);
+        dataset.stats = read_imagenet_stats(dataset_file);
+        split = split_imagenet_dataset(dataset.size(), test_fraction, seed);
+    }
+
+    /**
+     * Same as the first overload but keeps every pixel in one contiguous block
+     * Iterate over either set with make_subset(dataset, split.training), whose
+     * images are zero-copy views.
+     */
+    void load_stable_imagenet_1k(
+        const std::string& dataset_file,
+        packed_imagenet_dataset& dataset,
+        imagenet_split& split,
+        double test_fraction = 0.05,
+        unsigned long seed = std::random_device()()
+    )
+    {
+        load_imagenet_dataset(dataset_file, dataset);
+        dataset.set_stats(read_imagenet_stats(dataset_file));
+        split = split_imagenet_dataset(dataset.size(), test_fraction, seed);
+    }
+
+    /**
+     * Same as the first overload but keeps at most memory_budget bytes of decoded
+     * images in memory, reading the others from the file when they are accessed
+     * (see cached_imagenet_dataset). dataset.stats() returns the stored statistics.
+     */
+    void load_stable_imagenet_1k(
+        const std::string& dataset_file,
+        uint64 memory_budget,
+        cached_imagenet_dataset& dataset,
+        imagenet_split& split,
+        double test_fraction = 0.05,
+        unsigned long seed = std::random_device()()
+    )
+    {
+        dataset.open(dataset_file, memory_budget);
+        split = split_imagenet_dataset(dataset.size(), test_fraction, seed);
+    }
+
+    /**
+     * Loads a preprocessed ImageNet dataset and splits it into training and testing sets
+     * The legacy, stream and fixed formats are all accepted. Images are moved (or, for
+     * fixed-stride files, copied straight from the memory mapping) into the output
+     * vectors, so each image is held in memory only once. The vectors leave no room
+     * for the pixel statistics; read them with read_imagenet_stats().
+     *
+     * @param dataset_file Path to the saved dataset file
+     * @param training_images Output vector for training images
+     * @param training_labels Output vector for training labels
+     * @param testing_images Output vector for testing images
+     * @param testing_labels Output vector for testing labels
+     * @param test_fraction Fraction of data to use for testing (default 0.05)
+     * @param seed Seed of the split (default: drawn from std::random_device)
+     */
+    void load_stable_imagenet_1k(
+        const std::string& dataset_file,
+        std::vector<matrix<rgb_pixel>>& training_images,
+        std::vector<unsigned long>& training_labels,
+        std::vector<matrix<rgb_pixel>>& testing_images,
+        std::vector<unsigned long>& testing_labels,
+        double test_fraction = 0.05,
+        unsigned long seed = std::random_device()()
+    )
+    {
+        training_images.clear();
+        training_labels.clear();
+        testing_images.clear();
+        testing_labels.clear();
+
+        if (detect_dataset_format(dataset_file) == dataset_format::fixed)
+        {
+            mapped_imagenet_dataset dataset(dataset_file);
+            const imagenet_split split = split_imagenet_dataset(dataset.size(), test_fraction, seed);
+            const auto fill = [&](const std::vector<size_t>& indices,
+                std::vector<matrix<rgb_pixel>>& images, std::vector<unsigned long>& labels)
+            {
+                images.resize(indices.size());
+                labels.resize(indices.size());
+                for (size_t i = 0; i < indices.size(); ++i)
+                {
+                    dataset.copy_image(indices[i], images[i]);
+                    labels[i] = dataset.numeric_label(indices[i]);
+                }
+            };
+            fill(split.training, training_images, training_labels);
+            fill(split.testing, testing_images, testing_labels);
+            return;
+        }
+
+        imagenet_dataset dataset;
+        load_imagenet_dataset(dataset_file, dataset);
+        const imagenet_split split = split_imagenet_dataset(dataset.size(), test_fraction, seed);
+
+        // Move the images out of the dataset instead of copying them
+        const auto fill = [&](const std::vector<size_t>& indices,
+            std::vector<matrix<rgb_pixel>>& images, std::vector<unsigned long>& labels)
+        {
+            images.reserve(indices.size());
+            labels.reserve(indices.size());
+            for (size_t idx : indices)
+            {
+                images.push_back(std::move(dataset.images[idx]));
+                labels.push_back(dataset.numeric_labels[idx]);
+            }
+        };
+        fill(split.training, training_images, training_labels);
+        fill(split.testing, testing_images, testing_labels);
+    }
+
+    /**
+     * Loads a preprocessed ImageNet dataset straight into class-balanced training
+     * and testing sets
+     * The split is computed from the labels alone (see
+     * stratified_split_imagenet_dataset()), then the file is read once, each image
+     * going directly to its set.
+     *
+     * @param dataset_file Path to the saved dataset file or shard index
+     * @param training Receives the training images
+     * @param testing Receives the testing images
+     * @param test_fraction Fraction of each class to use for testing (default 0.05)
+     * @param seed Seed of the split (default: drawn from std::random_device)
+     */
+    void load_stratified_imagenet_1k(
+        const std::string& dataset_file,
+        imagenet_dataset& training,
+        imagenet_dataset& testing,
+        double test_fraction = 0.05,
+        unsigned long seed = std::random_device()()
+    )
+    {
+        const imagenet_split split = stratified_split_imagenet_dataset(read_imagenet_labels(dataset_file), test_fraction, seed);
+        load_imagenet_split(dataset_file, split, training, testing);
+    }
+
+    /**
+     * Random transformations applied by imagenet_batch_loader to every image it serves
+     * Everything is disabled by default.
+     */
+    struct imagenet_augmentation
+    {
+        long crop_rows = 0;         // Size of the served images, 0 to keep the size of the stored ones
+        long crop_cols = 0;
+        double min_scale = 1;       // Smallest crop area, as a fraction of the largest crop that fits;
+                                    // below 1 the crop is resized to crop_rows x crop_cols
+        bool flip = false;          // Mirror half of the images left to right
+        double brightness = 0;      // Maximum relative change of brightness, contrast and saturation,
+        double contrast = 0;        // e.g. 0.4 draws each factor in [0.6, 1.4]
+        double saturation = 0;
+
+        bool enabled() const
+        {
+            return crop_rows > 0 || crop_cols > 0 || min_scale < 1 || flip ||
+                brightness > 0 || contrast > 0 || saturation > 0;
+        }
+    };
+
+    namespace impl
+    {
+        inline unsigned char clamp_pixel(float v)
+        {
+            return static_cast<unsigned char>(v <= 0 ? 0 : v >= 255 ? 255 : v + 0.5f);
+        }
+
+        inline double uniform(std::mt19937_64& rng, double lo, double hi)
+        {
+            return lo + (hi - lo) * (rng() >> 11) * (1.0 / 9007199254740992.0);
+        }
+
+        /**
+         * Draws a crop of src, optionally mirrored, into out
+         * The crop has the aspect ratio of out and an area between min_scale and 1
+         * times the largest such crop; it is copied as is when it has the size of out,
+         * bilinearly resampled otherwise. out keeps its buffer when its size does not
+         * change.
+         */
+        void random_crop(
+            const rgb_pixel* src,
+            long rows,
+            long cols,
+            const imagenet_augmentation& aug,
+            std::mt19937_64& rng,
+            matrix<rgb_pixel>& out
+        )
+        {
+            const long out_rows = aug.crop_rows > 0 ? aug.crop_rows : rows;
+            const long out_cols = aug.crop_cols > 0 ? aug.crop_cols : cols;
+            out.set_size(out_rows, out_cols);
+
+            // Largest region with the aspect ratio of the output, scaled down at random
+            double fit_rows = rows, fit_cols = static_cast<double>(rows) * out_cols / out_rows;
+            if (fit_cols > cols)
+            {
+                fit_cols = cols;
+                fit_rows = static_cast<double>(cols) * out_rows / out_cols;
+            }
+            const double side = std::sqrt(uniform(rng, std::min(1.0, std::max(aug.min_scale, 0.01)), 1.0));
+            long crop_rows = std::max(1L, static_cast<long>(fit_rows * side));
+            long crop_cols = std::max(1L, static_cast<long>(fit_cols * side));
+            if (aug.min_scale >= 1 && out_rows <= rows && out_cols <= cols)
+            {
+                crop_rows = out_rows;
+                crop_cols = out_cols;
+            }
+            const long top = static_cast<long>(rng() % static_cast<uint64>(rows - crop_rows + 1));
+            const long left = static_cast<long>(rng() % static_cast<uint64>(cols - crop_cols + 1));
+            const bool mirror = aug.flip && (rng() & 1);
+
+            if (crop_rows == out_rows && crop_cols == out_cols)
+            {
+                for (long r = 0; r < out_rows; ++r)
+                {
+                    const rgb_pixel* in = src + (top + r) * cols + left;
+                    if (!mirror)
+                        std::memcpy(&out(r, 0), in, out_cols * sizeof(rgb_pixel));
+                    else
+                        for (long c = 0; c < out_cols; ++c)
+                            out(r, c) = in[out_cols - 1 - c];
+                }
+                return;
+            }
+
+            const double sy = static_cast<double>(crop_rows) / out_rows;
+            const double sx = static_cast<double>(crop_cols) / out_cols;
+            for (long r = 0; r < out_rows; ++r)
+            {
+                const double y = std::min(std::max(top + (r + 0.5) * sy - 0.5, 0.0), rows - 1.0);
+                const long y0 = static_cast<long>(y);
+                const long y1 = std::min(y0 + 1, rows - 1);
+                const float fy = static_cast<float>(y - y0);
+                for (long c = 0; c < out_cols; ++c)
+                {
+                    const double x = std::min(std::max(left + (c + 0.5) * sx - 0.5, 0.0), cols - 1.0);
+                    const long x0 = static_cast<long>(x);
+                    const long x1 = std::min(x0 + 1, cols - 1);
+                    const float fx = static_cast<float>(x - x0);
+                    const unsigned char* p00 = &src[y0 * cols + x0].red;
+                    const unsigned char* p01 = &src[y0 * cols + x1].red;
+                    const unsigned char* p10 = &src[y1 * cols + x0].red;
+                    const unsigned char* p11 = &src[y1 * cols + x1].red;
+                    unsigned char* dest = &out(r, mirror ? out_cols - 1 - c : c).red;
+                    for (int k = 0; k < 3; ++k)
+                    {
+                        const float top_value = p00[k] + (p01[k] - p00[k]) * fx;
+                        const float bottom_value = p10[k] + (p11[k] - p10[k]) * fx;
+                        dest[k] = clamp_pixel(top_value + (bottom_value - top_value) * fy);
+                    }
+                }
+            }
+        }
+
+        /**
+         * Scales the brightness, contrast and saturation of img by random factors, in place
+         */
+        void random_color_jitter(
+            matrix<rgb_pixel>& img,
+            const imagenet_augmentation& aug,
+            std::mt19937_64& rng
+        )
+        {
+            const float b = static_cast<float>(uniform(rng, 1 - aug.brightness, 1 + aug.brightness));
+            const float c = static_cast<float>(uniform(rng, 1 - aug.contrast, 1 + aug.contrast));
+            const float s = static_cast<float>(uniform(rng, 1 - aug.saturation, 1 + aug.saturation));
+            const size_t n = img.size();
+            if (n == 0)
+                return;
+            rgb_pixel* p = &img(0, 0);
+
+            double sum = 0;
+            for (size_t i = 0; i < n; ++i)
+                sum += 0.299f * p[i].red + 0.587f * p[i].green + 0.114f * p[i].blue;
+            const float mean = static_cast<float>(sum / n);
+
+            // out = b * (c * (s * p + (1 - s) * gray) + (1 - c) * mean)
+            for (size_t i = 0; i < n; ++i)
+            {
+                const float gray = 0.299f * p[i].red + 0.587f * p[i].green + 0.114f * p[i].blue;
+                const float offset = (1 - s) * gray * c + (1 - c) * mean;
+                p[i].red = clamp_pixel(b * (c * s * p[i].red + offset));
+                p[i].green = clamp_pixel(b * (c * s * p[i].green + offset));
+                p[i].blue = clamp_pixel(b * (c * s * p[i].blue + offset));
+            }
+        }
+    }
+
+    /**
+     * Form in which an imagenet_batch_loader hands its batches over
+     *
+     * - images: one matrix<rgb_pixel> per record, from get_batch(images, labels)
+     * - tensor: a (n, 3, rows, cols) tensor of values normalized as by
+     *   input_rgb_image, from get_batch(data, labels)
      */
-    void load_stable_imagenet_1k(
-        const std::string& dataset_file,
-        std::vector<matrix<rgb_pixel>>& training_images,
-        std::vector<unsigned long>& training_labels,
-        std::vector<matrix<rgb_pixel>>& testing_images,
-        std::vector<unsigned long>& testing_labels,
-        double test_fraction = 0.05
+    enum class batch_output
+    {
+        images,
+        tensor
+    };
+
+    /**
+     * Produces shuffled mini-batches from a dataset file on demand
+     *
+     * Background worker threads assemble the next batches while the caller trains on
+     * the current one. Finished batches wait in a bounded dlib::pipe, so at most
+     * about max_queued_batches batches are held in memory at any time. Batches are
+     * handed out in a fixed order whatever the number of workers: a worker never
+     * starts a batch more than max_queued_batches + num_workers ahead of the last one
+     * delivered, so batches finished early wait in a fixed ring of that many slots.
+     * The records are reshuffled at the start of every epoch; with an explicit seed
+     * the whole sequence of batches is reproducible.
+     *
+     * The dataset file must be fixed-stride (built with --format fixed): it is
+     * memory-mapped and images are copied out only when a batch needs them, so the
+     * loader never holds more than its queued batches. The other formats are not
+     * randomly accessible and are rejected.
+     *
+     * The workers produce batches in the batch_output form chosen at construction
+     * only: tensor batches are converted to normalized float planes in the
+     * background (straight from the mapping, or after augmentation), and the
+     * get_batch() overload of the other form must not be called.
+     *
+     * With an imagenet_augmentation, the workers also crop, flip and color-jitter
+     * the images. Each worker has its own random engine, reseeded from the seed and
+     * the batch number, so augmented batches are reproducible too. The buffers of the
+     * batches given back by get_batch() (the previous content of its arguments) are
+     * recycled by the workers, so once the loader is warm a batch of same-size
+     * images costs no allocation; the short last batch of an epoch keeps the
+     * buffers of the images it does not use for the next full one. What still
+     * allocates is the shuffle at the start of each epoch, the tensor
+     * get_batch() when data has to grow, and copies of images of varying size.
+     */
+    class imagenet_batch_loader
+    {
+    public:
+        /**
+         * Loader of image batches
+         *
+         * @param dataset_file Path to the fixed-stride dataset file
+         * @param batch_size Number of images per batch
+         * @param num_workers Number of background threads assembling batches (default 2)
+         * @param max_queued_batches Capacity of the queue of ready batches (default 8)
+         * @param seed Seed of the per-epoch shuffles (default: drawn from std::random_device)
+         * @throw dlib::error if dataset_file is not a fixed-stride file
+         */
+        imagenet_batch_loader(
+            const std::string& dataset_file,
+            size_t batch_size,
+            unsigned long num_workers = 2,
+            size_t max_queued_batches = 8,
+            unsigned long seed = std::random_device()()
+        ) : imagenet_batch_loader(dataset_file, std::vector<size_t>(), batch_size, num_workers, max_queued_batches, seed)
+        {
+        }
+
+        /**
+         * Same as above but only draws batches from the given records
+         * (for instance the training indices of an imagenet_split); an empty list
+         * means every record of the file.
+         */
+        imagenet_batch_loader(
+            const std::string& dataset_file,
+            std::vector<size_t> indices,
+            size_t batch_size,
+            unsigned long num_workers = 2,
+            size_t max_queued_batches = 8,
+            unsigned long seed = std::random_device()()
+        ) : imagenet_batch_loader(dataset_file, std::move(indices), batch_size, imagenet_augmentation(),
+                num_workers, max_queued_batches, seed)
+        {
+        }
+
+        /**
+         * Same as above but augments every image as described by augmentation
+         */
+        imagenet_batch_loader(
+            const std::string& dataset_file,
+            std::vector<size_t> indices,
+            size_t batch_size,
+            const imagenet_augmentation& augmentation,
+            unsigned long num_workers = 2,
+            size_t max_queued_batches = 8,
+            unsigned long seed = std::random_device()()
+        ) : imagenet_batch_loader(dataset_file, std::move(indices), batch_size, batch_output::images, augmentation,
+                num_workers, max_queued_batches, seed)
+        {
+        }
+
+        /**
+         * Same as above but hands the batches over in the given form
+         */
+        imagenet_batch_loader(
+            const std::string& dataset_file,
+            std::vector<size_t> indices,
+            size_t batch_size,
+            batch_output output,
+            const imagenet_augmentation& augmentation = imagenet_augmentation(),
+            unsigned long num_workers = 2,
+            size_t max_queued_batches = 8,
+            unsigned long seed = std::random_device()()
+        ) : m_batch_size(batch_size), m_indices(std::move(indices)), m_seed(seed), m_output(output),
+            m_augmentation(augmentation),
+            m_max_recycled(std::max<size_t>(1, max_queued_batches) + std::max(1ul, num_workers) + 1),
+            m_queue(std::max<size_t>(1, max_queued_batches))
+        {
+            DLIB_CASSERT(batch_size > 0, "batch_size must be positive");
+
+            if (detect_dataset_format(dataset_file) != dataset_format::fixed)
+                throw dlib::error("imagenet_batch_loader needs a fixed-stride dataset file (build it with --format fixed): " + dataset_file);
+            m_mapped.reset(new mapped_imagenet_dataset(dataset_file));
+
+            const size_t num_records = m_mapped->size();
+            if (m_indices.empty())
+            {
+                m_indices.resize(num_records);
+                for (size_t i = 0; i < m_indices.size(); ++i) m_indices[i] = i;
+            }
+            for (size_t idx : m_indices)
+            {
+                if (idx >= num_records)
+                    throw dlib::error("Batch loader index out of range for dataset: " + dataset_file);
+            }
+            if (m_indices.empty())
+                throw dlib::error("Cannot create a batch loader over an empty dataset: " + dataset_file);
+
+            m_batches_per_epoch = (m_indices.size() + m_batch_size - 1) / m_batch_size;
+            m_recycled.reserve(m_max_recycled);
+            m_pending.resize(std::max<size_t>(1, max_queued_batches) + std::max(1ul, num_workers));
+            m_parked.assign(m_pending.size(), 0);
+
+            for (unsigned long i = 0; i < std::max(1ul, num_workers); ++i)
+                m_workers.emplace_back([this]() { worker_loop(); });
+        }
+
+        ~imagenet_batch_loader()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_window_mutex);
+                m_stop.store(true);
+            }
+            m_window_signal.notify_all();
+            m_queue.disable();
+            for (auto& t : m_workers)
+                t.join();
+        }
+
+        imagenet_batch_loader(const imagenet_batch_loader&) = delete;
+        imagenet_batch_loader& operator=(const imagenet_batch_loader&) = delete;
+
+        size_t size() const { return m_indices.size(); }
+        size_t batch_size() const { return m_batch_size; }
+        size_t batches_per_epoch() const { return m_batches_per_epoch; }
+        batch_output output() const { return m_output; }
+
+        /**
+         * Blocks until the next batch is ready and hands it over
+         * The last batch of an epoch may be smaller than batch_size.
+         *
+         * @param images Receives the batch images
+         * @param labels Receives the batch numeric labels
+         * @throw dlib::error if the loader was created for batch_output::tensor
+         */
+        void get_batch(
+            std::vector<matrix<rgb_pixel>>& images,
+            std::vector<unsigned long>& labels
+        )
+        {
+            if (m_output != batch_output::images)
+                throw dlib::error("This imagenet_batch_loader serves tensors: create it with batch_output::images to get images");
+            batch b = next_batch();
+            images.swap(b.images);
+            labels.swap(b.labels);
+            recycle(std::move(b));
+        }
+
+        /**
+         * Same as above but hands the batch over as a (n, 3, rows, cols) tensor of
+         * normalized values, as produced by input_rgb_image. The workers already
+         * assembled the tensor data, so this only copies it.
+         *
+         * @param data Receives the batch images
+         * @param labels Receives the batch numeric labels
+         * @throw dlib::error if the loader was created for batch_output::images
+         */
+        void get_batch(
+            resizable_tensor& data,
+            std::vector<unsigned long>& labels
+        )
+        {
+            if (m_output != batch_output::tensor)
+                throw dlib::error("This imagenet_batch_loader serves images: create it with batch_output::tensor to get tensors");
+            batch b = next_batch();
+            data.set_size(b.labels.size(), 3, b.rows, b.cols);
+            std::memcpy(data.host(), b.planar.data(), b.planar.size() * sizeof(float));
+            labels.swap(b.labels);
+            recycle(std::move(b));
+        }
+
+    private:
+        struct batch
+        {
+            size_t id = 0;
+            std::vector<matrix<rgb_pixel>> images;
+            std::vector<matrix<rgb_pixel>> spare; // Buffers of the images a short batch does not use
+            std::vector<float> planar;            // CHW samples of tensor batches
+            long rows = 0;                        // Image size of tensor batches
+            long cols = 0;
+            std::vector<unsigned long> labels;
+            std::exception_ptr error;
+        };
+
+        /**
+         * Blocks until the batch following the last delivered one is ready
+         */
+        batch next_batch()
+        {
+            // Workers may finish out of order: park early batches in the slot of their id
+            const size_t slot = m_next_to_deliver % m_pending.size();
+            while (!m_parked[slot])
+            {
+                batch b;
+                if (!m_queue.dequeue(b))
+                    throw dlib::error("imagenet_batch_loader has been shut down");
+                if (b.error)
+                    std::rethrow_exception(b.error);
+                if (b.id == m_next_to_deliver)
+                {
+                    delivered();
+                    return b;
+                }
+                const size_t s = b.id % m_pending.size();
+                m_pending[s] = std::move(b);
+                m_parked[s] = 1;
+            }
+
+            batch b = std::move(m_pending[slot]);
+            m_parked[slot] = 0;
+            delivered();
+            return b;
+        }
+
+        /**
+         * Moves the window of batches the workers may build one batch further
+         */
+        void delivered()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_window_mutex);
+                ++m_next_to_deliver;
+            }
+            m_window_signal.notify_all();
+        }
+
+        /**
+         * Hands the next batch id to a worker once it fits in the ring of parked batches
+         *
+         * @return false if the loader is shutting down
+         */
+        bool next_batch_id(size_t& id)
+        {
+            std::unique_lock<std::mutex> lock(m_window_mutex);
+            id = m_next_to_build++;
+            m_window_signal.wait(lock, [&]() { return m_stop.load() || id < m_next_to_deliver + m_pending.size(); });
+            return !m_stop.load();
+        }
+
+        /**
+         * Gives the buffers of a delivered batch back to the workers
+         */
+        void recycle(batch&& b)
+        {
+            std::lock_guard<std::mutex> lock(m_recycled_mutex);
+            if (m_recycled.size() < m_max_recycled)
+                m_recycled.push_back(std::move(b));
+        }
+
+        batch reuse_batch()
+        {
+            std::lock_guard<std::mutex> lock(m_recycled_mutex);
+            if (m_recycled.empty())
+                return batch();
+            batch b = std::move(m_recycled.back());
+            m_recycled.pop_back();
+            return b;
+        }
+
+        /**
+         * Returns the record order of an epoch, shuffling it the first time it is needed
+         */
+        std::shared_ptr<const std::vector<size_t>> epoch_order(size_t epoch)
+        {
+            std::lock_guard<std::mutex> lock(m_order_mutex);
+            auto& order = m_orders[epoch];
+            if (!order)
+            {
+                auto shuffled = std::make_shared<std::vector<size_t>>(m_indices);
+                impl::shuffle_indices(*shuffled, m_seed + epoch);
+                order = shuffled;
+                // Workers never run more than a few batches ahead, so older epochs are done
+                while (m_orders.begin()->first + 1 < epoch)
+                    m_orders.erase(m_orders.begin());
+            }
+            return order;
+        }
+
+        void worker_loop()
+        {
+            const bool augment = m_augmentation.enabled();
+            const bool jitter = m_augmentation.brightness > 0 || m_augmentation.contrast > 0 || m_augmentation.saturation > 0;
+            const bool tensor = m_output == batch_output::tensor;
+            const long rows = m_mapped->nr(), cols = m_mapped->nc();
+            const long out_rows = augment && m_augmentation.crop_rows > 0 ? m_augmentation.crop_rows : rows;
+            const long out_cols = augment && m_augmentation.crop_cols > 0 ? m_augmentation.crop_cols : cols;
+            const size_t sample_size = static_cast<size_t>(3 * out_rows * out_cols);
+            std::mt19937_64 rng;
+            matrix<rgb_pixel> scratch, augmented;
+            while (!m_stop.load())
+            {
+                batch b = reuse_batch();
+                if (!next_batch_id(b.id))
+                    return;
+                b.error = nullptr;
+                try
+                {
+                    const auto order = epoch_order(b.id / m_batches_per_epoch);
+                    const size_t begin = (b.id % m_batches_per_epoch) * m_batch_size;
+                    const size_t end = std::min(begin + m_batch_size, order->size());
+                    if (tensor)
+                    {
+                        b.planar.resize((end - begin) * sample_size);
+                        b.rows = out_rows;
+                        b.cols = out_cols;
+                    }
+                    else
+                    {
+                        while (b.images.size() > end - begin)
+                        {
+                            b.spare.push_back(std::move(b.images.back()));
+                            b.images.pop_back();
+                        }
+                        while (b.images.size() < end - begin && !b.spare.empty())
+                        {
+                            b.images.push_back(std::move(b.spare.back()));
+                            b.spare.pop_back();
+                        }
+                        b.images.resize(end - begin);
+                    }
+                    b.labels.resize(end - begin);
+                    rng.seed(m_seed ^ (0x9E3779B97F4A7C15ull * (b.id + 1)));
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        const size_t idx = (*order)[i];
+                        b.labels[i - begin] = m_mapped->numeric_label(idx);
+                        if (augment)
+                        {
+                            // Crop straight from the mapping when it is interleaved
+                            const rgb_pixel* src;
+                            if (m_mapped->layout() == pixel_layout::interleaved)
+                            {
+                                src = m_mapped->pixels(idx);
+                            }
+                            else
+                            {
+                                m_mapped->copy_image(idx, scratch);
+                                src = scratch.size() != 0 ? &scratch(0, 0) : nullptr;
+                            }
+                            if (rows == 0 || cols == 0)
+                                throw dlib::error("Cannot augment an empty image (record " + std::to_string(idx) + ")");
+                            matrix<rgb_pixel>& out = tensor ? augmented : b.images[i - begin];
+                            impl::random_crop(src, rows, cols, m_augmentation, rng, out);
+                            if (jitter)
+                                impl::random_color_jitter(out, m_augmentation, rng);
+                            if (tensor)
+                            {
+                                impl::interleaved_to_planar_float(&out(0, 0), out.size(), impl::input_rgb_mean,
+                                    impl::input_rgb_scale, b.planar.data() + (i - begin) * sample_size);
+                            }
+                        }
+                        else if (tensor)
+                        {
+                            m_mapped->copy_planar(idx, b.planar.data() + (i - begin) * sample_size);
+                        }
+                        else
+                        {
+                            m_mapped->copy_image(idx, b.images[i - begin]);
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    b.error = std::current_exception();
+                }
+
+                if (!m_queue.enqueue(b))
+                    return;
+            }
+        }
+
+        const size_t m_batch_size;
+        std::vector<size_t> m_indices;
+        size_t m_batches_per_epoch = 0;
+        unsigned long m_seed = 0;
+        const batch_output m_output;
+        const imagenet_augmentation m_augmentation;
+
+        std::unique_ptr<mapped_imagenet_dataset> m_mapped;
+
+        const size_t m_max_recycled;
+        std::mutex m_recycled_mutex;
+        std::vector<batch> m_recycled;
+
+        std::mutex m_order_mutex;
+        std::map<size_t, std::shared_ptr<const std::vector<size_t>>> m_orders;
+
+        dlib::pipe<batch> m_queue;
+        std::vector<batch> m_pending;   // Batches finished early, in slot id % m_pending.size()
+        std::vector<char> m_parked;
+        std::mutex m_window_mutex;
+        std::condition_variable m_window_signal;
+        size_t m_next_to_build = 0;     // Guarded by m_window_mutex
+        size_t m_next_to_deliver = 0;   // Guarded by m_window_mutex, only changed by next_batch()
+        std::atomic<bool> m_stop{false};
+        std::vector<std::thread> m_workers;
+    };
+
+    namespace impl
+    {
+        /**
+         * @return Peak resident set size of the process in bytes (0 if unknown)
+         */
+        inline uint64 peak_rss_bytes()
+        {
+#ifdef _WIN32
+            PROCESS_MEMORY_COUNTERS counters;
+            if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+                return counters.PeakWorkingSetSize;
+            return 0;
+#else
+            struct rusage usage;
+            if (getrusage(RUSAGE_SELF, &usage) != 0)
+                return 0;
+#ifdef __APPLE__
+            return static_cast<uint64>(usage.ru_maxrss);        // bytes
+#else
+            return static_cast<uint64>(usage.ru_maxrss) * 1024; // kilobytes
+#endif
+#endif
+        }
+
+        inline double seconds_since(std::chrono::steady_clock::time_point start)
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    /**
+     * Timing of one benchmark stage
+     */
+    struct imagenet_benchmark_stage
+    {
+        std::string name;       // e.g. "decode", "resize 224x224", "load 224x224"
+        size_t images = 0;      // Images handled by the stage
+        uint64 bytes = 0;       // Bytes read or written by the stage (0 if not meaningful)
+        double seconds = 0;     // Wall time spent in the stage
+
+        double images_per_second() const { return seconds > 0 ? images / seconds : 0; }
+        double mb_per_second() const { return seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0; }
+    };
+
+    /**
+     * Outcome of run_imagenet_benchmark()
+     */
+    struct imagenet_benchmark_results
+    {
+        std::vector<imagenet_benchmark_stage> stages;
+        size_t failed_images = 0; // Sampled images that could not be decoded
+        uint64 peak_rss = 0;      // Peak resident set size of the process, in bytes
+    };
+
+    /**
+     * Prints benchmark results as a table
+     */
+    void print_benchmark_results(const imagenet_benchmark_results& results, std::ostream& out)
+    {
+        out << std::left << std::setw(22) << "stage" << std::right
+            << std::setw(10) << "images" << std::setw(12) << "seconds"
+            << std::setw(14) << "images/s" << std::setw(12) << "MB/s" << std::endl;
+        for (const auto& stage : results.stages)
+        {
+            out << std::left << std::setw(22) << stage.name << std::right
+                << std::setw(10) << stage.images
+                << std::setw(12) << std::fixed << std::setprecision(3) << stage.seconds
+                << std::setw(14) << std::setprecision(1) << stage.images_per_second();
+            if (stage.bytes != 0)
+                out << std::setw(12) << std::setprecision(1) << stage.mb_per_second();
+            out << std::endl;
+        }
+        out.unsetf(std::ios::floatfield);
+        out << std::setprecision(6);
+        if (results.failed_images != 0)
+            out << "Images that failed to decode: " << results.failed_images << std::endl;
+        if (results.peak_rss != 0)
+            out << "Peak RSS: " << results.peak_rss / (1024 * 1024) << " MB" << std::endl;
+    }
+
+    /**
+     * Measures the throughput of each step of a build and of loading its output
+     *
+     * Up to max_images images, spread evenly over the listing, go through every stage
+     * one after the other on the calling thread, so the numbers are per core and
+     * comparable between runs. No stage is warmed up beforehand:
+     *   - read: raw file bytes, from the disk unless an earlier run left the files
+     *     in the page cache; this pass puts them there
+     *   - read (warm): the same files again, from the page cache. Every later stage
+     *     that touches the files reads them warm, so compare this one with decode.
+     *   - decode: load_image(), or load_image_scaled() with options.jpeg_dct_scaling
+     *   - resize <size>: resize_rgb_image_bilinear() from the decoded image
+     *   - resize (dlib) <size>: resize_image() with interpolate_bilinear plus
+     *     assign_image(), the resize builds use without options.fixed_point_resize
+     *   - serialize <size>: writing the dataset file in options.format, from the
+     *     images of the resize the build would use
+     *   - load / split / load+split <size>: load_imagenet_dataset(),
+     *     split_imagenet_dataset() and load_stable_imagenet_1k() on that file
+     * The decoded sample is kept in memory between stages, which is what peak_rss
+     * mostly measures. The dataset files are written next to scratch_file (one per
+     * size, named as by get_sized_output_file) and removed at the end.
+     *
+     * @param images_folder Root directory containing class subdirectories
+     * @param scratch_file Path of the temporary dataset file(s)
+     * @param options Output sizes, format, layout and decoding options
+     * @param max_images Number of images sampled from the listing
+     */
+    imagenet_benchmark_results run_imagenet_benchmark(
+        const std::string& images_folder,
+        const std::string& scratch_file,
+        const imagenet_build_options& options,
+        size_t max_images = 1000
     )
     {
-        imagenet_dataset dataset;
-        deserialize(dataset_file) >> dataset.images >> dataset.labels >> dataset.numeric_labels;
+        using clock = std::chrono::steady_clock;
+        imagenet_benchmark_results results;
+        check_build_sizes(options.sizes);
 
-        // Create indices for shuffling
-        std::vector<size_t> indices(dataset.images.size());
-        for (size_t i = 0; i < indices.size(); ++i) indices[i] = i;
+        const std::vector<imagenet_info> listing = get_imagenet_listing(images_folder, options.scan_threads);
+        if (listing.empty())
+            throw dlib::error("No images found in: " + images_folder);
+        std::vector<const imagenet_info*> sample;
+        const size_t count = std::min(std::max<size_t>(1, max_images), listing.size());
+        for (size_t i = 0; i < count; ++i)
+            sample.push_back(&listing[i * listing.size() / count]);
 
-        // Shuffle indices for random train/test split
-        std::random_device rd;
-        std::mt19937 g(rd());
-        std::shuffle(indices.begin(), indices.end(), g);
+        long min_rows = 0, min_cols = 0;
+        for (const auto& size : options.sizes)
+        {
+            min_rows = std::max(min_rows, size.first);
+            min_cols = std::max(min_cols, size.second);
+        }
 
-        size_t split_point = static_cast<size_t>(dataset.images.size() * (1.0 - test_fraction));
+        imagenet_benchmark_stage read{"read"}, warm_read{"read (warm)"}, decode{"decode"};
+        for (auto* stage : {&read, &warm_read})
+        {
+            const auto start = clock::now();
+            for (const auto* info : sample)
+                stage->bytes += impl::read_file_bytes(info->filename).size();
+            stage->seconds = impl::seconds_since(start);
+            stage->images = sample.size();
+        }
 
-        // Reserve space for efficiency
-        training_images.clear();
-        training_labels.clear();
-        testing_images.clear();
-        testing_labels.clear();
-        training_images.reserve(split_point);
-        training_labels.reserve(split_point);
-        testing_images.reserve(dataset.images.size() - split_point);
-        testing_labels.reserve(dataset.images.size() - split_point);
+        std::vector<matrix<rgb_pixel>> decoded;
+        std::vector<const imagenet_info*> decoded_info;
+        auto start = clock::now();
+        for (const auto* info : sample)
+        {
+            matrix<rgb_pixel> img;
+            try
+            {
+                if (options.jpeg_dct_scaling)
+                    load_image_scaled(img, info->filename, min_rows, min_cols);
+                else
+                    load_image(img, info->filename);
+            }
+            catch (const std::exception&)
+            {
+                ++results.failed_images;
+                continue;
+            }
+            decoded.push_back(std::move(img));
+            decoded_info.push_back(info);
+        }
+        decode.seconds = impl::seconds_since(start);
+        decode.images = decoded.size();
+        results.stages.push_back(read);
+        results.stages.push_back(warm_read);
+        results.stages.push_back(decode);
+        if (decoded.empty())
+            throw dlib::error("None of the sampled images could be decoded");
 
-        // Split into training and testing sets
-        for (size_t i = 0; i < indices.size(); ++i)
+        std::vector<std::string> files;
+        for (size_t k = 0; k < options.sizes.size(); ++k)
         {
-            size_t idx = indices[i];
+            const long rows = options.sizes[k].first, cols = options.sizes[k].second;
+            const std::string tag = std::to_string(rows) + "x" + std::to_string(cols);
 
-            if (i < split_point)
+            imagenet_benchmark_stage resize{"resize " + tag};
+            std::vector<matrix<rgb_pixel>> resized(decoded.size());
+            start = clock::now();
+            for (size_t i = 0; i < decoded.size(); ++i)
             {
-                training_images.push_back(dataset.images[idx]);
-                training_labels.push_back(dataset.numeric_labels[idx]);
+                resized[i].set_size(rows, cols);
+                resize_rgb_image_bilinear(decoded[i], resized[i]);
             }
-            else
+            resize.seconds = impl::seconds_since(start);
+            resize.images = resized.size();
+            results.stages.push_back(resize);
+
+            imagenet_benchmark_stage dlib_resize{"resize (dlib) " + tag};
+            std::vector<matrix<rgb_pixel>> dlib_resized(decoded.size());
+            start = clock::now();
+            for (size_t i = 0; i < decoded.size(); ++i)
+            {
+                matrix<rgb_pixel> img(rows, cols);
+                resize_image(decoded[i], img, interpolate_bilinear());
+                assign_image(dlib_resized[i], img);
+            }
+            dlib_resize.seconds = impl::seconds_since(start);
+            dlib_resize.images = dlib_resized.size();
+            results.stages.push_back(dlib_resize);
+            if (!options.fixed_point_resize)
+                resized.swap(dlib_resized);
+            dlib_resized.clear();
+
+            const std::string filename = get_sized_output_file(scratch_file, options, k);
+            files.push_back(filename);
+            imagenet_benchmark_stage write{"serialize " + tag};
+            start = clock::now();
             {
-                testing_images.push_back(dataset.images[idx]);
-                testing_labels.push_back(dataset.numeric_labels[idx]);
+                auto writer = make_dataset_writer(filename, options.format, rows, cols, options.layout);
+                for (size_t i = 0; i < resized.size(); ++i)
+                    writer->write(resized[i], decoded_info[i]->label, decoded_info[i]->numeric_label);
+                writer->close();
             }
+            write.seconds = impl::seconds_since(start);
+            write.images = resized.size();
+            write.bytes = impl::file_size_bytes(filename);
+            results.stages.push_back(write);
         }
+
+        for (size_t k = 0; k < options.sizes.size(); ++k)
+        {
+            const std::string tag = std::to_string(options.sizes[k].first) + "x" + std::to_string(options.sizes[k].second);
+            const uint64 bytes = impl::file_size_bytes(files[k]);
+
+            imagenet_benchmark_stage load{"load " + tag}, split{"split " + tag}, both{"load+split " + tag};
+            imagenet_dataset dataset;
+            start = clock::now();
+            load_imagenet_dataset(files[k], dataset);
+            load.seconds = impl::seconds_since(start);
+            load.images = dataset.size();
+            load.bytes = bytes;
+
+            start = clock::now();
+            const imagenet_split s = split_imagenet_dataset(dataset.size(), 0.05, 0);
+            split.seconds = impl::seconds_since(start);
+            split.images = s.training.size() + s.testing.size();
+            dataset = imagenet_dataset();
+
+            std::vector<matrix<rgb_pixel>> training_images, testing_images;
+            std::vector<unsigned long> training_labels, testing_labels;
+            start = clock::now();
+            load_stable_imagenet_1k(files[k], training_images, training_labels, testing_images, testing_labels, 0.05, 0);
+            both.seconds = impl::seconds_since(start);
+            both.images = training_images.size() + testing_images.size();
+            both.bytes = bytes;
+
+            results.stages.push_back(load);
+            results.stages.push_back(split);
+            results.stages.push_back(both);
+        }
+
+        for (const auto& filename : files)
+            std::remove(filename.c_str());
+        results.peak_rss = impl::peak_rss_bytes();
+        return results;
     }
 }
 
-/**
- * Main program for creating an ImageNet dataset
- */
-int main(int argc, char** argv)
+namespace
 {
-    try
+    /**
+     * build: creates the dataset(s), then checks each output file with a streaming
+     * verify unless --no-verify is given
+     */
+    int build_command(int argc, char** argv, const std::string& program)
     {
-        // Setup interrupt handling for clean termination
-        setup_interrupt_handler();
+        dlib::command_line_parser parser;
+        parser.add_option("threads", "Number of worker threads used to decode and resize images (default: 1, 0 = all cores).", 1);
+        parser.add_option("scan-threads", "Number of class directories listed concurrently (default: 8).", 1);
+        parser.add_option("io-threads", "Number of threads reading files ahead of the decode (default: 4, 0 = read in the decode threads).", 1);
+        parser.add_option("prefetch", "Number of files read ahead of the decode (default: 64).", 1);
+        parser.add_option("no-listing-cache", "Always rescan the image directory instead of reusing <output_file>.listing when no directory changed.");
+        parser.add_option("retry-failed", "Decode again the images that failed in an earlier build (listed in <output_file>.skip).");
+        parser.add_option("dedup", "Drop duplicate images: exact (same file bytes) or perceptual (difference hashes at most 3 bits apart, catches re-encoded copies).", 1);
+        parser.add_option("dedup-keep", "With --dedup, only report the duplicates and write them anyway.");
+        parser.add_option("dedup-report", "With --dedup, write one 'duplicate<TAB>original' line per duplicate to this file.", 1);
+        parser.add_option("format", "Output format: stream (default), fixed (memory-mappable, fixed stride) or compressed (zlib chunks, parallel loading).", 1);
+        parser.add_option("layout", "Pixel layout of fixed files: interleaved (default), planar (CHW bytes) or planar-float (normalized CHW floats).", 1);
+        parser.add_option("checkpoint-dir", "Keep per-class shards in this directory so that an interrupted or repeated build only processes new or changed images.", 1);
+        parser.add_option("shards", "Write the dataset as N class-balanced shard files; <output_file> then becomes the shard index.", 1);
+        parser.add_option("jpeg-dct-scaling", "Let libjpeg decode large JPEGs directly at 1/2, 1/4 or 1/8 scale (never below the output size), then resize.");
+        parser.add_option("fixed-point-resize", "Resize with the vectorized 8-bit fixed point bilinear resize instead of dlib's resize_image (pixels differ by up to 2 levels).");
+        parser.add_option("stats", "Print read/decode/resize/write throughput and p50/p99 latencies with each progress line.");
+        parser.add_option("stats-json", "Write the final per-stage timings and the slowest images to this JSON file.", 1);
+        parser.add_option("benchmark", "Instead of building, time each stage on N images of <image_directory>; <output_file> is only used as a scratch file.", 1);
+        parser.add_option("no-verify", "Do not read the written files back to check them.");
+        parser.add_option("h", "Display this help message.");
+        parser.parse(argc, argv);
 
-        if (argc != 4)
+        if (parser.option("h") || parser.number_of_arguments() != 3)
         {
-            std::cout << "Usage: " << argv[0] << " <image_directory> <output_file> <image_size>" << std::endl;
-            std::cout << "Example: " << argv[0] << " imagenet_train imagenet.dat 224" << std::endl;
+            std::cout << "Usage: " << program << " build [options] <image_directory> <output_file> <image_size>[,<image_size>...]" << std::endl;
+            std::cout << "Example: " << program << " build --threads 8 imagenet_train imagenet.dat 224" << std::endl;
+            std::cout << "Example: " << program << " build --threads 8 imagenet_train imagenet.dat 32,64,128  (writes imagenet_32.dat, ...)" << std::endl;
+            parser.print_options();
             return 1;
         }
 
-        std::string image_directory(argv[1]);
-        std::string output_file(argv[2]);
-        long image_size = std::stol(argv[3]);
+        std::string image_directory(parser[0]);
+        std::string output_file(parser[1]);
+        std::vector<long> image_sizes;
+        {
+            std::istringstream sizes(parser[2]);
+            std::string size;
+            while (std::getline(sizes, size, ','))
+            {
+                size_t used = 0;
+                try { image_sizes.push_back(std::stol(size, &used)); }
+                catch (const std::exception&) { used = 0; }
+                if (used == 0 || used != size.size())
+                    throw dlib::error("Invalid image size '" + size + "' in " + parser[2]);
+            }
+        }
+        unsigned long num_threads = dlib::get_option(parser, "threads", 1ul);
+        if (num_threads == 0)
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        dlib::dataset_format format = dlib::parse_dataset_format(dlib::get_option(parser, "format", "stream"));
 
         std::cout << "Creating ImageNet dataset with parameters:" << std::endl;
         std::cout << "  Image directory: " << image_directory << std::endl;
         std::cout << "  Output file: " << output_file << std::endl;
-        std::cout << "  Image size: " << image_size << "x" << image_size << std::endl;
+        for (long image_size : image_sizes)
+            std::cout << "  Image size: " << image_size << "x" << image_size << std::endl;
+        std::cout << "  Threads: " << num_threads << std::endl;
+        std::cout << "  Format: " << dlib::get_option(parser, "format", "stream") << std::endl;
+
+        dlib::imagenet_build_options options;
+        options.sizes.clear();
+        for (long image_size : image_sizes)
+            options.sizes.emplace_back(image_size, image_size);
+        dlib::check_build_sizes(options.sizes);
+        options.num_threads = num_threads;
+        options.scan_threads = dlib::get_option(parser, "scan-threads", 8ul);
+        options.io_threads = dlib::get_option(parser, "io-threads", 4ul);
+        options.prefetch = dlib::get_option(parser, "prefetch", 64ul);
+        options.format = format;
+        options.checkpoint_dir = dlib::get_option(parser, "checkpoint-dir", "");
+        options.num_shards = dlib::get_option(parser, "shards", 1ul);
+        options.jpeg_dct_scaling = parser.option("jpeg-dct-scaling").count() > 0;
+        options.fixed_point_resize = parser.option("fixed-point-resize").count() > 0;
+        options.listing_cache = parser.option("no-listing-cache").count() == 0;
+        options.skip_failed = parser.option("retry-failed").count() == 0;
+        options.dedup = dlib::parse_dedup_mode(dlib::get_option(parser, "dedup", "none"));
+        options.keep_duplicates = parser.option("dedup-keep").count() > 0;
+        options.dedup_report = dlib::get_option(parser, "dedup-report", "");
+        options.print_stats = parser.option("stats").count() > 0;
+        options.stats_file = dlib::get_option(parser, "stats-json", "");
+        options.layout = dlib::parse_pixel_layout(dlib::get_option(parser, "layout", "interleaved"));
+        if (options.layout != dlib::pixel_layout::interleaved)
+        {
+            if (format != dlib::dataset_format::fixed)
+                throw dlib::error("--layout " + dlib::get_option(parser, "layout", "interleaved") + " requires --format fixed");
+            std::cout << "  Layout: " << dlib::get_option(parser, "layout", "interleaved") << std::endl;
+        }
+        if (options.jpeg_dct_scaling)
+            std::cout << "  JPEG DCT scaling: on" << std::endl;
+        if (options.fixed_point_resize)
+            std::cout << "  Fixed point resize: on" << std::endl;
+        if (options.num_shards > 1)
+            std::cout << "  Shards: " << options.num_shards << std::endl;
+        if (!options.checkpoint_dir.empty())
+            std::cout << "  Checkpoint directory: " << options.checkpoint_dir << std::endl;
+
+        if (parser.option("benchmark"))
+        {
+            const size_t max_images = dlib::get_option(parser, "benchmark", 1000ul);
+            std::cout << "  Benchmark: " << max_images << " images" << std::endl << std::endl;
+            dlib::print_benchmark_results(dlib::run_imagenet_benchmark(image_directory, output_file, options, max_images), std::cout);
+            return 0;
+        }
 
         // Create the dataset
-        dlib::create_imagenet_dataset(image_directory, output_file, image_size, image_size);
+        if (!dlib::create_imagenet_dataset(image_directory, output_file, options))
+            return 1;
+        if (parser.option("no-verify"))
+            return 0;
+
+        bool ok = true;
+        for (size_t k = 0; k < options.sizes.size(); ++k)
+        {
+            const std::string filename = dlib::get_sized_output_file(output_file, options, k);
+            std::cout << "Verifying " << filename << "..." << std::endl;
+            const dlib::imagenet_verify_report report = dlib::verify_imagenet_dataset(filename);
+            dlib::print_verify_report(report, std::cout);
+            dlib::print_imagenet_stats(dlib::read_imagenet_stats(filename), std::cout);
+            ok = ok && report.ok();
+        }
+        return ok ? 0 : 1;
+    }
 
-        // Now load and evaluate the dataset
-        std::vector<dlib::matrix<dlib::rgb_pixel>> training_images, testing_images;
-        std::vector<unsigned long> training_labels, testing_labels;
+    /**
+     * verify: streams through dataset files and checks their records
+     */
+    int verify_command(int argc, char** argv, const std::string& program)
+    {
+        dlib::command_line_parser parser;
+        parser.add_option("h", "Display this help message.");
+        parser.parse(argc, argv);
 
-        // Now load with train/test split
-        dlib::load_stable_imagenet_1k(output_file, training_images, training_labels,
-            testing_images, testing_labels);
+        if (parser.option("h") || parser.number_of_arguments() == 0)
+        {
+            std::cout << "Usage: " << program << " verify <dataset_file> [<dataset_file>...]" << std::endl;
+            parser.print_options();
+            return 1;
+        }
 
-        // Create a window for displaying images
-        dlib::image_window win;
+        bool ok = true;
+        for (unsigned long i = 0; i < parser.number_of_arguments(); ++i)
+        {
+            std::cout << "Verifying " << parser[i] << "..." << std::endl;
+            const dlib::imagenet_verify_report report = dlib::verify_imagenet_dataset(parser[i]);
+            dlib::print_verify_report(report, std::cout);
+            dlib::print_imagenet_stats(dlib::read_imagenet_stats(parser[i]), std::cout);
+            ok = ok && report.ok();
+        }
+        return ok ? 0 : 1;
+    }
 
-        // Display training set info
-        std::cout << "\nTraining set (" << training_images.size() << " images):" << std::endl;
-        size_t num_to_show = std::min((size_t)3, training_images.size());
+    /**
+     * merge: concatenates dataset files without decoding their images, then checks
+     * the result unless --no-verify is given
+     */
+    int merge_command(int argc, char** argv, const std::string& program)
+    {
+        dlib::command_line_parser parser;
+        parser.add_option("no-verify", "Do not read the merged file back to check it.");
+        parser.add_option("h", "Display this help message.");
+        parser.parse(argc, argv);
 
-        for (size_t i = 0; i < num_to_show; ++i)
+        if (parser.option("h") || parser.number_of_arguments() < 2)
         {
-            std::cout << "  Image " << i + 1 << " - Label: " << training_labels[i] << std::endl;
+            std::cout << "Usage: " << program << " merge [options] <output_file> <dataset_file> [<dataset_file>...]" << std::endl;
+            std::cout << "Example: " << program << " merge imagenet_all.dat imagenet.dat new_classes.dat" << std::endl;
+            std::cout << "The first file keeps its numeric labels, the classes of the others are matched by name." << std::endl;
+            parser.print_options();
+            return 1;
+        }
 
-            // Display the image
-            win.set_image(training_images[i]);
-            win.set_title("Training Image #" + std::to_string(i + 1));
-            std::cout << "    Press enter to continue..." << std::endl;
-            std::cin.ignore();
+        const std::string output_file(parser[0]);
+        std::vector<std::string> input_files;
+        for (unsigned long i = 1; i < parser.number_of_arguments(); ++i)
+            input_files.push_back(parser[i]);
+
+        std::cout << "Merging " << input_files.size() << " dataset files into " << output_file << "..." << std::endl;
+        const auto start = std::chrono::steady_clock::now();
+        const size_t images = dlib::merge_imagenet_datasets(input_files, output_file);
+        std::cout << "Dataset saved successfully! (" << images << " images in "
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s)" << std::endl;
+        if (parser.option("no-verify"))
+            return 0;
+
+        std::cout << "Verifying " << output_file << "..." << std::endl;
+        const dlib::imagenet_verify_report report = dlib::verify_imagenet_dataset(output_file);
+        dlib::print_verify_report(report, std::cout);
+        dlib::print_imagenet_stats(dlib::read_imagenet_stats(output_file), std::cout);
+        return report.ok() ? 0 : 1;
+    }
+
+    /**
+     * view: shows a random sample of the images of a dataset file
+     */
+    int view_command(int argc, char** argv, const std::string& program)
+    {
+        dlib::command_line_parser parser;
+        parser.add_option("count", "Number of images to show (default: 6).", 1);
+        parser.add_option("seed", "Seed of the random sample (default: random).", 1);
+        parser.add_option("h", "Display this help message.");
+        parser.parse(argc, argv);
+
+        if (parser.option("h") || parser.number_of_arguments() != 1)
+        {
+            std::cout << "Usage: " << program << " view [options] <dataset_file>" << std::endl;
+            parser.print_options();
+            return 1;
         }
 
-        // Display testing set info
-        std::cout << "\nTesting set (" << testing_images.size() << " images):" << std::endl;
-        num_to_show = std::min((size_t)3, testing_images.size());
+        std::vector<dlib::matrix<dlib::rgb_pixel>> images;
+        std::vector<std::string> labels;
+        std::vector<unsigned long> numeric_labels;
+        const unsigned long seed = dlib::get_option(parser, "seed", (unsigned long)std::random_device()());
+        dlib::sample_imagenet_dataset(parser[0], dlib::get_option(parser, "count", 6ul), seed,
+            images, labels, numeric_labels);
 
-        for (size_t i = 0; i < num_to_show; ++i)
+        // Create a window for displaying images
+        dlib::image_window win;
+        for (size_t i = 0; i < images.size() && !g_terminate_flag.load(); ++i)
         {
-            std::cout << "  Image " << i + 1 << " - Label: " << testing_labels[i] << std::endl;
+            std::cout << "  Image " << i + 1 << " - Label: " << numeric_labels[i] << " (" << labels[i] << ")" << std::endl;
 
             // Display the image
-            win.set_image(testing_images[i]);
-            win.set_title("Testing Image #" + std::to_string(i + 1));
+            win.set_image(images[i]);
+            win.set_title("Image #" + std::to_string(i + 1) + " - " + labels[i]);
             std::cout << "    Press enter to continue..." << std::endl;
             std::cin.ignore();
         }
-
-        std::cout << "\nDataset evaluation complete." << std::endl;
         return 0;
     }
+}
+
+/**
+ * Main program for creating, checking and viewing ImageNet datasets
+ *
+ * The first argument selects the command (build, verify, merge or view); without one the
+ * arguments are those of build, as in earlier versions of the tool.
+ */
+int main(int argc, char** argv)
+{
+    try
+    {
+        // Setup interrupt handling for clean termination
+        setup_interrupt_handler();
+
+        const std::string program = argv[0];
+        const std::string command = argc > 1 ? argv[1] : "";
+        if (command == "verify")
+            return verify_command(argc - 1, argv + 1, program);
+        if (command == "view")
+            return view_command(argc - 1, argv + 1, program);
+        if (command == "merge")
+            return merge_command(argc - 1, argv + 1, program);
+        if (command == "build")
+            return build_command(argc - 1, argv + 1, program);
+        if (argc <= 1 || command == "-h" || command == "--help")
+        {
+            std::cout << "Usage: " << program << " <command> [options] ..." << std::endl;
+            std::cout << "Commands:" << std::endl;
+            std::cout << "  build   Create a dataset from a directory of class subdirectories" << std::endl;
+            std::cout << "  verify  Check the records of dataset files without loading them" << std::endl;
+            std::cout << "  merge   Concatenate dataset files without decoding their images" << std::endl;
+            std::cout << "  view    Show random images of a dataset file" << std::endl;
+            std::cout << "Run '" << program << " <command> -h' for the options of a command." << std::endl;
+            return 1;
+        }
+        return build_command(argc, argv, program);
+    }
     catch (std::exception& e)
     {
         std::cerr << "Error: " << e.what() << std::endl;